@@ -0,0 +1,114 @@
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+
+#include <boost/asio/post.hpp>
+#include <spdlog/spdlog.h>
+
+#include "affinity.hpp"
+
+namespace ezio
+{
+bool parse_cpu_list(std::string const &list, std::vector<int> &cpus)
+{
+	std::vector<int> result;
+	std::size_t pos = 0;
+	while (pos < list.size()) {
+		std::size_t end = list.find(',', pos);
+		if (end == std::string::npos) {
+			end = list.size();
+		}
+
+		std::string const range = list.substr(pos, end - pos);
+		pos = end + 1;
+		if (range.empty()) {
+			continue;
+		}
+
+		char *p = nullptr;
+		long const first = strtol(range.c_str(), &p, 10);
+		long last = first;
+		if (p == range.c_str()) {
+			return false;
+		}
+		if (*p == '-') {
+			char const *second = p + 1;
+			last = strtol(second, &p, 10);
+			if (p == second) {
+				return false;
+			}
+		}
+		if (*p != '\0') {
+			return false;
+		}
+
+		if (first < 0 || last < first || last >= CPU_SETSIZE) {
+			return false;
+		}
+
+		for (int i = int(first); i <= int(last); i++) {
+			result.push_back(i);
+		}
+	}
+
+	cpus.swap(result);
+	return !cpus.empty();
+}
+
+bool numa_node_cpus(int node, std::vector<int> &cpus)
+{
+	std::ifstream f("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+	std::string list;
+	if (!std::getline(f, list)) {
+		return false;
+	}
+	return parse_cpu_list(list, cpus);
+}
+
+void pin_thread_pool(boost::asio::thread_pool &pool, int threads, std::vector<int> const &cpus)
+{
+	if (cpus.empty() || threads <= 0) {
+		return;
+	}
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int const cpu : cpus) {
+		CPU_SET(cpu, &set);
+	}
+
+	// each task blocks until all are started, so every thread runs exactly one
+	std::mutex m;
+	std::condition_variable cv;
+	int started = 0;
+	int done = 0;
+
+	for (int i = 0; i < threads; i++) {
+		boost::asio::post(pool, [&]() {
+			int const ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+			if (ret) {
+				SPDLOG_WARN("pthread_setaffinity_np: {}", strerror(ret));
+			}
+
+			std::unique_lock<std::mutex> l(m);
+			started++;
+			cv.notify_all();
+			cv.wait(l, [&]() {
+				return started == threads;
+			});
+			done++;
+			cv.notify_all();
+		});
+	}
+
+	std::unique_lock<std::mutex> l(m);
+	cv.wait(l, [&]() {
+		return done == threads;
+	});
+}
+
+}  // namespace ezio
@@ -0,0 +1,21 @@
+#ifndef __AFFINITY_HPP__
+#define __AFFINITY_HPP__
+
+#include <string>
+#include <vector>
+#include <boost/asio/thread_pool.hpp>
+
+namespace ezio
+{
+// parse cpu list like "0-3,8,10-11"
+bool parse_cpu_list(std::string const &list, std::vector<int> &cpus);
+
+// cpus of NUMA node from /sys/devices/system/node
+bool numa_node_cpus(int node, std::vector<int> &cpus);
+
+// pin all threads of pool to cpus, threads must be idle
+void pin_thread_pool(boost::asio::thread_pool &pool, int threads, std::vector<int> const &cpus);
+
+}  // namespace ezio
+
+#endif
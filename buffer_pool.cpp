@@ -1,7 +1,56 @@
+#include <cstring>
+#include <unordered_map>
+#include <sys/mman.h>
+
+#include <boost/assert.hpp>
+#include <spdlog/spdlog.h>
+
 #include "buffer_pool.hpp"
+#include "trace.hpp"
+
+// 2 MB
+#define HUGEPAGE_SIZE (2ULL * 1024 * 1024)
 
 namespace ezio
 {
+namespace
+{
+	// pools alive, thread caches check it before return blocks at thread exit
+	std::mutex g_pools_mutex;
+	std::unordered_map<std::uint64_t, buffer_pool *> g_pools;
+	std::atomic<std::uint64_t> g_next_pool_id{1};
+}  // namespace
+
+struct buffer_pool_thread_cache {
+	struct entry {
+		std::uint64_t pool_id;
+		std::vector<std::uint32_t> blocks;
+	};
+
+	std::vector<entry> entries;
+
+	~buffer_pool_thread_cache()
+	{
+		std::lock_guard<std::mutex> l(g_pools_mutex);
+		for (auto &e : entries) {
+			auto it = g_pools.find(e.pool_id);
+			if (it == g_pools.end()) {
+				continue;
+			}
+
+			buffer_pool *pool = it->second;
+			for (auto const index : e.blocks) {
+				pool->central_push(index);
+			}
+			pool->m_cached -= int(e.blocks.size());
+		}
+	}
+};
+
+namespace
+{
+	thread_local buffer_pool_thread_cache t_cache;
+}  // namespace
 
 void watermark_callback(std::vector<std::weak_ptr<libtorrent::disk_observer>> const &cbs)
 {
@@ -13,54 +62,240 @@ void watermark_callback(std::vector<std::weak_ptr<libtorrent::disk_observer>> co
 	}
 }
 
-buffer_pool::buffer_pool(libtorrent::io_context &ioc) :
+buffer_pool::buffer_pool(libtorrent::io_context &ioc, std::size_t pool_size, bool hugepage, std::size_t max_pool_size) :
 	m_ios(ioc),
 	m_size(0),
-	m_exceeded_max_size(false)
+	m_exceeded_max_size(false),
+	m_slab(nullptr),
+	m_slab_size(0),
+	m_free_head(0),
+	m_cached(0),
+	m_id(g_next_pool_id++)
 {
+	m_max_buffers = std::max<int>(int(std::max(pool_size, max_pool_size) / DEFAULT_BLOCK_SIZE), 8);
+	set_limit(std::max<int>(int(pool_size / DEFAULT_BLOCK_SIZE), 8));
+	m_max_cached = std::max(m_max_buffers / 64, THREAD_CACHE_SIZE);
+
+	m_slab_size = std::size_t(m_max_buffers) * DEFAULT_BLOCK_SIZE;
+
+	void *addr = MAP_FAILED;
+	if (hugepage) {
+		std::size_t const len = (m_slab_size + HUGEPAGE_SIZE - 1) / HUGEPAGE_SIZE * HUGEPAGE_SIZE;
+		addr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (addr != MAP_FAILED) {
+			m_slab_size = len;
+		} else {
+			SPDLOG_WARN("failed to allocate hugepage buffer pool, fallback to normal pages: {}", strerror(errno));
+		}
+	}
+
+	if (addr == MAP_FAILED) {
+		addr = mmap(nullptr, m_slab_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (addr == MAP_FAILED) {
+			SPDLOG_CRITICAL("failed to allocate buffer pool ({} bytes): {}", m_slab_size, strerror(errno));
+			exit(1);
+		}
+		if (hugepage) {
+			madvise(addr, m_slab_size, MADV_HUGEPAGE);
+		}
+	}
+	m_slab = static_cast<char *>(addr);
+
+	// link all blocks
+	m_next.reset(new std::atomic<std::uint32_t>[m_max_buffers]);
+	for (int i = 0; i < m_max_buffers; i++) {
+		m_next[i] = (i + 1 < m_max_buffers) ? std::uint32_t(i + 1) : nil;
+	}
+	m_free_head = 0;
+
+	std::lock_guard<std::mutex> l(g_pools_mutex);
+	g_pools.emplace(m_id, this);
 }
 
 buffer_pool::~buffer_pool()
 {
+	{
+		std::lock_guard<std::mutex> l(g_pools_mutex);
+		g_pools.erase(m_id);
+	}
+
+	munmap(m_slab, m_slab_size);
+}
+
+void buffer_pool::set_limit(int limit)
+{
+	m_limit = limit;
+	m_low_watermark = limit / 2;
+	m_high_watermark = limit / 8 * 7;
 }
 
-char *buffer_pool::allocate_buffer_impl(std::unique_lock<std::mutex> &l)
+void buffer_pool::enable_adaptive(std::size_t min_size, std::chrono::microseconds target_latency)
 {
-	// no memory
-	if (m_size >= BUFFER_COUNT) {
+	std::lock_guard<std::mutex> l(m_pool_mutex);
+	m_adaptive = true;
+	m_min_limit = std::min(std::max<int>(int(min_size / DEFAULT_BLOCK_SIZE), 8), m_limit.load());
+	m_target_latency = target_latency;
+	m_last_adjust = std::chrono::steady_clock::now();
+}
+
+void buffer_pool::record_latency(std::chrono::microseconds latency, int queued)
+{
+	// ewma with 1/8 weight
+	std::int64_t avg = m_latency_us;
+	std::int64_t const next = (avg == 0) ? latency.count() : avg + (latency.count() - avg) / 8;
+	m_latency_us.compare_exchange_strong(avg, next, std::memory_order_relaxed);
+
+	if (!m_adaptive) {
+		return;
+	}
+
+	std::unique_lock<std::mutex> l(m_pool_mutex, std::try_to_lock);
+	if (!l.owns_lock()) {
+		return;
+	}
+
+	auto const now = std::chrono::steady_clock::now();
+	if (now - m_last_adjust < std::chrono::milliseconds(ADAPTIVE_INTERVAL_MS)) {
+		return;
+	}
+	m_last_adjust = now;
+
+	std::int64_t const stalls = m_stalls;
+	bool const stalled = stalls != m_last_stalls;
+	m_last_stalls = stalls;
+	// disk is falling behind, more buffers only make the backlog longer
+	bool const rising = queued > m_last_queued;
+	m_last_queued = queued;
+
+	int const limit = m_limit;
+	int const step = std::max(limit >> ADAPTIVE_STEP_SHIFT, 1);
+	int next_limit = limit;
+	if (next > m_target_latency.count()) {
+		// disk can't keep up, smaller backlog keeps latency low for other peers
+		next_limit = std::max(limit - step, m_min_limit);
+	} else if (stalled && !rising) {
+		// disk is fast but peers are throttled, allow more in flight
+		next_limit = std::min(limit + step, m_max_buffers);
+	}
+
+	if (next_limit != limit) {
+		SPDLOG_DEBUG("buffer pool limit {} -> {} blocks, latency {} us, {} blocks queued", limit, next_limit, next, queued);
+		set_limit(next_limit);
+	}
+}
+
+std::uint32_t buffer_pool::central_pop()
+{
+	std::uint64_t head = m_free_head.load(std::memory_order_acquire);
+	while (true) {
+		std::uint32_t const index = std::uint32_t(head);
+		if (index == nil) {
+			return nil;
+		}
+
+		std::uint64_t const tag = (head >> 32) + 1;
+		std::uint64_t const next = (tag << 32) | m_next[index].load(std::memory_order_relaxed);
+		if (m_free_head.compare_exchange_weak(head, next, std::memory_order_acq_rel, std::memory_order_acquire)) {
+			return index;
+		}
+	}
+}
+
+void buffer_pool::central_push(std::uint32_t index)
+{
+	std::uint64_t head = m_free_head.load(std::memory_order_relaxed);
+	while (true) {
+		m_next[index].store(std::uint32_t(head), std::memory_order_relaxed);
+		std::uint64_t const tag = (head >> 32) + 1;
+		std::uint64_t const next = (tag << 32) | index;
+		if (m_free_head.compare_exchange_weak(head, next, std::memory_order_release, std::memory_order_relaxed)) {
+			return;
+		}
+	}
+}
+
+std::vector<std::uint32_t> &buffer_pool::thread_cache()
+{
+	for (auto &e : t_cache.entries) {
+		if (e.pool_id == m_id) {
+			return e.blocks;
+		}
+	}
+
+	t_cache.entries.push_back({m_id, {}});
+	t_cache.entries.back().blocks.reserve(THREAD_CACHE_SIZE);
+	return t_cache.entries.back().blocks;
+}
+
+char *buffer_pool::allocate_buffer_impl()
+{
+	// reserve one block, concurrent allocations can't pass the limit
+	int size = m_size.load(std::memory_order_relaxed);
+	do {
+		if (size >= m_limit) {
+			// limit might be lower than the slab
+			m_exceeded_max_size = true;
+			trace_instant("buffer pool empty", size);
+			return nullptr;
+		}
+	} while (!m_size.compare_exchange_weak(size, size + 1, std::memory_order_relaxed));
+
+	auto &cache = thread_cache();
+
+	std::uint32_t index = nil;
+	if (!cache.empty()) {
+		index = cache.back();
+		cache.pop_back();
+		m_cached--;
+	} else {
+		index = central_pop();
+		// take some more for next time
+		for (int i = 1; index != nil && i < THREAD_CACHE_BATCH && m_cached < m_max_cached; i++) {
+			std::uint32_t const more = central_pop();
+			if (more == nil) {
+				break;
+			}
+			cache.push_back(more);
+			m_cached++;
+		}
+	}
+
+	// no memory, the rest is in caches of other threads
+	if (index == nil) {
+		m_size--;
 		m_exceeded_max_size = true;
+		trace_instant("buffer pool empty", size);
 		return nullptr;
 	}
 
 	// reach high watermak, but still has some buffer to use
-	if (m_size > HIGH_WATERMARK) {
+	if (size + 1 > m_high_watermark) {
 		m_exceeded_max_size = true;
 	}
 
-	char *buf = (char*)malloc(DEFAULT_BLOCK_SIZE);
-	if (!buf) {
-		m_exceeded_max_size = true;
-		return nullptr;
-	}
-	m_size++;
-	return buf;
+	return m_slab + std::size_t(index) * DEFAULT_BLOCK_SIZE;
 }
 
 char *buffer_pool::allocate_buffer()
 {
-	std::unique_lock<std::mutex> l(m_pool_mutex);
-	return allocate_buffer_impl(l);
+	return allocate_buffer_impl();
 }
 
 char *buffer_pool::allocate_buffer(bool &exceeded, std::shared_ptr<libtorrent::disk_observer> o)
 {
-	std::unique_lock<std::mutex> l(m_pool_mutex);
-	char *buf = allocate_buffer_impl(l);
+	char *buf = allocate_buffer_impl();
 
 	if (m_exceeded_max_size) {
-		exceeded = true;
-		if (o) {
-			m_observers.push_back(o);
+		// check again with lock, check_buffer_level may reopen it
+		std::unique_lock<std::mutex> l(m_pool_mutex);
+		if (m_exceeded_max_size) {
+			exceeded = true;
+			m_stalls++;
+			if (o) {
+				m_observers.push_back(o);
+			}
+			trace_instant("buffer pool stall", m_size);
+			trace_counter(m_name, m_size);
 		}
 	}
 
@@ -69,21 +304,42 @@ char *buffer_pool::allocate_buffer(bool &exceeded, std::shared_ptr<libtorrent::d
 
 void buffer_pool::free_disk_buffer(char *buf)
 {
-	std::unique_lock<std::mutex> l(m_pool_mutex);
-	free(buf);
-	m_size--;
-	check_buffer_level(l);
+	BOOST_ASSERT(buf >= m_slab && buf < m_slab + m_slab_size);
+	BOOST_ASSERT((buf - m_slab) % DEFAULT_BLOCK_SIZE == 0);
+
+	std::uint32_t const index = std::uint32_t((buf - m_slab) / DEFAULT_BLOCK_SIZE);
+
+	auto &cache = thread_cache();
+	if (cache.size() < THREAD_CACHE_SIZE && m_cached < m_max_cached) {
+		cache.push_back(index);
+		m_cached++;
+	} else {
+		// full, give back all but a batch so allocating threads find them
+		central_push(index);
+		while (cache.size() > THREAD_CACHE_BATCH) {
+			central_push(cache.back());
+			cache.pop_back();
+			m_cached--;
+		}
+	}
+
+	if (--m_size <= m_low_watermark && m_exceeded_max_size) {
+		check_buffer_level();
+	}
 }
 
-void buffer_pool::check_buffer_level(std::unique_lock<std::mutex> &l)
+void buffer_pool::check_buffer_level()
 {
-	if (!m_exceeded_max_size || m_size > LOW_WATERMARK) {
+	std::unique_lock<std::mutex> l(m_pool_mutex);
+	if (!m_exceeded_max_size || m_size > m_low_watermark) {
 		// still high usgae
 		return;
 	}
 
 	// lower than LOW_WATERMARKi, reopen
 	m_exceeded_max_size = false;
+	trace_instant("buffer pool reopen", m_size);
+	trace_counter(m_name, m_size);
 
 	std::vector<std::weak_ptr<libtorrent::disk_observer>> cbs;
 	m_observers.swap(cbs);
@@ -1,44 +1,155 @@
 #ifndef __BUFFER_POOL_HPP__
 #define __BUFFER_POOL_HPP__
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <deque>
+#include <memory>
 #include <vector>
 #include <mutex>
 #include <boost/core/noncopyable.hpp>
 #include <libtorrent/libtorrent.hpp>
 
-// 256 MB
+// default 16 MB for each pool, --buffer-pool-size to change it
 #define MAX_BUFFER_POOL_SIZE (16ULL * 1024 * 1024)
 // 16 KB
 #define DEFAULT_BLOCK_SIZE (16 * 1024)
 
-// watermark for write buffer
-#define BUFFER_COUNT (MAX_BUFFER_POOL_SIZE / DEFAULT_BLOCK_SIZE)
-// 50%
-#define LOW_WATERMARK (MAX_BUFFER_POOL_SIZE / DEFAULT_BLOCK_SIZE / 2)
-// 87.5%
-#define HIGH_WATERMARK (MAX_BUFFER_POOL_SIZE / DEFAULT_BLOCK_SIZE / 8 * 7)
+// blocks kept in each thread, a full cache is flushed down to
+// THREAD_CACHE_BATCH to the central free list. disk threads free most
+// blocks and the network thread allocates them, so it's small
+#define THREAD_CACHE_SIZE 8
+// blocks taken from the central free list at once
+#define THREAD_CACHE_BATCH 4
+
+// adaptive limit is checked at most once per interval, and moves 1/8 each time
+#define ADAPTIVE_INTERVAL_MS 1000
+#define ADAPTIVE_STEP_SHIFT 3
 
 namespace ezio
 {
+struct buffer_pool_thread_cache;
+
 class buffer_pool : public libtorrent::buffer_allocator_interface, boost::noncopyable
 {
+	friend struct buffer_pool_thread_cache;
+
 public:
-	buffer_pool(libtorrent::io_context &ioc);
+	// max_pool_size is the size of slab, the limit can grow up to it.
+	// 0 for the same as pool_size.
+	buffer_pool(libtorrent::io_context &ioc, std::size_t pool_size = MAX_BUFFER_POOL_SIZE, bool hugepage = false,
+		std::size_t max_pool_size = 0);
 	~buffer_pool();
 
-	char *allocate_buffer_impl(std::unique_lock<std::mutex> &l);
+	// counter name in traces, a literal
+	void set_name(char const *name)
+	{
+		m_name = name;
+	}
+
+	// adapt the limit in [min_size, slab] by latency of jobs using the buffers
+	void enable_adaptive(std::size_t min_size, std::chrono::microseconds target_latency);
+	// latency from buffer queued to written, queued is blocks waiting to
+	// be written now. the limit doesn't grow while queued goes up
+	void record_latency(std::chrono::microseconds latency, int queued);
+
+	char *allocate_buffer_impl();
 	char *allocate_buffer();
 	char *allocate_buffer(bool &exceeded, std::shared_ptr<libtorrent::disk_observer> o);
 	void free_disk_buffer(char *) override;
-	void check_buffer_level(std::unique_lock<std::mutex> &l);
+	void check_buffer_level();
+
+	// all blocks are in one page aligned slab
+	char *slab() const
+	{
+		return m_slab;
+	}
+
+	std::size_t slab_size() const
+	{
+		return m_slab_size;
+	}
+
+	int max_buffers() const
+	{
+		return m_max_buffers;
+	}
+
+	// blocks in use
+	int size() const
+	{
+		return m_size;
+	}
+
+	// current limit of blocks in use
+	int limit() const
+	{
+		return m_limit;
+	}
+
+	// times peers are stalled by high watermark
+	std::int64_t stalls() const
+	{
+		return m_stalls;
+	}
+
+	std::int64_t latency_us() const
+	{
+		return m_latency_us;
+	}
 
 private:
+	static constexpr std::uint32_t nil = UINT32_MAX;
+
+	std::uint32_t central_pop();
+	void central_push(std::uint32_t index);
+	std::vector<std::uint32_t> &thread_cache();
+
 	libtorrent::io_context &m_ios;
+	char const *m_name{"buffer pool"};
 	std::mutex m_pool_mutex;
-	int m_size;
-	bool m_exceeded_max_size;
+	std::atomic<int> m_size;
+	std::atomic<bool> m_exceeded_max_size;
 	std::vector<std::weak_ptr<libtorrent::disk_observer>> m_observers;
+
+	void set_limit(int limit);
+
+	// watermark for buffer, blocks in slab
+	int m_max_buffers;
+	// effective limit, m_max_buffers unless adaptive
+	std::atomic<int> m_limit;
+	// 50% of limit
+	std::atomic<int> m_low_watermark;
+	// 87.5% of limit
+	std::atomic<int> m_high_watermark;
+
+	// adaptive limit, only under m_pool_mutex
+	bool m_adaptive{false};
+	int m_min_limit{0};
+	std::chrono::microseconds m_target_latency{0};
+	std::chrono::steady_clock::time_point m_last_adjust;
+	std::int64_t m_last_stalls{0};
+	int m_last_queued{0};
+
+	// moving average of latency
+	std::atomic<std::int64_t> m_latency_us{0};
+	std::atomic<std::int64_t> m_stalls{0};
+
+	char *m_slab;
+	std::size_t m_slab_size;
+
+	// lock free stack of free blocks, head is (tag << 32 | index) to avoid ABA
+	std::atomic<std::uint64_t> m_free_head;
+	std::unique_ptr<std::atomic<std::uint32_t>[]> m_next;
+
+	// blocks in all thread caches, bounded so they don't starve others.
+	// 1/64 of the slab, at least one cache
+	std::atomic<int> m_cached;
+	int m_max_cached;
+
+	// to find thread caches of this pool
+	std::uint64_t m_id;
 };
 
 }  // namespace ezio
@@ -1,7 +1,17 @@
+#include <algorithm>
+
 #include "config.hpp"
 
 namespace ezio
 {
+std::function<void(std::string const &)> one_of(char const *option, std::vector<std::string> values)
+{
+	return [option, values](std::string const &value) {
+		if (std::find(values.begin(), values.end(), value) == values.end()) {
+			throw bpo::validation_error(bpo::validation_error::invalid_option_value, option, value);
+		}
+	};
+}
 
 void config::parse_from_argv(int argc, char **argv)
 {
@@ -11,17 +21,31 @@ void config::parse_from_argv(int argc, char **argv)
 		("help,h", "some help")
 		("file,F", bpo::bool_switch(&file_flag)->default_value(false), "read data from file rather than raw disk")
 		("listen,l", bpo::value<std::string>(&listen_address), "gRPC service listen address and port, default is 127.0.0.1:50051")
+		("rpc-threads", bpo::value<int>(&rpc_threads), "gRPC completion queue threads, default is 2")
+	;
+	add_disk_options(desc);
+	desc.add_options()
+		("resume-dir", bpo::value<std::string>(&resume_dir), "save piece bitmap of torrents in the directory and resume from it, default is off")
+		("resume-interval", bpo::value<int>(&resume_interval), "save resume files every N seconds, default is 30")
+		("nbd", bpo::value<std::string>(&nbd_listen), "export torrents as read only NBD devices on host:port while downloading, e.g. 0.0.0.0:10809, default is off")
+		("profile", bpo::value<std::string>(&profile), "apply built-in settings profile at start: lan-seed, lan-receiver or low-memory")
+		("torrent-cache", bpo::value<int>(&torrent_cache), "keep N parsed torrents to add them again by info hash, 0 to disable, default is 16")
 		("version,v", "show version")
 	;
 	// clang-format on
 
 	// clang-format off
 	bpo::variables_map vmap;
-	bpo::store(bpo::command_line_parser(argc, argv)
-		.options(desc)
-		.run(),
-		vmap);
-	bpo::notify(vmap);
+	try {
+		bpo::store(bpo::command_line_parser(argc, argv)
+			.options(desc)
+			.run(),
+			vmap);
+		bpo::notify(vmap);
+	} catch (bpo::error const &e) {
+		std::cerr << e.what() << std::endl;
+		exit(1);
+	}
 	// clang-format on
 
 	if (vmap.count("help")) {
@@ -35,4 +59,34 @@ void config::parse_from_argv(int argc, char **argv)
 	}
 }
 
+void config::add_disk_options(bpo::options_description &desc)
+{
+	// clang-format off
+	desc.add_options()
+		("io-uring", bpo::bool_switch(&io_uring_flag)->default_value(false), "use io_uring for raw disk I/O")
+		("io-uring-entries", bpo::value<unsigned>(&io_uring_entries), "io_uring submission queue size, default is 256")
+		("buffer-pool-size", bpo::value<int>(&buffer_pool_size), "size of read and write buffer pool in MB each, default is 16")
+		("buffer-pool-max-size", bpo::value<int>(&buffer_pool_max_size), "adapt write buffer pool limit by disk latency up to N MB, default is off")
+		("write-latency-target", bpo::value<int>(&write_latency_target), "shrink write buffer pool limit when write latency is above N ms, default is 200")
+		("hugepage", bpo::bool_switch(&hugepage_flag)->default_value(false), "allocate buffer pool from hugepages")
+		("aio-threads", bpo::value<int>(&aio_threads), "read and write threads for each disk, default depends on cpu count")
+		("hashing-threads", bpo::value<int>(&hashing_threads), "hash threads, default is cpu count")
+		("per-disk-queue", bpo::bool_switch(&per_disk_queue_flag)->default_value(false), "separate read and write threads for each block device")
+		("read-weight", bpo::value<int>(&read_weight), "share of disk threads for reads, default is 4, not for io_uring I/O")
+		("write-weight", bpo::value<int>(&write_weight), "share of disk threads for writes, default is 1, not for io_uring I/O")
+		("read-deadline", bpo::value<int>(&read_deadline), "reads waiting longer than N ms go before writes, default is 50, not for io_uring I/O")
+		("io-cpus", bpo::value<std::string>(&io_cpus), "pin read and write threads to cpu list, e.g. 0-3,8")
+		("hash-cpus", bpo::value<std::string>(&hash_cpus), "pin hash threads to cpu list, e.g. 0-3,8")
+		("hash-numa-node", bpo::value<int>(&hash_numa_node), "pin hash threads to cpus of NUMA node")
+		("mmap-seed", bpo::bool_switch(&mmap_seed_flag)->default_value(false), "zero copy read from mmap of partition for seeding")
+		("direct-io", bpo::bool_switch(&direct_io_flag)->default_value(false), "open partitions with O_DIRECT, writes don't fill the page cache")
+		("read-cache-size", bpo::value<int>(&read_cache_size), "size of piece read cache for seeding in MB, default is 0 (disabled)")
+		("elevator", bpo::value<std::string>(&elevator)->notifier(one_of("elevator", {"on", "off", "auto"})), "write in partition offset order: on, off or auto (rotational disk), default is auto, ignored with --io-uring")
+		("sync", bpo::value<std::string>(&sync_policy)->notifier(one_of("sync", {"none", "piece", "torrent"})), "fdatasync at piece or torrent completion: none, piece or torrent, default is torrent")
+		("writeback-size", bpo::value<int>(&writeback_size), "start writeback behind writes every N MB, 0 to disable, default is 64")
+		("zero-blocks", bpo::value<std::string>(&zero_blocks)->notifier(one_of("zero-blocks", {"write", "zeroout", "skip"})), "all zero blocks: write, zeroout (discard or write zeroes offload) or skip (target is pre-cleared), default is write")
+	;
+	// clang-format on
+}
+
 }  // namespace ezio
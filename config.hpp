@@ -4,23 +4,86 @@
 #define BOOST_PROGRAM_OPTIONS_DYN_LINK 1
 #include <boost/program_options.hpp>
 
+#include <functional>
 #include <iostream>
+#include <string>
 #include <vector>
 
 namespace bpo = boost::program_options;
 
 namespace ezio
 {
+// notifier of an option that takes one of a few words, option is its
+// name in the error
+std::function<void(std::string const &)> one_of(char const *option, std::vector<std::string> values);
 
 class config
 {
 public:
 	void parse_from_argv(int argc, char **argv);
+	// raw_disk_io options, shared with ezio_disk_bench
+	void add_disk_options(bpo::options_description &desc);
 
 	// regular file mode
 	bool file_flag = false;
 	// --listen address
 	std::string listen_address = "127.0.0.1:50051";
+	// --rpc-threads, gRPC completion queue threads
+	int rpc_threads = 2;
+	// --io-uring
+	bool io_uring_flag = false;
+	// --io-uring-entries
+	unsigned io_uring_entries = 256;
+	// --buffer-pool-size in MB, for each of read and write pool
+	int buffer_pool_size = 16;
+	// --buffer-pool-max-size in MB, write pool limit adapts up to it
+	int buffer_pool_max_size = 0;
+	// --write-latency-target in ms, shrink write pool limit above it
+	int write_latency_target = 200;
+	// --hugepage
+	bool hugepage_flag = false;
+	// --aio-threads, read and write threads for each disk, 0 for auto
+	int aio_threads = 0;
+	// --hashing-threads, 0 for auto
+	int hashing_threads = 0;
+	// --per-disk-queue, separate read and write threads for each block device
+	bool per_disk_queue_flag = false;
+	// --read-weight and --write-weight, share of disk threads
+	int read_weight = 4;
+	int write_weight = 1;
+	// --read-deadline in ms, reads waiting longer go first
+	int read_deadline = 50;
+	// --io-cpus, cpu list for read and write threads
+	std::string io_cpus;
+	// --hash-cpus, cpu list for hash threads
+	std::string hash_cpus;
+	// --hash-numa-node, pin hash threads to cpus of the node, -1 for none
+	int hash_numa_node = -1;
+	// --mmap-seed, serve reads from a read only mapping of partition
+	bool mmap_seed_flag = false;
+	// --direct-io, open partitions with O_DIRECT, bypass the page cache
+	bool direct_io_flag = false;
+	// --read-cache-size in MB, 0 to disable
+	int read_cache_size = 0;
+	// --elevator, sort writes by offset: on, off or auto (rotational disk)
+	std::string elevator = "auto";
+	// --sync, when to fdatasync: none, piece or torrent
+	std::string sync_policy = "torrent";
+	// --writeback-size in MB, sync_file_range window behind writes, 0 to disable
+	int writeback_size = 64;
+	// --zero-blocks, all zero blocks: write, zeroout or skip (target is cleared)
+	std::string zero_blocks = "write";
+	// --resume-dir, piece bitmap sidecar files, empty to disable
+	std::string resume_dir;
+	// --resume-interval in seconds, save modified resume files
+	int resume_interval = 30;
+	// --nbd, host:port of read only NBD export, empty to disable
+	std::string nbd_listen;
+	// --profile, built-in settings profile applied at start
+	std::string profile;
+	// --torrent-cache, parsed torrents kept for AddRequest.info_hash and
+	// adding the same torrent again, 0 to disable
+	int torrent_cache = 16;
 };
 
 }  // namespace ezio
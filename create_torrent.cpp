@@ -0,0 +1,395 @@
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define BOOST_PROGRAM_OPTIONS_DYN_LINK 1
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/program_options.hpp>
+#include <spdlog/spdlog.h>
+#include "spdlog/cfg/env.h"
+
+#include <libtorrent/libtorrent.hpp>
+#include <libtorrent/hasher.hpp>
+
+#include "partition_storage.hpp"
+
+// same as partclone torrent helper
+#define PIECE_LENGTH (16 * 1024 * 1024)
+#define BLOCK_SIZE (16 * 1024)
+// log progress every 1/N of the pieces
+#define PROGRESS_STEPS 20
+
+namespace bpo = boost::program_options;
+
+namespace
+{
+struct partclone_info {
+	std::vector<std::string> offsets;
+	std::vector<std::int64_t> lengths;
+	std::vector<lt::sha1_hash> hashes;
+};
+
+// torrent.info has "offset: <hex>", "length: <hex>" and "sha1: <hex>"
+// lines, read it line by line instead of as a whole
+bool parse_partclone_info(std::istream &in, partclone_info &info)
+{
+	std::string line;
+	while (std::getline(in, line)) {
+		std::size_t const colon = line.find(": ");
+		if (colon == std::string::npos) {
+			continue;
+		}
+
+		std::string const key = line.substr(0, colon);
+		std::string const value = line.substr(colon + 2);
+		if (key == "offset") {
+			info.offsets.push_back(value);
+		} else if (key == "length") {
+			std::size_t end = 0;
+			std::int64_t length = 0;
+			try {
+				length = std::stoll(value, &end, 16);
+			} catch (std::exception const &) {
+				end = 0;
+			}
+			if (end == 0 || length < 0) {
+				SPDLOG_ERROR("invalid length: {}", value);
+				return false;
+			}
+			info.lengths.push_back(length);
+		} else if (key == "sha1") {
+			lt::sha1_hash h;
+			std::istringstream s(value);
+			if (value.size() != lt::sha1_hash::size() * 2 || !(s >> h)) {
+				SPDLOG_ERROR("invalid sha1: {}", value);
+				return false;
+			}
+			info.hashes.push_back(h);
+		}
+	}
+
+	if (info.offsets.size() != info.lengths.size()) {
+		SPDLOG_ERROR("{} offsets but {} lengths", info.offsets.size(), info.lengths.size());
+		return false;
+	}
+	return true;
+}
+
+// piece layer hash of v2, a file in one piece is padded to power of 2
+// blocks only
+lt::sha256_hash piece_root(char const *data, std::int64_t length, bool single_piece)
+{
+	std::vector<lt::sha256_hash> layer;
+	for (std::int64_t b = 0; b < length; b += BLOCK_SIZE) {
+		layer.push_back(lt::hasher256(data + b, int(std::min<std::int64_t>(BLOCK_SIZE, length - b))).final());
+	}
+
+	std::size_t leaves = PIECE_LENGTH / BLOCK_SIZE;
+	if (single_piece) {
+		leaves = 1;
+		while (leaves < layer.size()) {
+			leaves *= 2;
+		}
+	}
+	layer.resize(leaves);
+
+	while (layer.size() > 1) {
+		for (std::size_t i = 0; i < layer.size(); i += 2) {
+			lt::hasher256 h;
+			h.update(layer[i].data(), int(layer[i].size()));
+			h.update(layer[i + 1].data(), int(layer[i + 1].size()));
+			layer[i / 2] = h.final();
+		}
+		layer.resize(layer.size() / 2);
+	}
+	return layer[0];
+}
+
+// read back pieces from the partition and hash them in threads. each
+// job reads a whole piece in one go, the buffer is kept per thread.
+class device_hasher
+{
+public:
+	device_hasher(std::string const &device, lt::file_storage const &fs, bool v1, bool v2, int threads) :
+		fs_(fs),
+		storage_(device, fs, false, true),
+		v1_(v1),
+		v2_(v2),
+		threads_(threads)
+	{
+		if (v1_) {
+			v1_hashes_.resize(std::size_t(fs_.num_pieces()));
+		}
+		if (v2_) {
+			v2_hashes_.resize(std::size_t(fs_.num_files()));
+			for (lt::file_index_t f(0); f < lt::file_index_t(fs_.num_files()); ++f) {
+				v2_hashes_[std::size_t(static_cast<int>(f))].resize(std::size_t(file_pieces(f)));
+			}
+		}
+	}
+
+	bool run()
+	{
+		if (storage_.init_error()) {
+			SPDLOG_ERROR("torrent doesn't fit the partition: {}", storage_.init_error().ec.message());
+			return false;
+		}
+
+		boost::asio::thread_pool pool(static_cast<std::size_t>(threads_));
+		if (v1_) {
+			// hybrid files are aligned to pieces by pad files, v2 hashes
+			// come from the same read
+			total_ = fs_.num_pieces();
+			for (lt::piece_index_t p(0); p < lt::piece_index_t(fs_.num_pieces()); ++p) {
+				boost::asio::post(pool, [this, p]() {
+					hash_piece(p);
+				});
+			}
+		} else {
+			for (lt::file_index_t f(0); f < lt::file_index_t(fs_.num_files()); ++f) {
+				total_ += file_pieces(f);
+			}
+			for (lt::file_index_t f(0); f < lt::file_index_t(fs_.num_files()); ++f) {
+				for (int p = 0; p < file_pieces(f); p++) {
+					boost::asio::post(pool, [this, f, p]() {
+						hash_file_piece(f, p);
+					});
+				}
+			}
+		}
+		pool.join();
+		return !failed_;
+	}
+
+	void set_hashes(lt::create_torrent &ct) const
+	{
+		for (std::size_t i = 0; i < v1_hashes_.size(); i++) {
+			ct.set_hash(lt::piece_index_t(int(i)), v1_hashes_[i]);
+		}
+		for (std::size_t f = 0; f < v2_hashes_.size(); f++) {
+			for (std::size_t p = 0; p < v2_hashes_[f].size(); p++) {
+				ct.set_hash2(lt::file_index_t(int(f)), lt::piece_index_t::diff_type(int(p)), v2_hashes_[f][p]);
+			}
+		}
+	}
+
+private:
+	int file_pieces(lt::file_index_t f) const
+	{
+		if (fs_.pad_file_at(f)) {
+			return 0;
+		}
+		return int((fs_.file_size(f) + PIECE_LENGTH - 1) / PIECE_LENGTH);
+	}
+
+	char *buffer()
+	{
+		thread_local std::vector<char> buf(PIECE_LENGTH);
+		return buf.data();
+	}
+
+	bool read(char *buf, std::int64_t torrent_offset, int length)
+	{
+		lt::storage_error error;
+		int const n = storage_.read(buf, lt::piece_index_t(int(torrent_offset / PIECE_LENGTH)),
+			int(torrent_offset % PIECE_LENGTH), length, error);
+		if (error || n != length) {
+			SPDLOG_ERROR("failed to read {} bytes at {}: {}", length, torrent_offset, error.ec.message());
+			failed_ = true;
+			return false;
+		}
+		return true;
+	}
+
+	void hash_piece(lt::piece_index_t piece)
+	{
+		if (failed_) {
+			return;
+		}
+
+		char *buf = buffer();
+		int const size = fs_.piece_size(piece);
+		std::int64_t const piece_offset = std::int64_t(static_cast<int>(piece)) * PIECE_LENGTH;
+		if (!read(buf, piece_offset, size)) {
+			return;
+		}
+		v1_hashes_[std::size_t(static_cast<int>(piece))] = lt::hasher(buf, size).final();
+
+		if (v2_) {
+			for (lt::file_slice const &s : fs_.map_block(piece, 0, size)) {
+				if (fs_.pad_file_at(s.file_index) || s.size == 0) {
+					continue;
+				}
+				char const *data = buf + (fs_.file_offset(s.file_index) + s.offset - piece_offset);
+				int const p = int(s.offset / PIECE_LENGTH);
+				v2_hashes_[std::size_t(static_cast<int>(s.file_index))][std::size_t(p)] =
+					piece_root(data, s.size, file_pieces(s.file_index) == 1);
+			}
+		}
+		progress();
+	}
+
+	void hash_file_piece(lt::file_index_t f, int p)
+	{
+		if (failed_) {
+			return;
+		}
+
+		char *buf = buffer();
+		std::int64_t const start = std::int64_t(p) * PIECE_LENGTH;
+		int const size = int(std::min<std::int64_t>(PIECE_LENGTH, fs_.file_size(f) - start));
+		if (!read(buf, fs_.file_offset(f) + start, size)) {
+			return;
+		}
+		v2_hashes_[std::size_t(static_cast<int>(f))][std::size_t(p)] = piece_root(buf, size, file_pieces(f) == 1);
+		progress();
+	}
+
+	void progress()
+	{
+		int const done = ++done_;
+		int const step = std::max(total_ / PROGRESS_STEPS, 1);
+		if (done % step == 0 || done == total_) {
+			SPDLOG_INFO("hashed {} of {} pieces", done, total_);
+		}
+	}
+
+	lt::file_storage const &fs_;
+	ezio::partition_storage storage_;
+	bool v1_;
+	bool v2_;
+	int threads_;
+
+	// each slot is written by one job only
+	std::vector<lt::sha1_hash> v1_hashes_;
+	std::vector<std::vector<lt::sha256_hash>> v2_hashes_;
+
+	int total_{0};
+	std::atomic<int> done_{0};
+	std::atomic<bool> failed_{false};
+};
+}  // namespace
+
+int main(int argc, char **argv)
+{
+	spdlog::cfg::load_env_levels();
+
+	std::string partition_name;
+	std::string output;
+	std::string creator;
+	std::string input;
+	std::vector<std::string> trackers;
+	std::string device;
+	bool hybrid = false;
+	bool v2 = false;
+	int threads = int(std::max(std::thread::hardware_concurrency(), 1u));
+
+	// clang-format off
+	bpo::options_description desc("Create torrent from partclone torrent.info, read from stdin if no --input-file");
+	desc.add_options()
+		("help,h", "some help")
+		("partition-name,p", bpo::value<std::string>(&partition_name)->required(), "partition name of this torrent")
+		("output-file,o", bpo::value<std::string>(&output)->required(), "output torrent path and filename")
+		("creator,c", bpo::value<std::string>(&creator)->required(), "creator of this torrent")
+		("input-file,i", bpo::value<std::string>(&input), "input torrent.info")
+		("tracker,t", bpo::value<std::vector<std::string>>(&trackers), "tracker of this torrent, can be repeated")
+		("hybrid", bpo::bool_switch(&hybrid)->default_value(false), "create v1 + v2 hybrid torrent, need --device")
+		("v2", bpo::bool_switch(&v2)->default_value(false), "create v2 only torrent, need --device")
+		("device,d", bpo::value<std::string>(&device), "partition or image to hash, instead of sha1 from torrent.info")
+		("threads", bpo::value<int>(&threads), "hash threads, default is cpu count")
+	;
+	// clang-format on
+
+	bpo::variables_map vmap;
+	try {
+		bpo::store(bpo::parse_command_line(argc, argv, desc), vmap);
+		if (vmap.count("help")) {
+			std::cout << desc << std::endl;
+			return 0;
+		}
+		bpo::notify(vmap);
+	} catch (bpo::error const &e) {
+		std::cerr << e.what() << std::endl
+				  << desc << std::endl;
+		return 1;
+	}
+
+	if ((hybrid || v2) && device.empty()) {
+		std::cerr << "--hybrid and --v2 need --device" << std::endl;
+		return 1;
+	}
+
+	partclone_info info;
+	bool parsed = false;
+	if (input.empty()) {
+		parsed = parse_partclone_info(std::cin, info);
+	} else {
+		std::ifstream in(input);
+		if (!in) {
+			SPDLOG_ERROR("failed to open {}", input);
+			return 1;
+		}
+		parsed = parse_partclone_info(in, info);
+	}
+	if (!parsed) {
+		return 1;
+	}
+
+	lt::file_storage fs;
+	fs.set_piece_length(PIECE_LENGTH);
+	for (std::size_t i = 0; i < info.offsets.size(); i++) {
+		fs.add_file(partition_name + "/" + info.offsets[i], info.lengths[i]);
+	}
+
+	lt::create_flags_t flags = lt::create_torrent::v1_only;
+	if (v2) {
+		flags = lt::create_torrent::v2_only;
+	} else if (hybrid) {
+		flags = {};
+	}
+
+	// v2 and hybrid add pad files to fs, hash with the files of ct
+	lt::create_torrent ct(fs, PIECE_LENGTH, flags);
+	ct.set_creator(creator.c_str());
+	for (auto const &t : trackers) {
+		ct.add_tracker(t);
+	}
+
+	if (device.empty()) {
+		if (int(info.hashes.size()) != ct.num_pieces()) {
+			SPDLOG_ERROR("{} sha1 for {} pieces", info.hashes.size(), ct.num_pieces());
+			return 1;
+		}
+		for (int i = 0; i < ct.num_pieces(); i++) {
+			ct.set_hash(lt::piece_index_t(i), info.hashes[std::size_t(i)]);
+		}
+	} else {
+		bool const use_v1 = !v2;
+		SPDLOG_INFO("hashing {} with {} threads", device, threads);
+		device_hasher hasher(device, ct.files(), use_v1, v2 || hybrid, std::max(threads, 1));
+		if (!hasher.run()) {
+			return 1;
+		}
+		hasher.set_hashes(ct);
+	}
+
+	std::vector<char> torrent;
+	lt::bencode(std::back_inserter(torrent), ct.generate());
+
+	std::ofstream out(output, std::ios::binary);
+	out.write(torrent.data(), std::streamsize(torrent.size()));
+	if (!out) {
+		SPDLOG_ERROR("failed to write {}", output);
+		return 1;
+	}
+
+	std::cout << output << " created successfully" << std::endl;
+	return 0;
+}
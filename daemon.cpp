@@ -1,157 +1,586 @@
-#include <sstream>
-#include <thread>
+#include <algorithm>
 #include <chrono>
-#include <stdexcept>
+#include <boost/asio/post.hpp>
 #include <spdlog/spdlog.h>
 #include <vector>
 #include "daemon.hpp"
+#include "raw_disk_io.hpp"
 
 namespace ezio
 {
-ezio::ezio(lt::session &session) :
-	session_(session), shutdown_(false)
+namespace
 {
+	// status fields used by torrent_status, others are skipped
+	lt::status_flags_t const status_flags = lt::torrent_handle::query_name | lt::torrent_handle::query_save_path;
+
+	std::string to_hex(lt::sha1_hash const &h)
+	{
+		static char const digits[] = "0123456789abcdef";
+		std::string hex(h.size() * 2, '0');
+		for (std::size_t i = 0; i < h.size(); i++) {
+			auto const c = static_cast<unsigned char>(h[i]);
+			hex[i * 2] = digits[c >> 4];
+			hex[i * 2 + 1] = digits[c & 0xf];
+		}
+		return hex;
+	}
+
+	int hex_value(char c)
+	{
+		if (c >= '0' && c <= '9') {
+			return c - '0';
+		}
+		if (c >= 'a' && c <= 'f') {
+			return c - 'a' + 10;
+		}
+		if (c >= 'A' && c <= 'F') {
+			return c - 'A' + 10;
+		}
+		return -1;
+	}
+
+	bool from_hex(std::string const &hex, lt::sha1_hash &h)
+	{
+		if (hex.size() != h.size() * 2) {
+			return false;
+		}
+
+		for (std::size_t i = 0; i < h.size(); i++) {
+			int const hi = hex_value(hex[i * 2]);
+			int const lo = hex_value(hex[i * 2 + 1]);
+			if (hi < 0 || lo < 0) {
+				return false;
+			}
+			h[i] = static_cast<char>((hi << 4) | lo);
+		}
+		return true;
+	}
+}  // namespace
+
+ezio::ezio(lt::session &session, raw_disk_io *disk_io, std::size_t torrent_cache_size) :
+	session_(session), disk_io_(disk_io), shutdown_(false), settings_(session.get_settings()),
+	torrents_(torrent_cache_size), loader_(TORRENT_LOADER_THREADS)
+{
+}
+
+void ezio::on_alert(alert_handler handler)
+{
+	alert_handlers_.push_back(std::move(handler));
+}
+
+void ezio::on_finished(finished_handler handler)
+{
+	finished_handlers_.push_back(std::move(handler));
+}
+
+void ezio::every(std::chrono::milliseconds interval, tick_handler handler)
+{
+	ticks_.push_back({interval, std::chrono::steady_clock::now() + interval, std::move(handler)});
+}
+
+void ezio::enable_resume(std::string dir, std::chrono::seconds interval)
+{
+	SPDLOG_INFO("resume files in {}, every {}s", dir, interval.count());
+	resume_ = std::make_shared<resume_store>(std::move(dir));
+	every(interval, [this]() {
+		for (auto const &h : all_handles()) {
+			// no alert if nothing changed since last save
+			h.save_resume_data(lt::torrent_handle::only_if_modified);
+		}
+	});
 }
 
 void ezio::stop()
 {
-	shutdown_ = true;
+	{
+		std::lock_guard<std::mutex> l(loop_mutex_);
+		shutdown_ = true;
+	}
+	loop_cond_.notify_all();
 }
 
-void ezio::wait(int interval_second)
+void ezio::run()
 {
+	// called by libtorrent thread when the alert queue becomes non-empty,
+	// it must not block or call into session
+	session_.set_alert_notify([this]() {
+		{
+			std::lock_guard<std::mutex> l(loop_mutex_);
+			alerts_pending_ = true;
+		}
+		loop_cond_.notify_one();
+	});
+
+	std::vector<lt::alert *> alerts;
 	while (!shutdown_) {
-		std::this_thread::sleep_for(std::chrono::seconds(interval_second));
+		// not time_point::max, it may overflow in wait_until
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::hours(1);
+		for (auto const &t : ticks_) {
+			deadline = std::min(deadline, t.next);
+		}
 
-		/*
-		std::vector<libtorrent::alert*> alerts;
+		{
+			std::unique_lock<std::mutex> l(loop_mutex_);
+			loop_cond_.wait_until(l, deadline, [this]() {
+				return shutdown_ || alerts_pending_;
+			});
+			alerts_pending_ = false;
+		}
+		if (shutdown_) {
+			break;
+		}
+
+		// alerts are only valid until next pop_alerts
 		session_.pop_alerts(&alerts);
-		for (auto a : alerts) {
-			SPDLOG_INFO("alert: {} {}", a->what(), a->message());
+		handle_alerts(alerts);
+
+		auto const now = std::chrono::steady_clock::now();
+		for (auto &t : ticks_) {
+			if (t.next <= now) {
+				// skip missed ticks instead of running them in a burst
+				while (t.next <= now) {
+					t.next += t.interval;
+				}
+				t.handler();
+			}
+		}
+	}
+
+	// last resume files before the session is gone
+	if (resume_) {
+		save_all_resume();
+	}
+
+	session_.set_alert_notify([]() {});
+
+	// nobody answers them after the loop
+	std::multimap<std::string, add_handler> adds;
+	std::vector<status_handler> status;
+	{
+		std::lock_guard<std::mutex> l(status_mutex_);
+		adds.swap(pending_adds_);
+		status.swap(pending_status_);
+	}
+	for (auto const &a : adds) {
+		a.second(lt::error_code(boost::asio::error::operation_aborted));
+	}
+	for (auto const &h : status) {
+		h();
+	}
+}
+
+void ezio::join_loader()
+{
+	loader_.join();
+}
+
+void ezio::handle_alerts(std::vector<lt::alert *> const &alerts)
+{
+	bool finished = false;
+	std::vector<std::pair<add_handler, lt::error_code>> adds;
+	std::vector<status_handler> status;
+	{
+		std::lock_guard<std::mutex> l(status_mutex_);
+		for (lt::alert *a : alerts) {
+			if (auto *su = lt::alert_cast<lt::state_update_alert>(a)) {
+				// only torrents changed since last post_torrent_updates
+				for (lt::torrent_status const &st : su->status) {
+					status_cache_[to_hex(st.info_hashes.get_best())] = st;
+				}
+				status.swap(pending_status_);
+			} else if (auto *ta = lt::alert_cast<lt::add_torrent_alert>(a)) {
+				std::string const hash = to_hex(ta->params.ti
+						? ta->params.ti->info_hashes().get_best()
+						: ta->params.info_hashes.get_best());
+				if (!ta->error) {
+					handles_[hash] = ta->handle;
+				} else if (disk_io_) {
+					// libtorrent never opened a storage for it
+					disk_io_->cancel_direct_io(ta->params.save_path);
+				}
+				auto it = pending_adds_.find(hash);
+				if (it != pending_adds_.end()) {
+					adds.emplace_back(std::move(it->second), ta->error);
+					pending_adds_.erase(it);
+				}
+			} else if (auto *tr = lt::alert_cast<lt::torrent_removed_alert>(a)) {
+				std::string const hash = to_hex(tr->info_hashes.get_best());
+				status_cache_.erase(hash);
+				handles_.erase(hash);
+				default_uploads_.erase(hash);
+				default_connections_.erase(hash);
+			}
 		}
-		*/
+	}
+
+	for (auto const &a : adds) {
+		a.first(a.second);
+	}
+	for (auto const &h : status) {
+		h();
+	}
+
+	for (lt::alert *a : alerts) {
+		for (auto const &h : alert_handlers_) {
+			h(a);
+		}
+
+		if (auto *sr = lt::alert_cast<lt::save_resume_data_alert>(a)) {
+			if (resume_alerts_ > 0) {
+				resume_alerts_--;
+			}
+			write_resume(sr->params);
+		} else if (auto *sf = lt::alert_cast<lt::save_resume_data_failed_alert>(a)) {
+			if (resume_alerts_ > 0) {
+				resume_alerts_--;
+			}
+			SPDLOG_DEBUG("save resume data: {}", sf->error.message());
+		}
+
+		if (auto *tf = lt::alert_cast<lt::torrent_finished_alert>(a)) {
+			finished = true;
+			if (resume_) {
+				tf->handle.save_resume_data();
+			}
+			std::string const hash = to_hex(tf->handle.info_hashes().get_best());
+			std::string save_path;
+			{
+				std::lock_guard<std::mutex> l(status_mutex_);
+				auto it = status_cache_.find(hash);
+				if (it != status_cache_.end()) {
+					save_path = it->second.save_path;
+				}
+			}
+			for (auto const &h : finished_handlers_) {
+				h(hash, save_path);
+			}
+		}
+	}
+
+	// status streams see the finished torrent now, not at next interval
+	if (finished) {
+		post_torrent_updates();
 	}
 }
 
-void ezio::add_torrent(std::string torrent_body, std::string save_path, bool seeding_mode = false, int max_uploads = 3, int max_connections = 5, bool sequential_download = false)
+void ezio::add_torrent(add_request request, add_handler done)
 {
-	lt::span<const char> torrent_byte(torrent_body);
+	int const sources = !request.torrent.empty() + !request.torrent_path.empty() + !request.info_hash.empty();
+	if (sources != 1) {
+		SPDLOG_WARN("torrent adding needs one of torrent, torrent_path and info_hash");
+		done(boost::system::errc::make_error_code(boost::system::errc::invalid_argument));
+		return;
+	}
 
-	lt::add_torrent_params atp;
-	lt::error_code ec;
-	const int depth_limit = 100;
-	const int token_limit = 10000000;
-	const lt::bdecode_node node =
-		lt::bdecode(torrent_byte, ec, nullptr, depth_limit, token_limit);
+	if (!request.info_hash.empty()) {
+		lt::sha1_hash info_hash;
+		std::shared_ptr<lt::torrent_info> ti;
+		if (from_hex(request.info_hash, info_hash)) {
+			ti = torrents_.find(info_hash);
+		}
+		if (!ti) {
+			SPDLOG_WARN("torrent {} is not cached", request.info_hash);
+			done(boost::system::errc::make_error_code(boost::system::errc::no_such_file_or_directory));
+			return;
+		}
+		add_parsed(std::move(ti), request, std::move(done));
+		return;
+	}
 
-	if (ec) {
-		throw std::invalid_argument("failed to decode node");
+	if (shutdown_) {
+		// the loader might be joined already
+		done(lt::errors::make_error_code(lt::errors::session_is_closing));
+		return;
 	}
 
-	atp.ti = std::make_shared<lt::torrent_info>(node, std::ref(ec));
-	atp.save_path = save_path;
-	atp.max_uploads = max_uploads > 0 ? max_uploads : 3;
-	atp.max_connections = max_connections > 0 ? max_connections : 5;
+	// big torrents take seconds to parse, keep them off the gRPC threads
+	boost::asio::post(loader_, [this, request = std::move(request), done = std::move(done)]() mutable {
+		lt::error_code ec;
+		if (request.torrent.empty() && !load_torrent_file(request.torrent_path, request.torrent, ec)) {
+			SPDLOG_WARN("failed to load {}: {}", request.torrent_path, ec.message());
+			done(ec);
+			return;
+		}
+
+		std::shared_ptr<lt::torrent_info> ti = torrents_.parse(request.torrent, ec);
+		if (!ti) {
+			SPDLOG_WARN("failed to parse torrent: {}", ec.message());
+			done(ec);
+			return;
+		}
+		add_parsed(std::move(ti), request, std::move(done));
+	});
+}
+
+void ezio::add_parsed(std::shared_ptr<lt::torrent_info> ti, add_request const &request, add_handler done)
+{
+	lt::add_torrent_params atp;
+	atp.ti = std::move(ti);
+	atp.save_path = request.save_path;
+	torrent_defaults defaults;
+	{
+		std::lock_guard<std::mutex> l(settings_mutex_);
+		defaults = defaults_;
+	}
+	atp.max_uploads = request.max_uploads > 0 ? request.max_uploads : defaults.max_uploads;
+	atp.max_connections = request.max_connections > 0 ? request.max_connections : defaults.max_connections;
 	//atp.flags = libtorrent::torrent_flags::default_flags & ~libtorrent::torrent_flags::auto_managed & ~libtorrent::torrent_flags::paused;
-	atp.flags = {};
+	// state_update_alert only reports subscribed torrents
+	atp.flags = libtorrent::torrent_flags::update_subscribe;
 
-	if (seeding_mode) {
+	if (request.seeding_mode) {
 		atp.flags |= libtorrent::torrent_flags::seed_mode;
+		if (defaults.super_seeding) {
+			atp.flags |= libtorrent::torrent_flags::super_seeding;
+		}
 	}
 
-	if (sequential_download) {
+	if (request.sequential_download) {
 		atp.flags |= libtorrent::torrent_flags::sequential_download;
 	}
 
-	if (ec) {
-		throw std::invalid_argument("failed to save path");
+	std::string const hash = to_hex(atp.ti->info_hashes().get_best());
+	// seed mode has all pieces anyway
+	if (!request.seeding_mode) {
+		std::string resume_data = request.resume_data;
+		if (resume_data.empty() && resume_) {
+			resume_->load(hash, resume_data);
+		}
+		// file mode doesn't fdatasync, libtorrent checks file sizes there
+		if (!resume_data.empty()) {
+			apply_resume_data(resume_data, atp, disk_io_ != nullptr);
+		}
+	}
+
+	{
+		std::unique_lock<std::mutex> l(status_mutex_);
+		if (shutdown_) {
+			l.unlock();
+			done(lt::errors::make_error_code(lt::errors::session_is_closing));
+			return;
+		}
+		pending_adds_.emplace(hash, std::move(done));
+		if (request.seeding_mode) {
+			initial_seeds_.insert(hash);
+		}
+		// limits set by the caller are kept by apply_settings
+		if (request.max_uploads > 0) {
+			default_uploads_.erase(hash);
+		} else {
+			default_uploads_.insert(hash);
+		}
+		if (request.max_connections > 0) {
+			default_connections_.erase(hash);
+		} else {
+			default_connections_.insert(hash);
+		}
+	}
+	if (request.direct_io) {
+		if (disk_io_) {
+			disk_io_->use_direct_io(request.save_path);
+		} else {
+			SPDLOG_WARN("direct_io is ignored in file mode");
+		}
+	}
+	// answered by add_torrent_alert
+	session_.async_add_torrent(std::move(atp));
+
+	SPDLOG_INFO("torrent adding. save_path({})", request.save_path);
+}
+
+torrent_status ezio::to_status(lt::torrent_status const &t_stat, lt::time_point now) const
+{
+	torrent_status status;
+	status.hash = to_hex(t_stat.info_hashes.get_best());
+	status.name = t_stat.name;
+	status.progress = t_stat.progress;
+	status.download_rate = t_stat.download_payload_rate;
+	status.upload_rate = t_stat.upload_payload_rate;
+	status.is_finished = t_stat.is_finished;
+	status.num_peers = t_stat.num_peers;
+	status.active_time = std::chrono::duration_cast<std::chrono::seconds>(t_stat.active_duration).count();
+	status.state = t_stat.state;
+	status.total_done = t_stat.total_done;
+	status.total = t_stat.total;
+	status.num_pieces = t_stat.num_pieces;
+	status.finished_time = std::chrono::duration_cast<std::chrono::seconds>(t_stat.finished_duration).count();
+	status.seeding_time = std::chrono::duration_cast<std::chrono::seconds>(t_stat.seeding_duration).count();
+	status.total_payload_download = t_stat.total_payload_download;
+	status.total_payload_upload = t_stat.total_payload_upload;
+	status.is_paused = (t_stat.flags & libtorrent::torrent_flags::paused) != 0;
+	status.save_path = t_stat.save_path;
+
+	status.last_upload = -1;
+	if (t_stat.last_upload.time_since_epoch().count() != 0) {
+		status.last_upload = std::chrono::duration_cast<std::chrono::seconds>(now - t_stat.last_upload).count();
 	}
 
-	lt::torrent_handle handle = session_.add_torrent(std::move(atp));
+	status.last_download = -1;
+	if (t_stat.last_download.time_since_epoch().count() != 0) {
+		status.last_download = std::chrono::duration_cast<std::chrono::seconds>(now - t_stat.last_download).count();
+	}
 
-	SPDLOG_INFO("torrent added. save_path({})", save_path);
+	status.bytes_durable = disk_io_ ? disk_io_->durable_bytes(t_stat.save_path) : -1;
+	return status;
 }
 
-std::map<std::string, torrent_status> ezio::get_torrent_status(std::vector<std::string> hashes)
+void ezio::post_torrent_updates()
 {
+	session_.post_torrent_updates(status_flags);
+}
+
+void ezio::request_status(status_handler done)
+{
+	{
+		std::lock_guard<std::mutex> l(status_mutex_);
+		if (!shutdown_) {
+			pending_status_.push_back(std::move(done));
+			done = nullptr;
+		}
+	}
+
+	if (done) {
+		done();
+		return;
+	}
+	post_torrent_updates();
+}
+
+std::map<std::string, torrent_status> ezio::get_cached_status(std::vector<std::string> const &hashes)
+{
+	auto const now = lt::clock_type::now();
 	std::map<std::string, torrent_status> result;
-	// TODO we ignore request hashes first, always return all
-	for (auto h : hashes) {
-		SPDLOG_DEBUG("hash: {}", h);
-		//std::cout << h << std::endl;
-		// do some filter for below
-	}
-
-	auto now = std::chrono::high_resolution_clock::now();
-
-	std::vector<lt::torrent_handle> torrents = session_.get_torrents();
-	for (lt::torrent_handle const &h : torrents) {
-		std::stringstream ss;
-		ss << h.info_hash();
-		const std::string &hash = ss.str();
-
-		// disable those info we don't need
-		lt::torrent_status t_stat = h.status();
-
-		torrent_status status;
-		status.hash = hash;
-		status.name = t_stat.name;
-		status.progress = t_stat.progress;
-		status.download_rate = t_stat.download_payload_rate;
-		status.upload_rate = t_stat.upload_payload_rate;
-		status.active_time = 1;
-		status.is_finished = t_stat.is_finished;
-		status.num_peers = t_stat.num_peers;
-		status.active_time = std::chrono::duration_cast<std::chrono::seconds>(t_stat.active_duration).count();
-		status.state = t_stat.state;
-		status.total_done = t_stat.total_done;
-		status.total = t_stat.total;
-		status.num_pieces = t_stat.num_pieces;
-		status.finished_time = std::chrono::duration_cast<std::chrono::seconds>(t_stat.finished_duration).count();
-		status.seeding_time = std::chrono::duration_cast<std::chrono::seconds>(t_stat.seeding_duration).count();
-		status.total_payload_download = t_stat.total_payload_download;
-		status.total_payload_upload = t_stat.total_payload_upload;
-		status.is_paused = (t_stat.flags & libtorrent::torrent_flags::paused) != 0;
-		status.save_path = t_stat.save_path;
-
-		status.last_upload = -1;
-		if (t_stat.last_upload.time_since_epoch().count() != 0) {
-			status.last_upload = std::chrono::duration_cast<std::chrono::seconds>(now - t_stat.last_upload).count();
-		}
-
-		status.last_download = -1;
-		if (t_stat.last_download.time_since_epoch().count() != 0) {
-			status.last_download = std::chrono::duration_cast<std::chrono::seconds>(now - t_stat.last_download).count();
-		}
-
-		result.emplace(hash, status);
+	std::lock_guard<std::mutex> l(status_mutex_);
+	if (hashes.empty()) {
+		for (auto const &t : status_cache_) {
+			result.emplace(t.first, to_status(t.second, now));
+		}
+		return result;
 	}
 
+	for (auto const &h : hashes) {
+		// keyed by lower case hex, same as find_handle
+		libtorrent::sha1_hash info_hash;
+		if (!from_hex(h, info_hash)) {
+			continue;
+		}
+		auto it = status_cache_.find(to_hex(info_hash));
+		if (it != status_cache_.end()) {
+			result.emplace(h, to_status(it->second, now));
+		}
+	}
 	return result;
 }
 
-void ezio::pause_torrent(std::string hash)
+std::vector<lt::torrent_handle> ezio::all_handles()
 {
-	SPDLOG_INFO("pause {}", hash);
-	std::stringstream ss(hash);
+	std::vector<lt::torrent_handle> handles;
+	std::lock_guard<std::mutex> l(status_mutex_);
+	handles.reserve(handles_.size());
+	for (auto const &h : handles_) {
+		handles.push_back(h.second);
+	}
+	return handles;
+}
+
+void ezio::write_resume(lt::add_torrent_params const &params)
+{
+	if (!resume_) {
+		return;
+	}
+
+	std::string const hash = to_hex(params.info_hashes.get_best());
+	if (!disk_io_) {
+		resume_->save(hash, params, false);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> l(loop_mutex_);
+		resume_writes_++;
+	}
+	std::shared_ptr<resume_store> store = resume_;
+	disk_io_->sync_storage(params.save_path, [this, store, hash, params](bool ok) {
+		// keep the last durable file if fdatasync fails
+		if (ok) {
+			store->save(hash, params, true);
+		}
+		{
+			std::lock_guard<std::mutex> l(loop_mutex_);
+			resume_writes_--;
+		}
+		loop_cond_.notify_all();
+	});
+}
+
+void ezio::save_all_resume()
+{
+	std::vector<lt::torrent_handle> const handles = all_handles();
+	SPDLOG_INFO("saving resume files of {} torrents", handles.size());
+
+	// one save_resume_data_alert or failed alert for each
+	resume_alerts_ = int(handles.size());
+	for (auto const &h : handles) {
+		h.save_resume_data();
+	}
+
+	auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(RESUME_SHUTDOWN_TIMEOUT);
+	std::vector<lt::alert *> alerts;
+	while (resume_alerts_ > 0) {
+		auto const now = std::chrono::steady_clock::now();
+		if (now >= deadline) {
+			SPDLOG_WARN("timeout, {} resume files are not saved", resume_alerts_);
+			break;
+		}
+		if (session_.wait_for_alert(deadline - now) == nullptr) {
+			continue;
+		}
+		session_.pop_alerts(&alerts);
+		handle_alerts(alerts);
+	}
+
+	// disk threads hold this in their callbacks
+	std::unique_lock<std::mutex> l(loop_mutex_);
+	loop_cond_.wait(l, [this]() {
+		return resume_writes_ == 0;
+	});
+}
+
+lt::torrent_handle ezio::find_handle(std::string const &hash)
+{
+	// accept upper case too
 	libtorrent::sha1_hash info_hash;
-	ss >> info_hash;
-	auto h = session_.find_torrent(info_hash);
-	if (h.is_valid()) {
-		h.pause();
+	if (!from_hex(hash, info_hash)) {
+		SPDLOG_WARN("invalid hash {}", hash);
+		return {};
 	}
+
+	std::lock_guard<std::mutex> l(status_mutex_);
+	auto it = handles_.find(to_hex(info_hash));
+	return it != handles_.end() ? it->second : lt::torrent_handle{};
 }
 
-void ezio::resume_torrent(std::string hash)
+bool ezio::pause_torrent(std::string hash)
+{
+	SPDLOG_INFO("pause {}", hash);
+	lt::torrent_handle h = find_handle(hash);
+	if (!h.is_valid()) {
+		return false;
+	}
+	// posted to the network thread
+	h.pause();
+	return true;
+}
+
+bool ezio::resume_torrent(std::string hash)
 {
 	SPDLOG_INFO("resume {}", hash);
-	std::stringstream ss(hash);
-	libtorrent::sha1_hash info_hash;
-	ss >> info_hash;
-	auto h = session_.find_torrent(info_hash);
-	if (h.is_valid()) {
-		h.resume();
+	lt::torrent_handle h = find_handle(hash);
+	if (!h.is_valid()) {
+		return false;
 	}
+	h.resume();
+	return true;
 }
 
 bool ezio::get_shutdown()
@@ -159,14 +588,87 @@ bool ezio::get_shutdown()
 	return shutdown_;
 }
 
-void ezio::pop_alerts(std::vector<lt::alert *> *alerts)
+std::string ezio::get_version()
 {
-	session_.pop_alerts(alerts);
+	return GIT_VERSION;
 }
 
-std::string ezio::get_version()
+bool ezio::get_disk_stats(disk_stats &stats)
 {
-	return GIT_VERSION;
+	if (!disk_io_) {
+		return false;
+	}
+
+	stats = disk_io_->get_disk_stats();
+	return true;
+}
+
+bool ezio::get_settings(std::vector<std::string> const &names, setting_list &out, std::string &error)
+{
+	std::vector<std::string> const all = names.empty() ? setting_names() : names;
+	std::lock_guard<std::mutex> l(settings_mutex_);
+	for (auto const &name : all) {
+		std::string value;
+		if (!get_setting(name, settings_, defaults_, value)) {
+			error = "unknown setting " + name;
+			return false;
+		}
+		out.emplace_back(name, value);
+	}
+	return true;
+}
+
+bool ezio::apply_settings(std::string const &profile, setting_list const &settings, setting_list &changed, std::string &error)
+{
+	// held until the session has the pack, so concurrent calls apply in order
+	std::lock_guard<std::mutex> l(settings_mutex_);
+	lt::settings_pack pack;
+	torrent_defaults defaults = defaults_;
+	if (!profile.empty() && !apply_profile(profile, pack, defaults)) {
+		error = "unknown profile " + profile;
+		return false;
+	}
+	for (auto const &s : settings) {
+		if (!set_setting(s.first, s.second, pack, defaults, error)) {
+			return false;
+		}
+	}
+
+	changed = changed_settings(pack, defaults_, defaults);
+	// posted to the network thread
+	session_.apply_settings(pack);
+	merge_settings(settings_, pack);
+
+	SPDLOG_INFO("apply settings {}: {} changed", profile.empty() ? "without profile" : profile, changed.size());
+	for (auto const &c : changed) {
+		SPDLOG_INFO("setting {} = {}", c.first, c.second);
+	}
+
+	bool const limits = defaults.max_uploads != defaults_.max_uploads || defaults.max_connections != defaults_.max_connections;
+	bool const super_seeding = defaults.super_seeding != defaults_.super_seeding;
+	defaults_ = defaults;
+	if (!limits && !super_seeding) {
+		return true;
+	}
+
+	// running torrents added without limits get the new defaults too
+	std::lock_guard<std::mutex> sl(status_mutex_);
+	for (auto const &h : handles_) {
+		if (limits && default_uploads_.count(h.first)) {
+			h.second.set_max_uploads(defaults.max_uploads);
+		}
+		if (limits && default_connections_.count(h.first)) {
+			h.second.set_max_connections(defaults.max_connections);
+		}
+		if (super_seeding && initial_seeds_.count(h.first)) {
+			if (defaults.super_seeding) {
+				h.second.set_flags(lt::torrent_flags::super_seeding);
+			} else {
+				h.second.unset_flags(lt::torrent_flags::super_seeding);
+			}
+		}
+	}
+	return true;
 }
 
 }  // namespace ezio
@@ -2,11 +2,29 @@
 #define __DAEMON_HPP__
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
 #include <vector>
 #include <libtorrent/libtorrent.hpp>
+#include <boost/asio/thread_pool.hpp>
 #include <boost/core/noncopyable.hpp>
 #include "service.hpp"
+#include "disk_stats.hpp"
+#include "resume.hpp"
+#include "profile.hpp"
+#include "torrent_cache.hpp"
+
+// wait for resume files of all torrents at shutdown, in seconds
+#define RESUME_SHUTDOWN_TIMEOUT 10
+// threads reading and parsing .torrent files
+#define TORRENT_LOADER_THREADS 2
 
 namespace ezio
 {
@@ -31,28 +49,149 @@ struct torrent_status {
 	std::string save_path;
 	int64_t last_upload;
 	int64_t last_download;
+	int64_t bytes_durable;
+};
+
+// one of torrent, torrent_path and info_hash is set
+struct add_request {
+	// bencoded .torrent
+	std::string torrent;
+	// local file, file:// or http:// url
+	std::string torrent_path;
+	// hex info hash of a torrent in the parsed torrent cache
+	std::string info_hash;
+	std::string save_path;
+	bool seeding_mode{false};
+	// 0 for torrent_defaults
+	int max_uploads{0};
+	int max_connections{0};
+	bool sequential_download{false};
+	// bencoded libtorrent resume data, if empty the resume file is used
+	std::string resume_data;
+	// O_DIRECT for this partition even without --direct-io
+	bool direct_io{false};
 };
 
+class raw_disk_io;
+
 class ezio : boost::noncopyable
 {
 public:
-	ezio(lt::session &);
+	using alert_handler = std::function<void(lt::alert *)>;
+	// lowercase hex info hash and save path
+	using finished_handler = std::function<void(std::string const &, std::string const &)>;
+	using tick_handler = std::function<void()>;
+	using add_handler = std::function<void(lt::error_code const &)>;
+	using status_handler = std::function<void()>;
+
+	// disk_io is nullptr in file mode, torrent_cache_size is --torrent-cache
+	ezio(lt::session &, raw_disk_io *disk_io, std::size_t torrent_cache_size);
 	~ezio() = default;
 
+	// handlers are called on the event loop, add them before run
+	void on_alert(alert_handler);
+	void on_finished(finished_handler);
+	void every(std::chrono::milliseconds interval, tick_handler);
+	// save resume files in dir every interval, at finish and at shutdown,
+	// and resume torrents added later from them
+	void enable_resume(std::string dir, std::chrono::seconds interval);
+
 	void stop();
-	void wait(int interval_second);
-	void add_torrent(std::string torrent_body, std::string save_path, bool seeding_mode, int max_uploads, int max_connections, bool sequential_download);
-	std::map<std::string, torrent_status> get_torrent_status(std::vector<std::string> hashes);
-	void pause_torrent(std::string hash);
-	void resume_torrent(std::string hash);
+	// event loop, wakes up on alerts, handler timers and shutdown
+	void run();
+	// wait for torrents still loaded or parsed after run, their done is
+	// called before it returns. call it before the gRPC service stops
+	void join_loader();
+	// none of these block on the session. torrents are loaded and parsed
+	// in loader threads, done is called there on failure, otherwise on
+	// the event loop when libtorrent has added the torrent, or failed to
+	void add_torrent(add_request request, add_handler done);
+	// false if the torrent is not found
+	bool pause_torrent(std::string hash);
+	bool resume_torrent(std::string hash);
+	// invalid handle if not found, hash is case insensitive
+	lt::torrent_handle find_handle(std::string const &hash);
 	bool get_shutdown();
-	void pop_alerts(std::vector<lt::alert *> *);
 	std::string get_version();
+	// false in file mode
+	bool get_disk_stats(disk_stats &);
+
+	// session settings and torrent defaults by name, all if names is empty.
+	// false if a name is unknown
+	bool get_settings(std::vector<std::string> const &names, setting_list &out, std::string &error);
+	// apply profile, then settings on top of it, to the running session
+	// and torrents added without limits. nothing is applied if one of
+	// them is invalid. changed is filled with the new values
+	bool apply_settings(std::string const &profile, setting_list const &settings, setting_list &changed, std::string &error);
+
+	// status cache, fed by state_update_alert.
+	// ask libtorrent for torrents changed since last call
+	void post_torrent_updates();
+	// done is called on the event loop once the cache is refreshed, or
+	// right away after shutdown
+	void request_status(status_handler done);
+	// torrents in hashes, all if empty. hashes are case insensitive, the
+	// result is keyed by them as given
+	std::map<std::string, torrent_status> get_cached_status(std::vector<std::string> const &hashes);
 
 private:
+	struct tick {
+		std::chrono::milliseconds interval;
+		std::chrono::steady_clock::time_point next;
+		tick_handler handler;
+	};
+
+	// add a parsed torrent on the calling thread
+	void add_parsed(std::shared_ptr<lt::torrent_info> ti, add_request const &request, add_handler done);
+	torrent_status to_status(lt::torrent_status const &, lt::time_point now) const;
+	void handle_alerts(std::vector<lt::alert *> const &alerts);
+	std::vector<lt::torrent_handle> all_handles();
+	// fdatasync the partition then write the file, in a disk thread
+	void write_resume(lt::add_torrent_params const &params);
+	void save_all_resume();
+
 	lt::session &session_;
+	// nullptr in file mode
+	raw_disk_io *disk_io_;
 
 	std::atomic_bool shutdown_;
+
+	// event loop
+	std::mutex loop_mutex_;
+	std::condition_variable loop_cond_;
+	bool alerts_pending_{false};
+	std::vector<alert_handler> alert_handlers_;
+	std::vector<finished_handler> finished_handlers_;
+	std::vector<tick> ticks_;
+
+	// nullptr if --resume-dir is not set, read only after run
+	std::shared_ptr<resume_store> resume_;
+	// save_resume_data alerts expected at shutdown
+	int resume_alerts_{0};
+	// files being written in disk threads, under loop_mutex_
+	int resume_writes_{0};
+
+	// all keyed by lowercase hex info hash
+	std::mutex status_mutex_;
+	std::map<std::string, lt::torrent_status> status_cache_;
+	// filled by add_torrent_alert, so pause and resume don't need find_torrent
+	std::map<std::string, lt::torrent_handle> handles_;
+	std::multimap<std::string, add_handler> pending_adds_;
+	std::vector<status_handler> pending_status_;
+	// added in seeding mode, for super seeding
+	std::set<std::string> initial_seeds_;
+	// added with max_uploads or max_connections 0, they follow defaults_
+	std::set<std::string> default_uploads_;
+	std::set<std::string> default_connections_;
+
+	// what the session runs with, libtorrent is only asked once at start
+	std::mutex settings_mutex_;
+	lt::settings_pack settings_;
+	torrent_defaults defaults_;
+
+	torrent_cache torrents_;
+	// last member, joined before the rest is destroyed
+	boost::asio::thread_pool loader_;
 };
 
 }  // namespace ezio
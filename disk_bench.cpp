@@ -0,0 +1,740 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/post.hpp>
+#include <spdlog/spdlog.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include "spdlog/cfg/env.h"
+
+#include <libtorrent/libtorrent.hpp>
+#include <libtorrent/hasher.hpp>
+
+#include "config.hpp"
+#include "disk_stats.hpp"
+#include "raw_disk_io.hpp"
+
+// extents of synthetic partclone layout are aligned to filesystem blocks
+#define LAYOUT_ALIGNMENT 4096
+// share of reads that go to the hot set in seed pattern, in percent
+#define HOT_READ_PERCENT 90
+
+namespace
+{
+struct bench_options {
+	std::string target;
+	// create or grow a regular file to it, 0 to use the current size
+	std::int64_t size_mb = 1024;
+	int piece_kb = 16 * 1024;
+	// average extent, smaller is more fragmented
+	int extent_kb = 4 * 1024;
+	// percent of target used by torrent data, the rest is gaps
+	int used_percent = 50;
+	std::string phases = "write,hash,read";
+	std::string write_pattern = "random";
+	std::string read_pattern = "seed";
+	int concurrency = 64;
+	int pieces_in_flight = 8;
+	// 0 for one read per block
+	std::int64_t reads = 0;
+	int hot_set_percent = 10;
+	std::uint64_t seed = 1;
+	bool verify = false;
+	bool keep_cache = false;
+	std::string output = "-";
+};
+
+// per phase results, latency from issue to handler
+struct phase_result {
+	std::string name;
+	std::int64_t jobs{0};
+	std::int64_t bytes{0};
+	double seconds{0};
+	double sync_seconds{0};
+	std::int64_t errors{0};
+	std::int64_t mismatches{0};
+	// async_write returned true, the bench waited for the observer
+	std::int64_t write_stalls{0};
+	// delta of buffer pool stalls
+	std::int64_t pool_stalls{0};
+	std::int64_t read_syscalls{0};
+	std::int64_t write_syscalls{0};
+	ezio::latency_histogram read;
+	ezio::latency_histogram write;
+	ezio::latency_histogram hash;
+};
+
+struct block_ref {
+	int piece;
+	int offset;
+};
+
+// read and write syscalls of this process, io_uring submissions are not
+// counted
+void syscall_counts(std::int64_t &reads, std::int64_t &writes)
+{
+	reads = 0;
+	writes = 0;
+	std::ifstream in("/proc/self/io");
+	std::string key;
+	std::int64_t value = 0;
+	while (in >> key >> value) {
+		if (key == "syscr:") {
+			reads = value;
+		} else if (key == "syscw:") {
+			writes = value;
+		}
+	}
+}
+
+std::int64_t align_down(std::int64_t v)
+{
+	return v / LAYOUT_ALIGNMENT * LAYOUT_ALIGNMENT;
+}
+
+// partclone style torrent, one file per used extent named by its hex
+// offset on the partition
+void build_layout(lt::file_storage &fs, std::int64_t device_size, bench_options const &o, std::mt19937_64 &rng)
+{
+	std::int64_t const extent = std::max<std::int64_t>(align_down(std::int64_t(o.extent_kb) * 1024), LAYOUT_ALIGNMENT);
+	std::int64_t const data = align_down(device_size / 100 * std::min(std::max(o.used_percent, 1), 100));
+	std::int64_t const count = std::max<std::int64_t>(data / extent, 1);
+	std::int64_t const avg_gap = (device_size - data) / count;
+
+	std::uniform_int_distribution<std::int64_t> gap_dist(0, 2 * avg_gap);
+	std::uniform_int_distribution<std::int64_t> length_dist(extent / 2, extent * 3 / 2);
+
+	fs.set_piece_length(o.piece_kb * 1024);
+	fs.set_name("bench");
+
+	std::int64_t pos = 0;
+	std::int64_t placed = 0;
+	while (placed < data && pos < device_size) {
+		std::int64_t gap = avg_gap > 0 ? align_down(gap_dist(rng)) : 0;
+		if (pos + gap >= device_size) {
+			gap = 0;
+		}
+		std::int64_t const length = std::min({std::max<std::int64_t>(align_down(length_dist(rng)), LAYOUT_ALIGNMENT),
+			data - placed, device_size - pos - gap});
+		if (length <= 0) {
+			break;
+		}
+
+		pos += gap;
+		char name[32];
+		std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(pos));
+		fs.add_file(std::string("bench/") + name, length);
+		pos += length;
+		placed += length;
+	}
+
+	fs.set_num_pieces(int((fs.total_size() + fs.piece_length() - 1) / fs.piece_length()));
+}
+
+// deterministic content of a block, never all zeros
+void fill_block(char *buf, int length, std::uint64_t seed, int piece, int offset)
+{
+	// splitmix64
+	std::uint64_t x = seed ^ (std::uint64_t(piece) << 32) ^ std::uint64_t(offset);
+	for (int i = 0; i < length; i += 8) {
+		x += 0x9e3779b97f4a7c15ULL;
+		std::uint64_t z = x;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		z ^= z >> 31;
+		std::memcpy(buf + i, &z, std::min(8, length - i));
+	}
+}
+
+struct bench_observer : lt::disk_observer {
+	std::function<void()> resume;
+
+	void on_disk() override
+	{
+		if (resume) {
+			resume();
+		}
+	}
+};
+
+class disk_bench
+{
+public:
+	disk_bench(lt::io_context &ioc, ezio::raw_disk_io &disk, lt::file_storage const &fs,
+		std::string const &target, bench_options const &o) :
+		ioc_(ioc),
+		work_(boost::asio::make_work_guard(ioc)),
+		disk_(disk),
+		fs_(fs),
+		target_(target),
+		o_(o),
+		rng_(o.seed),
+		buf_(DEFAULT_BLOCK_SIZE)
+	{
+	}
+
+	bool open()
+	{
+		lt::aux::vector<lt::download_priority_t, lt::file_index_t> priorities;
+		lt::storage_params params(fs_, nullptr, target_, lt::storage_mode_sparse, priorities, lt::sha1_hash());
+		try {
+			holder_ = disk_.new_torrent(params, nullptr);
+		} catch (std::exception const &e) {
+			SPDLOG_ERROR("failed to add storage {}: {}", target_, e.what());
+			return false;
+		}
+		storage_ = static_cast<lt::storage_index_t>(holder_);
+		return true;
+	}
+
+	void close()
+	{
+		// remove_torrent
+		holder_.reset();
+		disk_.abort(true);
+	}
+
+	void run_phase(std::string const &name, phase_result &r)
+	{
+		r.name = name;
+		std::int64_t const stalls = pool_stalls();
+		std::int64_t reads = 0;
+		std::int64_t writes = 0;
+		syscall_counts(reads, writes);
+
+		auto const start = std::chrono::steady_clock::now();
+		if (name == "write") {
+			write_phase(r);
+		} else if (name == "hash") {
+			hash_phase(r);
+		} else {
+			read_phase(r);
+		}
+		r.seconds = seconds_since(start);
+
+		if (name == "write") {
+			auto const sync_start = std::chrono::steady_clock::now();
+			sync();
+			r.sync_seconds = seconds_since(sync_start);
+		}
+
+		std::int64_t reads_after = 0;
+		std::int64_t writes_after = 0;
+		syscall_counts(reads_after, writes_after);
+		r.read_syscalls = reads_after - reads;
+		r.write_syscalls = writes_after - writes;
+		r.pool_stalls = pool_stalls() - stalls;
+
+		// the next phase starts cold
+		if (!o_.keep_cache) {
+			drop_cache();
+		}
+	}
+
+private:
+	static double seconds_since(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	static std::chrono::microseconds since(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+	}
+
+	template<typename Pred>
+	void run_until(Pred done)
+	{
+		while (!done()) {
+			ioc_.run_one();
+		}
+	}
+
+	std::int64_t pool_stalls() const
+	{
+		std::int64_t n = 0;
+		for (auto const &p : disk_.get_disk_stats().pools) {
+			n += p.stalls;
+		}
+		return n;
+	}
+
+	int block_length(block_ref const &b) const
+	{
+		return std::min(DEFAULT_BLOCK_SIZE, fs_.piece_size(lt::piece_index_t(b.piece)) - b.offset);
+	}
+
+	int blocks_in_piece(int piece) const
+	{
+		return (fs_.piece_size(lt::piece_index_t(piece)) + DEFAULT_BLOCK_SIZE - 1) / DEFAULT_BLOCK_SIZE;
+	}
+
+	lt::sha1_hash expected_hash(int piece)
+	{
+		lt::hasher h;
+		int const size = fs_.piece_size(lt::piece_index_t(piece));
+		for (int offset = 0; offset < size; offset += DEFAULT_BLOCK_SIZE) {
+			int const length = std::min(DEFAULT_BLOCK_SIZE, size - offset);
+			fill_block(buf_.data(), length, o_.seed, piece, offset);
+			h.update(buf_.data(), length);
+		}
+		return h.final();
+	}
+
+	// sequential, or rarest first: random pieces, several downloading at
+	// the same time with their blocks interleaved like from many peers
+	std::vector<block_ref> write_order()
+	{
+		std::vector<int> pieces(std::size_t(fs_.num_pieces()));
+		for (std::size_t i = 0; i < pieces.size(); i++) {
+			pieces[i] = int(i);
+		}
+		int group = 1;
+		if (o_.write_pattern == "random") {
+			std::shuffle(pieces.begin(), pieces.end(), rng_);
+			group = std::max(o_.pieces_in_flight, 1);
+		}
+
+		std::vector<block_ref> order;
+		for (std::size_t first = 0; first < pieces.size(); first += std::size_t(group)) {
+			std::size_t const last = std::min(pieces.size(), first + std::size_t(group));
+			for (int offset = 0; offset < fs_.piece_length(); offset += DEFAULT_BLOCK_SIZE) {
+				for (std::size_t i = first; i < last; i++) {
+					if (offset < fs_.piece_size(lt::piece_index_t(pieces[i]))) {
+						order.push_back({pieces[i], offset});
+					}
+				}
+			}
+		}
+		return order;
+	}
+
+	void hash_done(phase_result &r, int piece, lt::sha1_hash const &h, lt::storage_error const &error)
+	{
+		if (error) {
+			r.errors++;
+		} else if (o_.verify && !(h == expected_hash(piece))) {
+			r.mismatches++;
+		}
+	}
+
+	void write_phase(phase_result &r)
+	{
+		std::vector<block_ref> const order = write_order();
+		std::vector<int> left(std::size_t(fs_.num_pieces()));
+		for (int p = 0; p < fs_.num_pieces(); p++) {
+			left[std::size_t(p)] = blocks_in_piece(p);
+		}
+
+		std::size_t next = 0;
+		int writes = 0;
+		int hashes = 0;
+		bool stalled = false;
+		auto observer = std::make_shared<bench_observer>();
+		std::function<void()> issue;
+
+		// hash each piece when its last block is written, as libtorrent does
+		auto written = [&](block_ref const &b, int length, std::chrono::steady_clock::time_point start,
+						   lt::storage_error const &error) {
+			writes--;
+			r.write.record(since(start));
+			r.jobs++;
+			r.bytes += length;
+			if (error) {
+				r.errors++;
+			}
+
+			if (--left[std::size_t(b.piece)] == 0) {
+				hashes++;
+				auto const hash_start = std::chrono::steady_clock::now();
+				disk_.async_hash(storage_, lt::piece_index_t(b.piece), {}, lt::disk_interface::v1_hash,
+					[&, hash_start](lt::piece_index_t p, lt::sha1_hash const &h, lt::storage_error const &e) {
+						hashes--;
+						r.hash.record(since(hash_start));
+						hash_done(r, static_cast<int>(p), h, e);
+					});
+			}
+			issue();
+		};
+
+		issue = [&]() {
+			while (!stalled && writes < o_.concurrency && next < order.size()) {
+				block_ref const b = order[next++];
+				int const length = block_length(b);
+				fill_block(buf_.data(), length, o_.seed, b.piece, b.offset);
+
+				writes++;
+				auto const start = std::chrono::steady_clock::now();
+				lt::peer_request const req{lt::piece_index_t(b.piece), b.offset, length};
+				// the buffer is copied before it returns
+				bool const full = disk_.async_write(storage_, req, buf_.data(), observer,
+					[&written, b, length, start](lt::storage_error const &error) {
+						written(b, length, start, error);
+					});
+				if (full) {
+					stalled = true;
+					r.write_stalls++;
+				}
+			}
+			disk_.submit_jobs();
+		};
+		observer->resume = [&]() {
+			stalled = false;
+			issue();
+		};
+
+		issue();
+		run_until([&]() {
+			return next == order.size() && writes == 0 && hashes == 0;
+		});
+		observer->resume = nullptr;
+	}
+
+	// recheck, pieces are read back from the partition
+	void hash_phase(phase_result &r)
+	{
+		int next = 0;
+		int hashes = 0;
+		std::function<void()> issue = [&]() {
+			while (hashes < o_.concurrency && next < fs_.num_pieces()) {
+				int const piece = next++;
+				hashes++;
+				auto const start = std::chrono::steady_clock::now();
+				disk_.async_hash(storage_, lt::piece_index_t(piece), {}, lt::disk_interface::v1_hash,
+					[&, start](lt::piece_index_t p, lt::sha1_hash const &h, lt::storage_error const &e) {
+						hashes--;
+						r.hash.record(since(start));
+						r.jobs++;
+						r.bytes += fs_.piece_size(p);
+						hash_done(r, static_cast<int>(p), h, e);
+						issue();
+					});
+			}
+			disk_.submit_jobs();
+		};
+
+		issue();
+		run_until([&]() {
+			return next == fs_.num_pieces() && hashes == 0;
+		});
+	}
+
+	block_ref next_read(std::int64_t i)
+	{
+		int const pieces = fs_.num_pieces();
+		if (o_.read_pattern == "seq") {
+			std::int64_t const blocks_per_piece = fs_.piece_length() / DEFAULT_BLOCK_SIZE;
+			std::int64_t const block = i % (std::int64_t(pieces) * blocks_per_piece);
+			block_ref b{int(block / blocks_per_piece), int(block % blocks_per_piece) * DEFAULT_BLOCK_SIZE};
+			// blocks past the end of the last piece wrap to the start
+			return b.offset < fs_.piece_size(lt::piece_index_t(b.piece)) ? b : block_ref{0, 0};
+		}
+
+		int piece = 0;
+		if (o_.read_pattern == "seed") {
+			// most peers want the same few pieces
+			int const hot = std::max(pieces * std::min(std::max(o_.hot_set_percent, 1), 100) / 100, 1);
+			std::uniform_int_distribution<int> percent(0, 99);
+			bool const in_hot_set = percent(rng_) < HOT_READ_PERCENT || hot == pieces;
+			piece = in_hot_set ? std::uniform_int_distribution<int>(0, hot - 1)(rng_)
+							   : std::uniform_int_distribution<int>(hot, pieces - 1)(rng_);
+		} else {
+			piece = std::uniform_int_distribution<int>(0, pieces - 1)(rng_);
+		}
+		int const block = std::uniform_int_distribution<int>(0, blocks_in_piece(piece) - 1)(rng_);
+		return {piece, block * DEFAULT_BLOCK_SIZE};
+	}
+
+	void read_phase(phase_result &r)
+	{
+		std::int64_t const total = o_.reads > 0 ? o_.reads : (fs_.total_size() + DEFAULT_BLOCK_SIZE - 1) / DEFAULT_BLOCK_SIZE;
+		std::int64_t next = 0;
+		int reads = 0;
+		std::vector<char> expected(DEFAULT_BLOCK_SIZE);
+
+		std::function<void()> issue = [&]() {
+			while (reads < o_.concurrency && next < total) {
+				block_ref const b = next_read(next++);
+				int const length = block_length(b);
+				reads++;
+				auto const start = std::chrono::steady_clock::now();
+				lt::peer_request const req{lt::piece_index_t(b.piece), b.offset, length};
+				disk_.async_read(storage_, req,
+					[&, b, length, start](lt::disk_buffer_holder buffer, lt::storage_error const &error) {
+						reads--;
+						r.read.record(since(start));
+						r.jobs++;
+						r.bytes += length;
+						if (error) {
+							r.errors++;
+						} else if (o_.verify) {
+							fill_block(expected.data(), length, o_.seed, b.piece, b.offset);
+							if (std::memcmp(buffer.data(), expected.data(), std::size_t(length)) != 0) {
+								r.mismatches++;
+							}
+						}
+						issue();
+					});
+			}
+			disk_.submit_jobs();
+		};
+
+		issue();
+		run_until([&]() {
+			return next == total && reads == 0;
+		});
+	}
+
+	void sync()
+	{
+		bool done = false;
+		disk_.sync_storage(target_, [this, &done](bool ok) {
+			if (!ok) {
+				SPDLOG_WARN("failed to sync {}", target_);
+			}
+			// called in a disk thread
+			boost::asio::post(ioc_, [&done]() {
+				done = true;
+			});
+		});
+		run_until([&done]() {
+			return done;
+		});
+	}
+
+	void drop_cache()
+	{
+		int const fd = ::open(target_.c_str(), O_RDONLY);
+		if (fd < 0) {
+			return;
+		}
+		if (posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0) {
+			SPDLOG_WARN("failed to drop page cache of {}", target_);
+		}
+		::close(fd);
+	}
+
+	lt::io_context &ioc_;
+	boost::asio::executor_work_guard<lt::io_context::executor_type> work_;
+	ezio::raw_disk_io &disk_;
+	lt::file_storage const &fs_;
+	std::string target_;
+	bench_options const &o_;
+	std::mt19937_64 rng_;
+	// one block of generated data, async_write copies it
+	std::vector<char> buf_;
+	lt::storage_holder holder_;
+	lt::storage_index_t storage_{0};
+};
+
+std::string json_string(std::string const &s)
+{
+	std::string out = "\"";
+	for (char const c : s) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+		}
+		out += c;
+	}
+	return out + "\"";
+}
+
+void write_latency(std::ostream &out, char const *name, ezio::latency_summary const &l)
+{
+	out << "\"" << name << "\": {\"count\": " << l.count << ", \"p50_us\": " << l.p50_us
+		<< ", \"p99_us\": " << l.p99_us << ", \"max_us\": " << l.max_us << "}";
+}
+
+void write_report(std::ostream &out, bench_options const &o, ezio::config const &cfg,
+	lt::file_storage const &fs, std::deque<phase_result> const &phases, ezio::disk_stats const &s)
+{
+	out << "{\n";
+	out << "  \"target\": " << json_string(o.target) << ",\n";
+	out << "  \"torrent_bytes\": " << fs.total_size() << ",\n";
+	out << "  \"files\": " << fs.num_files() << ",\n";
+	out << "  \"piece_length\": " << fs.piece_length() << ",\n";
+	out << "  \"write_pattern\": " << json_string(o.write_pattern) << ",\n";
+	out << "  \"read_pattern\": " << json_string(o.read_pattern) << ",\n";
+	out << "  \"concurrency\": " << o.concurrency << ",\n";
+	out << "  \"io_uring\": " << (cfg.io_uring_flag ? "true" : "false") << ",\n";
+	out << "  \"phases\": [";
+	for (std::size_t i = 0; i < phases.size(); i++) {
+		phase_result const &r = phases[i];
+		double const mb_per_s = r.seconds > 0 ? double(r.bytes) / 1024 / 1024 / r.seconds : 0;
+		out << (i ? ",\n" : "\n") << "    {\"name\": " << json_string(r.name) << ", \"jobs\": " << r.jobs
+			<< ", \"bytes\": " << r.bytes << ", \"seconds\": " << r.seconds << ", \"sync_seconds\": " << r.sync_seconds
+			<< ", \"mb_per_s\": " << mb_per_s << ", \"errors\": " << r.errors << ", \"mismatches\": " << r.mismatches
+			<< ", \"write_stalls\": " << r.write_stalls << ", \"pool_stalls\": " << r.pool_stalls
+			<< ", \"read_syscalls\": " << r.read_syscalls << ", \"write_syscalls\": " << r.write_syscalls;
+		for (auto const &l : {std::make_pair("read", &r.read), std::make_pair("write", &r.write), std::make_pair("hash", &r.hash)}) {
+			if (l.second->count() > 0) {
+				out << ", ";
+				write_latency(out, l.first, l.second->summary());
+			}
+		}
+		out << "}";
+	}
+	out << "\n  ],\n";
+
+	// totals of raw_disk_io, latency is from queued to done
+	out << "  \"disk\": {\"pools\": [";
+	for (std::size_t i = 0; i < s.pools.size(); i++) {
+		ezio::pool_stats const &p = s.pools[i];
+		out << (i ? ", " : "") << "{\"name\": " << json_string(p.name) << ", \"stalls\": " << p.stalls
+			<< ", \"limit\": " << p.limit << ", \"capacity\": " << p.capacity << "}";
+	}
+	out << "], ";
+	write_latency(out, "read", s.read_latency);
+	out << ", ";
+	write_latency(out, "write", s.write_latency);
+	out << ", ";
+	write_latency(out, "hash", s.hash_latency);
+	out << ", \"coalesced_syscalls\": " << s.coalesced_syscalls << ", \"saved_syscalls\": " << s.saved_syscalls
+		<< ", \"hash_hits\": " << s.hash_hits << ", \"hash_misses\": " << s.hash_misses
+		<< ", \"memory_reads\": " << s.memory_reads << ", \"mmap_reads\": " << s.mmap_reads
+		<< ", \"read_cache_hits\": " << s.read_cache_hits << ", \"read_cache_misses\": " << s.read_cache_misses
+		<< ", \"zero_blocks\": " << s.zero_blocks << "}\n";
+	out << "}\n";
+}
+}  // namespace
+
+int main(int argc, char **argv)
+{
+	// stdout is for the report
+	spdlog::set_default_logger(spdlog::stderr_color_mt("stderr"));
+	spdlog::cfg::load_env_levels();
+
+	bench_options o;
+	ezio::config cfg;
+
+	// clang-format off
+	bpo::options_description desc("Benchmark raw_disk_io on a synthetic partclone torrent, data on target is destroyed");
+	desc.add_options()
+		("help,h", "some help")
+		("target", bpo::value<std::string>(&o.target)->required(), "file, loop device or partition to write")
+		("size", bpo::value<std::int64_t>(&o.size_mb), "create or grow a regular file to N MB, 0 to use its size, default is 1024")
+		("piece-size", bpo::value<int>(&o.piece_kb), "piece size in KB, default is 16384")
+		("extent-size", bpo::value<int>(&o.extent_kb), "average extent size in KB, smaller is more fragmented, default is 4096")
+		("used", bpo::value<int>(&o.used_percent), "percent of target used by the torrent, default is 50")
+		("phases", bpo::value<std::string>(&o.phases), "comma separated phases of write, hash and read, default is write,hash,read")
+		("write-pattern", bpo::value<std::string>(&o.write_pattern)->notifier(ezio::one_of("write-pattern", {"seq", "random"})), "seq or random (rarest first), default is random")
+		("read-pattern", bpo::value<std::string>(&o.read_pattern)->notifier(ezio::one_of("read-pattern", {"seq", "random", "seed"})), "seq, random or seed (hot set), default is seed")
+		("concurrency", bpo::value<int>(&o.concurrency), "jobs in flight, default is 64")
+		("pieces-in-flight", bpo::value<int>(&o.pieces_in_flight), "pieces downloading at the same time in random pattern, default is 8")
+		("reads", bpo::value<std::int64_t>(&o.reads), "block reads in read phase, default is one per block")
+		("hot-set", bpo::value<int>(&o.hot_set_percent), "percent of pieces that get 90% of reads in seed pattern, default is 10")
+		("seed", bpo::value<std::uint64_t>(&o.seed), "seed of layout, data and access pattern, default is 1")
+		("verify", bpo::bool_switch(&o.verify)->default_value(false), "check hashes and read data")
+		("keep-cache", bpo::bool_switch(&o.keep_cache)->default_value(false), "don't drop page cache of target between phases")
+		("output,o", bpo::value<std::string>(&o.output), "JSON report file, default is stdout")
+	;
+	// clang-format on
+	cfg.add_disk_options(desc);
+
+	bpo::variables_map vmap;
+	try {
+		bpo::store(bpo::parse_command_line(argc, argv, desc), vmap);
+		if (vmap.count("help")) {
+			std::cout << desc << std::endl;
+			return 0;
+		}
+		bpo::notify(vmap);
+	} catch (bpo::error const &e) {
+		std::cerr << e.what() << std::endl
+				  << desc << std::endl;
+		return 1;
+	}
+
+	if (o.piece_kb < 16 || o.piece_kb % 16 != 0) {
+		std::cerr << "--piece-size must be a multiple of 16" << std::endl;
+		return 1;
+	}
+	if (o.concurrency < 1) {
+		std::cerr << "--concurrency must be positive" << std::endl;
+		return 1;
+	}
+
+	int const fd = ::open(o.target.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		SPDLOG_ERROR("failed to open {}: {}", o.target, strerror(errno));
+		return 1;
+	}
+	struct stat st;
+	fstat(fd, &st);
+	std::int64_t const wanted = o.size_mb * 1024 * 1024;
+	if (S_ISREG(st.st_mode) && wanted > st.st_size && ftruncate(fd, wanted) != 0) {
+		SPDLOG_ERROR("failed to resize {}: {}", o.target, strerror(errno));
+		::close(fd);
+		return 1;
+	}
+	std::int64_t const device_size = lseek(fd, 0, SEEK_END);
+	::close(fd);
+	if (device_size < LAYOUT_ALIGNMENT) {
+		SPDLOG_ERROR("{} is too small", o.target);
+		return 1;
+	}
+
+	std::mt19937_64 rng(o.seed);
+	lt::file_storage fs;
+	build_layout(fs, device_size, o, rng);
+	SPDLOG_INFO("{} extents, {} bytes in {} pieces on {} bytes", fs.num_files(), fs.total_size(), fs.num_pieces(), device_size);
+
+	// same defaults as ezio
+	int const cpus = std::max<int>(std::thread::hardware_concurrency(), 1);
+	lt::settings_pack settings;
+	settings.set_int(lt::settings_pack::aio_threads, cfg.aio_threads > 0 ? cfg.aio_threads : std::min(std::max(cpus, 2), 16));
+	settings.set_int(lt::settings_pack::hashing_threads, cfg.hashing_threads > 0 ? cfg.hashing_threads : cpus);
+
+	lt::io_context ioc;
+	std::deque<phase_result> phases;
+	ezio::disk_stats stats;
+	{
+		ezio::raw_disk_io disk(ioc, settings, cfg);
+		disk_bench bench(ioc, disk, fs, o.target, o);
+		if (!bench.open()) {
+			return 1;
+		}
+
+		std::stringstream list(o.phases);
+		std::string name;
+		while (std::getline(list, name, ',')) {
+			if (name != "write" && name != "hash" && name != "read") {
+				SPDLOG_ERROR("unknown phase {}", name);
+				continue;
+			}
+			SPDLOG_INFO("{} phase", name);
+			phases.emplace_back();
+			bench.run_phase(name, phases.back());
+		}
+
+		stats = disk.get_disk_stats();
+		bench.close();
+	}
+
+	if (o.output == "-") {
+		write_report(std::cout, o, cfg, fs, phases, stats);
+	} else {
+		std::ofstream out(o.output);
+		write_report(out, o, cfg, fs, phases, stats);
+		if (!out) {
+			SPDLOG_ERROR("failed to write {}", o.output);
+			return 1;
+		}
+	}
+	return 0;
+}
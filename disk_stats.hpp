@@ -0,0 +1,191 @@
+#ifndef __DISK_STATS_HPP__
+#define __DISK_STATS_HPP__
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// values below 8 us have their own bucket, above that each power of 2
+// is split into 8 linear sub buckets, so the error is at most 12.5%
+#define HISTOGRAM_SUB_BUCKETS 8
+// up to 2^36 us, about 19 hours
+#define HISTOGRAM_BUCKETS (36 * HISTOGRAM_SUB_BUCKETS)
+
+namespace ezio
+{
+// snapshot of latency_histogram, in microseconds
+struct latency_summary {
+	std::int64_t count{0};
+	std::int64_t sum_us{0};
+	std::int64_t max_us{0};
+	std::int64_t p50_us{0};
+	std::int64_t p90_us{0};
+	std::int64_t p99_us{0};
+	std::int64_t p999_us{0};
+};
+
+// HDR style latency histogram, record is lock free and cheap enough for
+// every disk job
+class latency_histogram
+{
+public:
+	void record(std::chrono::microseconds d)
+	{
+		std::uint64_t const v = d.count() > 0 ? std::uint64_t(d.count()) : 0;
+		counts_[index(v)].fetch_add(1, std::memory_order_relaxed);
+		count_.fetch_add(1, std::memory_order_relaxed);
+		sum_.fetch_add(v, std::memory_order_relaxed);
+
+		std::uint64_t max = max_.load(std::memory_order_relaxed);
+		while (max < v && !max_.compare_exchange_weak(max, v, std::memory_order_relaxed)) {
+		}
+	}
+
+	std::int64_t count() const
+	{
+		return std::int64_t(count_.load(std::memory_order_relaxed));
+	}
+
+	std::int64_t sum_us() const
+	{
+		return std::int64_t(sum_.load(std::memory_order_relaxed));
+	}
+
+	latency_summary summary() const
+	{
+		std::array<std::uint64_t, HISTOGRAM_BUCKETS> counts;
+		std::uint64_t total = 0;
+		for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+			counts[i] = counts_[i].load(std::memory_order_relaxed);
+			total += counts[i];
+		}
+
+		latency_summary s;
+		s.count = std::int64_t(total);
+		s.sum_us = sum_us();
+		s.max_us = std::int64_t(max_.load(std::memory_order_relaxed));
+		s.p50_us = percentile(counts, total, 0.5);
+		s.p90_us = percentile(counts, total, 0.9);
+		s.p99_us = percentile(counts, total, 0.99);
+		s.p999_us = percentile(counts, total, 0.999);
+		return s;
+	}
+
+private:
+	static int index(std::uint64_t v)
+	{
+		if (v < HISTOGRAM_SUB_BUCKETS) {
+			return int(v);
+		}
+
+		int const msb = 63 - __builtin_clzll(v);
+		int const shift = msb - 3;
+		int const i = (shift + 1) * HISTOGRAM_SUB_BUCKETS + int((v >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+		return i < HISTOGRAM_BUCKETS ? i : HISTOGRAM_BUCKETS - 1;
+	}
+
+	// largest value in bucket i
+	static std::int64_t upper(int i)
+	{
+		if (i < HISTOGRAM_SUB_BUCKETS) {
+			return i;
+		}
+
+		int const shift = i / HISTOGRAM_SUB_BUCKETS - 1;
+		std::int64_t const lower = std::int64_t(HISTOGRAM_SUB_BUCKETS + i % HISTOGRAM_SUB_BUCKETS) << shift;
+		return lower + (std::int64_t(1) << shift) - 1;
+	}
+
+	static std::int64_t percentile(std::array<std::uint64_t, HISTOGRAM_BUCKETS> const &counts,
+		std::uint64_t total, double p)
+	{
+		if (total == 0) {
+			return 0;
+		}
+
+		std::uint64_t const rank = std::uint64_t(double(total) * p);
+		std::uint64_t seen = 0;
+		for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+			seen += counts[i];
+			if (seen > rank) {
+				return upper(i);
+			}
+		}
+		return upper(HISTOGRAM_BUCKETS - 1);
+	}
+
+	std::array<std::atomic<std::uint64_t>, HISTOGRAM_BUCKETS> counts_{};
+	std::atomic<std::uint64_t> count_{0};
+	std::atomic<std::uint64_t> sum_{0};
+	std::atomic<std::uint64_t> max_{0};
+};
+
+// snapshots for GetDiskStats
+struct pool_stats {
+	std::string name;
+	int in_use;
+	int limit;
+	int capacity;
+	std::int64_t stalls;
+	std::int64_t latency_us;
+};
+
+struct storage_disk_stats {
+	int index;
+	std::string path;
+	std::int64_t read_jobs;
+	std::int64_t read_bytes;
+	std::int64_t write_jobs;
+	std::int64_t write_bytes;
+	std::int64_t hash_jobs;
+	std::int64_t hash_bytes;
+	std::int64_t written_bytes;
+	std::int64_t durable_bytes;
+	int writes_inflight;
+	bool elevator;
+};
+
+struct queue_stats {
+	// major:minor of the disk, 0:0 if shared by all
+	std::string disk;
+	int pending;
+	std::int64_t read_jobs;
+	std::int64_t read_wait_us;
+	std::int64_t read_max_wait_us;
+	std::int64_t write_jobs;
+	std::int64_t write_wait_us;
+	std::int64_t write_max_wait_us;
+};
+
+struct disk_stats {
+	std::vector<pool_stats> pools;
+	std::vector<storage_disk_stats> storages;
+	std::vector<queue_stats> queues;
+
+	latency_summary read_latency;
+	latency_summary write_latency;
+	latency_summary hash_latency;
+
+	std::int64_t memory_reads;
+	std::int64_t mmap_reads;
+	std::int64_t read_cache_hits;
+	std::int64_t read_cache_misses;
+	std::int64_t read_cache_evictions;
+	std::int64_t read_cache_size;
+	std::int64_t read_cache_capacity;
+	std::int64_t hash_hits;
+	std::int64_t hash_misses;
+	std::int64_t coalesced_bytes;
+	std::int64_t coalesced_syscalls;
+	std::int64_t saved_syscalls;
+	std::int64_t store_buffer_blocks;
+	std::int64_t zero_blocks;
+	std::int64_t zero_bytes_saved;
+};
+
+}  // namespace ezio
+
+#endif
@@ -8,60 +8,52 @@ namespace ezio
 log::log(ezio &daemon) :
 	m_daemon(daemon)
 {
-	m_speed = std::thread(&log::report_speed, this);
-	m_alert = std::thread(&log::report_alert, this);
+	m_daemon.every(std::chrono::milliseconds(REPORT_SPEED_INTERVAL_MS), [this]() {
+		report_speed();
+	});
+	m_daemon.on_alert([this](lt::alert *a) {
+		report_alert(a);
+	});
+	m_daemon.on_finished([this](std::string const &hash, std::string const &save_path) {
+		report_finished(hash, save_path);
+	});
 }
 
-log::~log()
-{
-	join();
-}
-
-void log::join()
+void log::report_speed()
 {
-	m_speed.join();
-	m_alert.join();
+	// from the status cache, refreshed for next report
+	std::vector<std::string> hashes;
+	auto result = m_daemon.get_cached_status(hashes);
+	m_daemon.post_torrent_updates();
+
+	for (const auto &iter : result) {
+		const auto &t_stat = iter.second;
+
+		SPDLOG_INFO("[{}][{}%][D: {:.2f}MB/s][U: {:.2f}MB/s][{}{}][A: {}][F: {}][S: {}]",
+			t_stat.save_path,
+			int(t_stat.progress * 100),
+			(double)t_stat.download_rate / 1024 / 1024,
+			(double)t_stat.upload_rate / 1024 / 1024,
+			t_stat.is_paused ? "P" : " ",
+			t_stat.is_finished ? "F" : " ",
+			t_stat.active_time,
+			t_stat.finished_time,
+			t_stat.seeding_time);
+	}
 }
 
-void log::report_speed()
+void log::report_alert(lt::alert *a)
 {
-	SPDLOG_INFO("start speed report thread");
-	while (!m_daemon.get_shutdown()) {
-		std::this_thread::sleep_for(std::chrono::seconds(5));
-
-		std::vector<std::string> hashes;
-		auto result = m_daemon.get_torrent_status(hashes);
-
-		for (const auto &iter : result) {
-			const auto &hash = iter.first;
-			const auto &t_stat = iter.second;
-
-			SPDLOG_INFO("[{}][{}%][D: {:.2f}MB/s][U: {:.2f}MB/s][{}{}][A: {}][F: {}][S: {}]",
-				t_stat.save_path,
-				int(t_stat.progress * 100),
-				(double)t_stat.download_rate / 1024 / 1024,
-				(double)t_stat.upload_rate / 1024 / 1024,
-				t_stat.is_paused ? "P" : " ",
-				t_stat.is_finished ? "F" : " ",
-				t_stat.active_time,
-				t_stat.finished_time,
-				t_stat.seeding_time);
-		}
+	// piece_finished_alert is only enabled for NBD, too many to log
+	if (lt::alert_cast<lt::state_update_alert>(a) || lt::alert_cast<lt::piece_finished_alert>(a)) {
+		return;
 	}
+	SPDLOG_INFO("lt alert: {} {}", a->what(), a->message());
 }
 
-void log::report_alert()
+void log::report_finished(std::string const &hash, std::string const &save_path)
 {
-	SPDLOG_INFO("start alert report thread");
-	while (!m_daemon.get_shutdown()) {
-		std::this_thread::sleep_for(std::chrono::seconds(5));
-
-		std::vector<libtorrent::alert *> alerts;
-		m_daemon.pop_alerts(&alerts);
-		for (auto a : alerts) {
-			SPDLOG_INFO("lt alert: {} {}", a->what(), a->message());
-		}
-	}
+	SPDLOG_INFO("torrent {} finished, save_path({})", hash, save_path);
 }
 
 }  // namespace ezio
@@ -1,27 +1,25 @@
 #ifndef __LOG_HPP__
 #define __LOG_HPP__
 
-#include <thread>
+#include <libtorrent/libtorrent.hpp>
 #include "daemon.hpp"
 
+// speed report interval
+#define REPORT_SPEED_INTERVAL_MS 5000
+
 namespace ezio
 {
+// handlers of daemon event loop, no thread of its own
 class log
 {
 public:
 	log(ezio &daemon);
-	~log();
-
-	void join();
 
-	// worker function
 	void report_speed();
-	void report_alert();
+	void report_alert(lt::alert *a);
+	void report_finished(std::string const &hash, std::string const &save_path);
 
 private:
-	std::thread m_speed;
-	std::thread m_alert;
-
 	ezio &m_daemon;
 };
 
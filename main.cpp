@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <memory>
 #include <iostream>
 #include <thread>
@@ -13,6 +14,7 @@
 #include "config.hpp"
 #include "raw_disk_io.hpp"
 #include "log.hpp"
+#include "nbd_server.hpp"
 
 int main(int argc, char **argv)
 {
@@ -25,8 +27,12 @@ int main(int argc, char **argv)
 
 	lt::settings_pack p;
 	// setup alert mask
-	p.set_int(lt::settings_pack::alert_mask,
-		lt::alert_category::error | lt::alert_category::status);
+	// NBD needs finished pieces to wake up readers
+	lt::alert_category_t mask = lt::alert_category::error | lt::alert_category::status;
+	if (!current_config.nbd_listen.empty()) {
+		mask |= lt::alert_category::piece_progress;
+	}
+	p.set_int(lt::settings_pack::alert_mask, mask);
 
 	// disable all encrypt to avoid bug https://github.com/arvidn/libtorrent/issues/6735#issuecomment-1036675263
 	p.set_int(lt::settings_pack::out_enc_policy, lt::settings_pack::pe_disabled);
@@ -38,31 +44,74 @@ int main(int argc, char **argv)
 	p.set_int(lt::settings_pack::mixed_mode_algorithm, lt::settings_pack::prefer_tcp);
 
 	//p.set_int(lt::settings_pack::alert_mask, lt::alert_category::peer | lt::alert_category::status);
+
+	// disk threads, raw_disk_io reads them from settings
+	int const cpus = std::max<int>(std::thread::hardware_concurrency(), 1);
+	p.set_int(lt::settings_pack::aio_threads,
+		current_config.aio_threads > 0 ? current_config.aio_threads : std::min(std::max(cpus, 2), 16));
+	p.set_int(lt::settings_pack::hashing_threads,
+		current_config.hashing_threads > 0 ? current_config.hashing_threads : cpus);
 	
-	// tune
-	//p.set_int(lt::settings_pack::suggest_mode, lt::settings_pack::suggest_read_cache);
-	//p.set_int(lt::settings_pack::max_queued_disk_bytes, 128 * 1024 * 1024);
+	// tune with --profile, or ApplySettings at runtime
 
 	lt::session_params ses_params(p);
+	// created in session constructor
+	ezio::raw_disk_io *disk_io = nullptr;
 	if (!current_config.file_flag) {
-		ses_params.disk_io_constructor = ezio::raw_disk_io_constructor;
+		ses_params.disk_io_constructor = [&current_config, &disk_io](lt::io_context &ioc,
+			lt::settings_interface const &s, lt::counters &c) {
+			auto io = ezio::raw_disk_io_constructor(ioc, s, c, current_config);
+			disk_io = static_cast<ezio::raw_disk_io *>(io.get());
+			return io;
+		};
 	}
 
+	// disk threads tell it about written pieces, so it outlives the session
+	std::unique_ptr<ezio::nbd_server> nbd;
+
 	// create session and inject to daemon.
 	lt::session session(ses_params);
-	ezio::ezio daemon(session);
+	ezio::ezio daemon(session, disk_io, std::max(current_config.torrent_cache, 0));
+
+	if (!current_config.profile.empty()) {
+		ezio::setting_list changed;
+		std::string error;
+		if (!daemon.apply_settings(current_config.profile, {}, changed, error)) {
+			std::cerr << error << std::endl;
+			return 1;
+		}
+	}
 
-	ezio::gRPCService service(daemon);
+	// before gRPC, it has to see every write of torrents added there. it
+	// stays even if it can't listen, its handlers are registered
+	if (!current_config.nbd_listen.empty()) {
+		if (current_config.file_flag) {
+			std::cerr << "--nbd needs raw disk mode, ignored" << std::endl;
+		} else {
+			nbd = std::make_unique<ezio::nbd_server>(daemon, *disk_io);
+			nbd->start(current_config.nbd_listen);
+		}
+	}
+
+	ezio::gRPCService service(daemon, current_config.rpc_threads);
 	service.start(current_config.listen_address);
 
-	// start log
+	if (!current_config.resume_dir.empty()) {
+		daemon.enable_resume(current_config.resume_dir, std::chrono::seconds(std::max(current_config.resume_interval, 1)));
+	}
+
+	// log handlers of the event loop
 	ezio::log log(daemon);
 
 	std::cout << "Server listening on " << current_config.listen_address << std::endl;
-	daemon.wait(10);
+	daemon.run();
 	std::cout << "shutdown in main" << std::endl;
 
-	log.join();
+	if (nbd) {
+		nbd->stop();
+	}
+	// late add_torrent answers go through the service
+	daemon.join_loader();
 	service.stop();
 
 	return 0;
@@ -0,0 +1,643 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <endian.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <spdlog/spdlog.h>
+
+#include "nbd_server.hpp"
+#include "daemon.hpp"
+#include "partition_storage.hpp"
+#include "raw_disk_io.hpp"
+
+// handshake, see doc/proto.md of the NBD project
+#define NBD_MAGIC 0x4e42444d41474943ULL
+#define NBD_IHAVEOPT 0x49484156454f5054ULL
+#define NBD_REPLY_MAGIC 0x3e889045565a9ULL
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES (1 << 1)
+
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_ABORT 2
+#define NBD_OPT_LIST 3
+#define NBD_OPT_INFO 6
+#define NBD_OPT_GO 7
+
+#define NBD_REP_ACK 1
+#define NBD_REP_SERVER 2
+#define NBD_REP_INFO 3
+#define NBD_REP_ERR_UNSUP 0x80000001U
+#define NBD_REP_ERR_INVALID 0x80000003U
+#define NBD_REP_ERR_UNKNOWN 0x80000006U
+#define NBD_INFO_EXPORT 0
+
+// transmission
+#define NBD_REQUEST_MAGIC 0x25609513U
+#define NBD_SIMPLE_REPLY_MAGIC 0x67446698U
+#define NBD_FLAG_HAS_FLAGS (1 << 0)
+#define NBD_FLAG_READ_ONLY (1 << 1)
+#define NBD_CMD_READ 0
+#define NBD_CMD_WRITE 1
+#define NBD_CMD_DISC 2
+#define NBD_CMD_FLUSH 3
+
+// longest option data accepted, names are info hashes
+#define NBD_MAX_OPTION 4096
+
+namespace ezio
+{
+namespace
+{
+	bool recv_all(int fd, void *buf, std::size_t len)
+	{
+		char *p = static_cast<char *>(buf);
+		while (len > 0) {
+			ssize_t const n = ::recv(fd, p, len, 0);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				return false;
+			}
+			p += n;
+			len -= std::size_t(n);
+		}
+		return true;
+	}
+
+	bool send_all(int fd, void const *buf, std::size_t len)
+	{
+		char const *p = static_cast<char const *>(buf);
+		while (len > 0) {
+			ssize_t const n = ::send(fd, p, len, MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				return false;
+			}
+			p += n;
+			len -= std::size_t(n);
+		}
+		return true;
+	}
+
+	// big endian encoding of handshake and replies
+	void put16(std::string &out, std::uint16_t v)
+	{
+		v = htobe16(v);
+		out.append(reinterpret_cast<char const *>(&v), sizeof(v));
+	}
+
+	void put32(std::string &out, std::uint32_t v)
+	{
+		v = htobe32(v);
+		out.append(reinterpret_cast<char const *>(&v), sizeof(v));
+	}
+
+	void put64(std::string &out, std::uint64_t v)
+	{
+		v = htobe64(v);
+		out.append(reinterpret_cast<char const *>(&v), sizeof(v));
+	}
+
+	std::uint16_t get16(char const *p)
+	{
+		std::uint16_t v;
+		std::memcpy(&v, p, sizeof(v));
+		return be16toh(v);
+	}
+
+	std::uint32_t get32(char const *p)
+	{
+		std::uint32_t v;
+		std::memcpy(&v, p, sizeof(v));
+		return be32toh(v);
+	}
+
+	std::uint64_t get64(char const *p)
+	{
+		std::uint64_t v;
+		std::memcpy(&v, p, sizeof(v));
+		return be64toh(v);
+	}
+
+	bool send_option_reply(int fd, std::uint32_t option, std::uint32_t type, std::string const &data)
+	{
+		std::string out;
+		put64(out, NBD_REPLY_MAGIC);
+		put32(out, option);
+		put32(out, type);
+		put32(out, std::uint32_t(data.size()));
+		out += data;
+		return send_all(fd, out.data(), out.size());
+	}
+
+	bool send_reply(int fd, std::uint32_t error, std::uint64_t handle)
+	{
+		std::string out;
+		put32(out, NBD_SIMPLE_REPLY_MAGIC);
+		put32(out, error);
+		put64(out, handle);
+		return send_all(fd, out.data(), out.size());
+	}
+}  // namespace
+
+nbd_server::nbd_server(ezio &daemon, raw_disk_io &disk_io) :
+	daemon_(daemon), disk_io_(disk_io)
+{
+	daemon_.on_alert([this](lt::alert *a) {
+		on_alert(a);
+	});
+	// hash on receive passes a piece before its blocks are on disk, and
+	// reads go to the partition directly
+	disk_io_.on_piece_written([this](std::string const &path, lt::piece_index_t piece) {
+		on_written(path, piece);
+	});
+}
+
+nbd_server::~nbd_server()
+{
+	stop();
+}
+
+bool nbd_server::start(std::string const &listen_address)
+{
+	std::size_t const colon = listen_address.rfind(':');
+	if (colon == std::string::npos) {
+		SPDLOG_ERROR("invalid NBD listen address {}, need host:port", listen_address);
+		return false;
+	}
+	std::string const host = listen_address.substr(0, colon);
+	std::string const port = listen_address.substr(colon + 1);
+
+	addrinfo hints{};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	addrinfo *res = nullptr;
+	int const rc = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res);
+	if (rc != 0) {
+		SPDLOG_ERROR("NBD listen address {}: {}", listen_address, gai_strerror(rc));
+		return false;
+	}
+
+	for (addrinfo *ai = res; ai; ai = ai->ai_next) {
+		int const fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0) {
+			continue;
+		}
+		int const on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0) {
+			listen_fd_ = fd;
+			break;
+		}
+		close(fd);
+	}
+	freeaddrinfo(res);
+
+	if (listen_fd_ < 0) {
+		SPDLOG_ERROR("failed to listen NBD on {}: {}", listen_address, strerror(errno));
+		return false;
+	}
+
+	accept_thread_ = std::thread(&nbd_server::accept_loop, this);
+	SPDLOG_INFO("NBD server listening on {}", listen_address);
+	return true;
+}
+
+void nbd_server::stop()
+{
+	if (stopped_.exchange(true)) {
+		return;
+	}
+
+	if (listen_fd_ >= 0) {
+		// wakes up accept
+		shutdown(listen_fd_, SHUT_RDWR);
+	}
+	if (accept_thread_.joinable()) {
+		accept_thread_.join();
+	}
+	if (listen_fd_ >= 0) {
+		close(listen_fd_);
+		listen_fd_ = -1;
+	}
+
+	std::unique_lock<std::mutex> l(mutex_);
+	for (auto const &c : clients_) {
+		shutdown(c.second, SHUT_RDWR);
+	}
+	// readers waiting for pieces see stopped_
+	piece_cond_.notify_all();
+	clients_cond_.wait(l, [this]() {
+		return clients_.empty();
+	});
+}
+
+void nbd_server::accept_loop()
+{
+	while (!stopped_) {
+		int const fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			if (!stopped_) {
+				SPDLOG_ERROR("NBD accept: {}", strerror(errno));
+			}
+			return;
+		}
+
+		int const on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+		std::uint64_t id = 0;
+		{
+			std::lock_guard<std::mutex> l(mutex_);
+			if (stopped_) {
+				close(fd);
+				return;
+			}
+			id = next_client_++;
+			clients_.emplace(id, fd);
+		}
+
+		std::thread([this, id, fd]() {
+			serve(fd);
+
+			std::lock_guard<std::mutex> l(mutex_);
+			close(fd);
+			clients_.erase(id);
+			clients_cond_.notify_all();
+		}).detach();
+	}
+}
+
+void nbd_server::serve(int fd)
+{
+	std::shared_ptr<nbd_export> e = handshake(fd);
+	if (!e) {
+		return;
+	}
+
+	SPDLOG_INFO("NBD client attached, {} bytes", e->size);
+	transmission(fd, *e);
+	SPDLOG_INFO("NBD client detached");
+}
+
+std::shared_ptr<nbd_export> nbd_server::handshake(int fd)
+{
+	std::string hello;
+	put64(hello, NBD_MAGIC);
+	put64(hello, NBD_IHAVEOPT);
+	put16(hello, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+	if (!send_all(fd, hello.data(), hello.size())) {
+		return nullptr;
+	}
+
+	char buf[16];
+	if (!recv_all(fd, buf, 4)) {
+		return nullptr;
+	}
+	bool const no_zeroes = get32(buf) & NBD_FLAG_NO_ZEROES;
+
+	std::uint16_t const transmission_flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY;
+	std::string data;
+	while (!stopped_) {
+		if (!recv_all(fd, buf, 16) || get64(buf) != NBD_IHAVEOPT) {
+			return nullptr;
+		}
+		std::uint32_t const option = get32(buf + 8);
+		std::uint32_t const length = get32(buf + 12);
+		if (length > NBD_MAX_OPTION) {
+			return nullptr;
+		}
+		data.resize(length);
+		if (length > 0 && !recv_all(fd, &data[0], length)) {
+			return nullptr;
+		}
+
+		switch (option) {
+		case NBD_OPT_EXPORT_NAME: {
+			// no way to report an error, hang up
+			std::shared_ptr<nbd_export> e = open_export(data);
+			if (!e) {
+				return nullptr;
+			}
+			std::string reply;
+			put64(reply, std::uint64_t(e->size));
+			put16(reply, transmission_flags);
+			if (!no_zeroes) {
+				reply.append(124, '\0');
+			}
+			return send_all(fd, reply.data(), reply.size()) ? e : nullptr;
+		}
+		case NBD_OPT_ABORT:
+			send_option_reply(fd, option, NBD_REP_ACK, "");
+			return nullptr;
+		case NBD_OPT_LIST: {
+			for (auto const &t : daemon_.get_cached_status({})) {
+				std::string server;
+				put32(server, std::uint32_t(t.first.size()));
+				server += t.first;
+				if (!send_option_reply(fd, option, NBD_REP_SERVER, server)) {
+					return nullptr;
+				}
+			}
+			if (!send_option_reply(fd, option, NBD_REP_ACK, "")) {
+				return nullptr;
+			}
+			break;
+		}
+		case NBD_OPT_INFO:
+		case NBD_OPT_GO: {
+			// name length, name, number of info requests and requests.
+			// only NBD_INFO_EXPORT is sent, which is always allowed
+			std::uint32_t const name_length = length >= 4 ? get32(data.data()) : 0;
+			if (length < 4 || name_length > length - 4 || length - 4 - name_length < 2) {
+				if (!send_option_reply(fd, option, NBD_REP_ERR_INVALID, "malformed request")) {
+					return nullptr;
+				}
+				break;
+			}
+
+			std::shared_ptr<nbd_export> e = open_export(data.substr(4, name_length));
+			if (!e) {
+				if (!send_option_reply(fd, option, NBD_REP_ERR_UNKNOWN, "no such torrent")) {
+					return nullptr;
+				}
+				break;
+			}
+
+			std::string info;
+			put16(info, NBD_INFO_EXPORT);
+			put64(info, std::uint64_t(e->size));
+			put16(info, transmission_flags);
+			if (!send_option_reply(fd, option, NBD_REP_INFO, info) || !send_option_reply(fd, option, NBD_REP_ACK, "")) {
+				return nullptr;
+			}
+			if (option == NBD_OPT_GO) {
+				return e;
+			}
+			break;
+		}
+		default:
+			if (!send_option_reply(fd, option, NBD_REP_ERR_UNSUP, "")) {
+				return nullptr;
+			}
+			break;
+		}
+	}
+	return nullptr;
+}
+
+void nbd_server::transmission(int fd, nbd_export &e)
+{
+	std::vector<char> buf;
+	char header[28];
+	while (!stopped_ && recv_all(fd, header, sizeof(header))) {
+		if (get32(header) != NBD_REQUEST_MAGIC) {
+			SPDLOG_WARN("NBD bad request magic");
+			return;
+		}
+		std::uint16_t const type = get16(header + 6);
+		std::uint64_t const handle = get64(header + 8);
+		std::uint64_t const offset = get64(header + 16);
+		std::uint32_t const length = get32(header + 24);
+
+		switch (type) {
+		case NBD_CMD_READ: {
+			if (length > NBD_MAX_REQUEST || offset > std::uint64_t(e.size) || length > std::uint64_t(e.size) - offset) {
+				if (!send_reply(fd, EINVAL, handle)) {
+					return;
+				}
+				break;
+			}
+
+			buf.resize(length);
+			int const error = read(e, buf.data(), std::int64_t(offset), std::int64_t(length));
+			if (!send_reply(fd, std::uint32_t(error), handle)) {
+				return;
+			}
+			if (error == 0 && !send_all(fd, buf.data(), length)) {
+				return;
+			}
+			break;
+		}
+		case NBD_CMD_WRITE: {
+			// read only, drop the payload
+			buf.resize(std::min<std::uint32_t>(length, NBD_MAX_REQUEST));
+			for (std::uint32_t left = length; left > 0;) {
+				std::uint32_t const n = std::min<std::uint32_t>(left, std::uint32_t(buf.size()));
+				if (!recv_all(fd, buf.data(), n)) {
+					return;
+				}
+				left -= n;
+			}
+			if (!send_reply(fd, EPERM, handle)) {
+				return;
+			}
+			break;
+		}
+		case NBD_CMD_DISC:
+			return;
+		case NBD_CMD_FLUSH:
+			if (!send_reply(fd, 0, handle)) {
+				return;
+			}
+			break;
+		default:
+			if (!send_reply(fd, EINVAL, handle)) {
+				return;
+			}
+			break;
+		}
+	}
+}
+
+int nbd_server::read(nbd_export &e, char *buf, std::int64_t offset, std::int64_t length)
+{
+	int const piece_length = e.ti->piece_length();
+	bool ok = true;
+	e.storage->for_each_partition_range(offset, length,
+		[&](std::int64_t, std::int64_t len, std::int64_t torrent_offset) {
+			// blocks outside the torrent are read as they are
+			if (ok && torrent_offset >= 0) {
+				ok = wait_pieces(e, int(torrent_offset / piece_length), int((torrent_offset + len - 1) / piece_length));
+			}
+		});
+	if (!ok) {
+		return ESHUTDOWN;
+	}
+
+	while (length > 0) {
+		ssize_t const n = pread(e.storage->fd(), buf, std::size_t(length), offset);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			SPDLOG_ERROR("NBD read at {}: {}", offset, n < 0 ? strerror(errno) : "end of partition");
+			return EIO;
+		}
+		buf += n;
+		offset += n;
+		length -= n;
+	}
+	return 0;
+}
+
+bool nbd_server::wait_pieces(nbd_export &e, int first, int last)
+{
+	std::vector<int> missing;
+	{
+		std::lock_guard<std::mutex> l(mutex_);
+		for (int p = first; p <= last; p++) {
+			if (!e.have[std::size_t(p)]) {
+				missing.push_back(p);
+			}
+		}
+	}
+	if (missing.empty()) {
+		return true;
+	}
+
+	// download them before anything else
+	for (int const p : missing) {
+		e.handle.set_piece_deadline(lt::piece_index_t(p), 0);
+	}
+	SPDLOG_DEBUG("NBD waits for {} pieces from {}", missing.size(), missing.front());
+
+	std::unique_lock<std::mutex> l(mutex_);
+	while (true) {
+		if (stopped_ || e.removed) {
+			return false;
+		}
+		bool const done = std::all_of(missing.begin(), missing.end(), [&e](int p) {
+			return e.have[std::size_t(p)];
+		});
+		if (done) {
+			return true;
+		}
+		piece_cond_.wait_for(l, std::chrono::milliseconds(NBD_WAIT_INTERVAL_MS));
+	}
+}
+
+std::shared_ptr<nbd_export> nbd_server::open_export(std::string const &name)
+{
+	lt::torrent_handle h = daemon_.find_handle(name);
+	if (!h.is_valid()) {
+		SPDLOG_WARN("NBD export {} is not found", name);
+		return nullptr;
+	}
+	lt::sha1_hash const key = h.info_hashes().get_best();
+
+	// one connection opens it, others wait and share it
+	std::lock_guard<std::mutex> open_lock(open_mutex_);
+	{
+		std::lock_guard<std::mutex> l(mutex_);
+		auto it = exports_.find(key);
+		if (it != exports_.end()) {
+			return it->second;
+		}
+	}
+
+	auto e = std::make_shared<nbd_export>();
+	e->handle = h;
+	e->ti = h.torrent_file();
+	if (!e->ti) {
+		SPDLOG_WARN("NBD export {} has no metadata", name);
+		return nullptr;
+	}
+	e->finished.assign(std::size_t(e->ti->num_pieces()), false);
+	e->have.assign(std::size_t(e->ti->num_pieces()), false);
+
+	// listen to piece_finished_alert before taking the bitmap, so no
+	// piece is missed in between
+	{
+		std::lock_guard<std::mutex> l(mutex_);
+		exports_[key] = e;
+	}
+
+	lt::torrent_status const st = h.status(lt::torrent_handle::query_pieces | lt::torrent_handle::query_save_path);
+	e->storage = std::make_unique<partition_storage>(st.save_path, e->ti->files(), false, true);
+	if (e->storage->init_error()) {
+		SPDLOG_WARN("NBD export {} doesn't fit {}", name, st.save_path);
+		std::lock_guard<std::mutex> l(mutex_);
+		exports_.erase(key);
+		return nullptr;
+	}
+
+	off_t const size = lseek(e->storage->fd(), 0, SEEK_END);
+	e->size = size > 0 ? std::int64_t(size) : 0;
+
+	{
+		std::lock_guard<std::mutex> l(mutex_);
+		e->path = st.save_path;
+		for (lt::piece_index_t p(0); p < lt::piece_index_t(e->ti->num_pieces()); ++p) {
+			if (st.pieces.size() > static_cast<int>(p) && st.pieces.get_bit(p)) {
+				e->finished[std::size_t(static_cast<int>(p))] = true;
+			}
+		}
+		// including pieces finished by alerts before the path was known
+		for (int p = 0; p < e->ti->num_pieces(); p++) {
+			update_have(*e, p);
+		}
+	}
+
+	SPDLOG_INFO("NBD export {} on {}, {} bytes", name, st.save_path, e->size);
+	return e;
+}
+
+void nbd_server::on_alert(lt::alert *a)
+{
+	if (auto *pf = lt::alert_cast<lt::piece_finished_alert>(a)) {
+		std::lock_guard<std::mutex> l(mutex_);
+		auto it = exports_.find(pf->handle.info_hashes().get_best());
+		if (it != exports_.end()) {
+			int const p = static_cast<int>(pf->piece_index);
+			it->second->finished[std::size_t(p)] = true;
+			update_have(*it->second, p);
+		}
+	} else if (auto *tr = lt::alert_cast<lt::torrent_removed_alert>(a)) {
+		std::lock_guard<std::mutex> l(mutex_);
+		auto it = exports_.find(tr->info_hashes.get_best());
+		if (it != exports_.end()) {
+			it->second->removed = true;
+			exports_.erase(it);
+			piece_cond_.notify_all();
+		}
+	}
+}
+
+void nbd_server::on_written(std::string const &path, lt::piece_index_t piece)
+{
+	std::lock_guard<std::mutex> l(mutex_);
+	for (auto const &e : exports_) {
+		if (e.second->path == path) {
+			update_have(*e.second, static_cast<int>(piece));
+		}
+	}
+}
+
+void nbd_server::update_have(nbd_export &e, int piece)
+{
+	std::size_t const p = std::size_t(piece);
+	if (e.have[p] || !e.finished[p] || e.path.empty()) {
+		return;
+	}
+	// the last run of the piece calls on_written once it's out
+	if (disk_io_.piece_pending(e.path, lt::piece_index_t(piece))) {
+		return;
+	}
+	e.have[p] = true;
+	piece_cond_.notify_all();
+}
+
+}  // namespace ezio
@@ -0,0 +1,95 @@
+#ifndef __NBD_SERVER_HPP__
+#define __NBD_SERVER_HPP__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <libtorrent/libtorrent.hpp>
+
+// largest NBD read, larger requests are refused
+#define NBD_MAX_REQUEST (32 * 1024 * 1024)
+// recheck shutdown while waiting for a piece, in ms
+#define NBD_WAIT_INTERVAL_MS 1000
+
+namespace ezio
+{
+class ezio;
+class partition_storage;
+class raw_disk_io;
+
+// one torrent exported as read only block device, the size is the whole
+// partition. reads of missing pieces wait for them.
+struct nbd_export {
+	lt::torrent_handle handle;
+	std::shared_ptr<lt::torrent_info const> ti;
+	std::unique_ptr<partition_storage> storage;
+	std::int64_t size{0};
+
+	// all under nbd_server::mutex_. path is empty until the bitmap is taken
+	std::string path;
+	// pieces passed the hash check, their blocks might still be in memory
+	std::vector<bool> finished;
+	// finished pieces with all blocks written to the partition
+	std::vector<bool> have;
+	bool removed{false};
+};
+
+// NBD server with fixed newstyle handshake, one thread per connection.
+// export names are info hashes in hex.
+class nbd_server
+{
+public:
+	// register alert and piece written handlers, before daemon runs and
+	// torrents are added
+	nbd_server(ezio &daemon, raw_disk_io &disk_io);
+	~nbd_server();
+
+	// host:port, return false if it can't listen
+	bool start(std::string const &listen_address);
+	void stop();
+
+private:
+	void accept_loop();
+	void serve(int fd);
+	// negotiation, nullptr if client quits
+	std::shared_ptr<nbd_export> handshake(int fd);
+	void transmission(int fd, nbd_export &e);
+	// read from partition after pieces in range arrive, errno or 0
+	int read(nbd_export &e, char *buf, std::int64_t offset, std::int64_t length);
+	// wait pieces [first, last] with a deadline on the missing ones
+	bool wait_pieces(nbd_export &e, int first, int last);
+
+	std::shared_ptr<nbd_export> open_export(std::string const &name);
+	void on_alert(lt::alert *a);
+	void on_written(std::string const &path, lt::piece_index_t piece);
+	// set have of a finished piece once nothing of it waits to be written,
+	// under mutex_
+	void update_have(nbd_export &e, int piece);
+
+	ezio &daemon_;
+	raw_disk_io &disk_io_;
+
+	int listen_fd_{-1};
+	std::atomic<bool> stopped_{false};
+	std::thread accept_thread_;
+
+	// serialize open_export, so an export is built once
+	std::mutex open_mutex_;
+	std::mutex mutex_;
+	std::condition_variable piece_cond_;
+	std::map<lt::sha1_hash, std::shared_ptr<nbd_export>> exports_;
+	// fd of connections by id, threads are detached and erase themselves
+	std::map<std::uint64_t, int> clients_;
+	std::uint64_t next_client_{0};
+	std::condition_variable clients_cond_;
+};
+
+}  // namespace ezio
+
+#endif
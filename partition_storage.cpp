@@ -0,0 +1,672 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/assert.hpp>
+#include <spdlog/spdlog.h>
+
+#include "partition_storage.hpp"
+
+// fallocate of block devices takes whole logical sectors
+#define ZERO_ALIGNMENT 512
+// O_DIRECT alignment of image files, and of bounce buffers. the logical
+// block size of the filesystem's disk is usually smaller
+#define DIRECT_IO_ALIGNMENT 4096
+
+namespace ezio
+{
+namespace
+{
+	// parse partition offset from file name, it's hex without prefix.
+	bool parse_hex_offset(libtorrent::string_view name, std::int64_t &result)
+	{
+		if (name.size() > 2 && name[0] == '0' && (name[1] == 'x' || name[1] == 'X')) {
+			name = name.substr(2);
+		}
+
+		// at most 63 bits
+		if (name.empty() || name.size() > 16) {
+			return false;
+		}
+
+		std::uint64_t value = 0;
+		for (char const c : name) {
+			int digit = 0;
+			if (c >= '0' && c <= '9') {
+				digit = c - '0';
+			} else if (c >= 'a' && c <= 'f') {
+				digit = c - 'a' + 10;
+			} else if (c >= 'A' && c <= 'F') {
+				digit = c - 'A' + 10;
+			} else {
+				return false;
+			}
+			value = (value << 4) | static_cast<std::uint64_t>(digit);
+		}
+
+		if (value > static_cast<std::uint64_t>(INT64_MAX)) {
+			return false;
+		}
+
+		result = static_cast<std::int64_t>(value);
+		return true;
+	}
+
+	// logical sector size, O_DIRECT offsets, lengths and buffers are
+	// multiples of it
+	int direct_alignment(int fd)
+	{
+		struct stat st;
+		int size = 0;
+		if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode) && ioctl(fd, BLKSSZGET, &size) == 0 && size > 0) {
+			return size;
+		}
+		return DIRECT_IO_ALIGNMENT;
+	}
+
+	// one for each disk thread, grows to the largest unaligned I/O
+	char *bounce_buffer(std::size_t size)
+	{
+		struct buffer {
+			void *data{nullptr};
+			std::size_t size{0};
+			~buffer()
+			{
+				free(data);
+			}
+		};
+		thread_local buffer b;
+
+		if (b.size < size) {
+			free(b.data);
+			b.data = nullptr;
+			b.size = 0;
+			if (posix_memalign(&b.data, DIRECT_IO_ALIGNMENT, size)) {
+				b.data = nullptr;
+				return nullptr;
+			}
+			b.size = size;
+		}
+		return static_cast<char *>(b.data);
+	}
+
+	// pread until length is read, short reads past the end of the
+	// partition fail with EIO. -1 and errno on failure
+	ssize_t pread_full(int fd, char *buffer, std::size_t length, std::int64_t offset)
+	{
+		std::size_t done = 0;
+		while (done < length) {
+			ssize_t const ret = pread(fd, buffer + done, length - done, offset + std::int64_t(done));
+			if (ret < 0 && errno == EINTR) {
+				continue;
+			}
+			if (ret < 0) {
+				return ret;
+			}
+			if (ret == 0) {
+				errno = EIO;
+				return -1;
+			}
+			done += std::size_t(ret);
+		}
+		return ssize_t(done);
+	}
+
+	// pwritev until all of vec is written, the rest is resubmitted after
+	// a short write. -1 and errno on failure
+	ssize_t pwritev_full(int fd, iovec const *vec, int n, std::int64_t offset)
+	{
+		std::size_t length = 0;
+		for (int i = 0; i < n; i++) {
+			length += vec[i].iov_len;
+		}
+
+		ssize_t ret = pwritev(fd, vec, n, offset);
+		if (ret >= 0 && std::size_t(ret) == length) {
+			return ret;
+		}
+
+		// copy only when it's short, the common case doesn't allocate
+		std::vector<iovec> rest(vec, vec + n);
+		std::size_t first = 0;
+		std::size_t done = 0;
+		while (true) {
+			if (ret < 0 && errno == EINTR) {
+				ret = pwritev(fd, rest.data() + first, int(rest.size() - first), offset + std::int64_t(done));
+				continue;
+			}
+			if (ret < 0) {
+				return ret;
+			}
+			if (ret == 0) {
+				errno = EIO;
+				return -1;
+			}
+
+			done += std::size_t(ret);
+			if (done == length) {
+				return ssize_t(done);
+			}
+			std::size_t skip = std::size_t(ret);
+			while (skip >= rest[first].iov_len) {
+				skip -= rest[first].iov_len;
+				first++;
+			}
+			rest[first].iov_base = static_cast<char *>(rest[first].iov_base) + skip;
+			rest[first].iov_len -= skip;
+			ret = pwritev(fd, rest.data() + first, int(rest.size() - first), offset + std::int64_t(done));
+		}
+	}
+}  // namespace
+
+partition_mapping *partition_mapping::create(int fd)
+{
+	// works for both block device and regular file
+	off_t const len = lseek(fd, 0, SEEK_END);
+	if (len <= 0) {
+		SPDLOG_WARN("failed to get partition size for mmap: {}", strerror(errno));
+		return nullptr;
+	}
+
+	void *addr = mmap(nullptr, std::size_t(len), PROT_READ, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		SPDLOG_WARN("mmap: {}", strerror(errno));
+		return nullptr;
+	}
+
+	// peers request pieces at random, read ahead is done per piece
+	madvise(addr, std::size_t(len), MADV_RANDOM);
+	return new partition_mapping(addr, std::size_t(len));
+}
+
+partition_mapping::~partition_mapping()
+{
+	munmap(mapping_addr_, mapping_len_);
+}
+
+void partition_mapping::free_disk_buffer(char *)
+{
+	if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		delete this;
+	}
+}
+
+void partition_mapping::will_need(std::int64_t offset, std::int64_t length) const
+{
+	long const page = sysconf(_SC_PAGESIZE);
+	std::int64_t const begin = offset / page * page;
+	std::int64_t const end = std::min<std::int64_t>(offset + length, mapping_len_);
+	if (end > begin) {
+		madvise(static_cast<char *>(mapping_addr_) + begin, std::size_t(end - begin), MADV_WILLNEED);
+	}
+}
+
+partition_storage::partition_storage(const std::string &path, libtorrent::file_storage const &fs, bool mmap_read, bool read_only,
+	bool direct_io) :
+	fs_(fs)
+{
+	int const flags = read_only ? O_RDONLY : O_RDWR;
+	fd_ = -1;
+	if (direct_io) {
+		fd_ = open(path.c_str(), flags | O_DIRECT);
+		if (fd_ >= 0) {
+			direct_align_ = direct_alignment(fd_);
+			SPDLOG_INFO("{} opened with O_DIRECT, {} bytes alignment", path, direct_align_);
+		} else {
+			// e.g. tmpfs
+			SPDLOG_WARN("O_DIRECT open of {} failed: {}, use buffered I/O", path, strerror(errno));
+		}
+	}
+	if (fd_ < 0) {
+		fd_ = open(path.c_str(), flags);
+	}
+	if (fd_ < 0) {
+		SPDLOG_CRITICAL("failed to open ({}) = {}", path, strerror(errno));
+		exit(1);
+	}
+
+	build_extents();
+
+	if (mmap_read) {
+		mapping_ = partition_mapping::create(fd_);
+		if (mapping_) {
+			SPDLOG_INFO("{} mapped for zero copy read, {} bytes", path, mapping_->size());
+		}
+	}
+}
+
+partition_storage::~partition_storage()
+{
+	if (mapping_) {
+		// buffers still held by peers keep it mapped
+		mapping_->release();
+	}
+
+	int ec = close(fd_);
+	if (ec) {
+		SPDLOG_ERROR("close: {}", strerror(errno));
+	}
+}
+
+void partition_storage::build_extents()
+{
+	extents_.reserve(fs_.num_files());
+
+	for (libtorrent::file_index_t i(0); i < libtorrent::file_index_t(fs_.num_files()); ++i) {
+		std::int64_t const length = fs_.file_size(i);
+		if (length <= 0) {
+			continue;
+		}
+
+		std::int64_t const torrent_offset = fs_.file_offset(i);
+		std::int64_t partition_offset = -1;
+
+		if (!fs_.pad_file_at(i)) {
+			// to find partition_offset from file name.
+			if (!parse_hex_offset(fs_.file_name(i), partition_offset)) {
+				SPDLOG_CRITICAL("failed to parse file_name({}) at ({})",
+					std::string(fs_.file_name(i)), static_cast<std::int32_t>(i));
+				init_error_.file(i);
+				init_error_.ec = libtorrent::errors::parse_failed;
+				init_error_.operation = libtorrent::operation_t::file_open;
+				extents_.clear();
+				return;
+			}
+		}
+
+		if (!extents_.empty()) {
+			extent &last = extents_.back();
+			bool const last_pad = last.partition_offset < 0;
+			bool const pad = partition_offset < 0;
+			if (last.torrent_offset + last.length == torrent_offset && last_pad == pad
+				&& (pad || last.partition_offset + last.length == partition_offset)) {
+				// contiguous on both sides, merge it.
+				last.length += length;
+				continue;
+			}
+		}
+
+		extents_.push_back({torrent_offset, partition_offset, length, i});
+	}
+
+	extents_.shrink_to_fit();
+
+	for (std::size_t i = 0; i < extents_.size(); i++) {
+		if (extents_[i].partition_offset >= 0) {
+			by_partition_.push_back(i);
+		}
+	}
+	std::sort(by_partition_.begin(), by_partition_.end(), [this](std::size_t a, std::size_t b) {
+		return extents_[a].partition_offset < extents_[b].partition_offset;
+	});
+	SPDLOG_INFO("{} files mapped to {} extents", fs_.num_files(), extents_.size());
+}
+
+std::vector<extent>::const_iterator partition_storage::find_extent(std::int64_t torrent_offset) const
+{
+	auto it = std::upper_bound(extents_.begin(), extents_.end(), torrent_offset,
+		[](std::int64_t const off, extent const &e) {
+			return off < e.torrent_offset;
+		});
+
+	if (it == extents_.begin()) {
+		return extents_.end();
+	}
+
+	--it;
+	if (torrent_offset >= it->torrent_offset + it->length) {
+		return extents_.end();
+	}
+	return it;
+}
+
+char const *partition_storage::mapped(libtorrent::piece_index_t const piece, int const offset, int const length) const
+{
+	if (!mapping_) {
+		return nullptr;
+	}
+
+	std::int64_t const torrent_offset = static_cast<std::int64_t>(static_cast<int>(piece)) * fs_.piece_length() + offset;
+	auto it = find_extent(torrent_offset);
+	if (it == extents_.end() || it->partition_offset < 0
+		|| torrent_offset + length > it->torrent_offset + it->length) {
+		return nullptr;
+	}
+
+	std::int64_t const partition_offset = it->partition_offset + (torrent_offset - it->torrent_offset);
+	if (partition_offset + length > static_cast<std::int64_t>(mapping_->size())) {
+		return nullptr;
+	}
+	return mapping_->data() + partition_offset;
+}
+
+std::int64_t partition_storage::partition_offset(libtorrent::piece_index_t const piece, int const offset) const
+{
+	std::int64_t result = -1;
+	for_each_extent(piece, offset, fs_.piece_size(piece) - offset,
+		[&](extent const &, std::int64_t const partition_offset, std::int64_t const) {
+			result = partition_offset;
+			// stop at the first extent on partition
+			return partition_offset < 0;
+		});
+	return result;
+}
+
+void partition_storage::will_need(libtorrent::piece_index_t const piece) const
+{
+	if (!mapping_) {
+		return;
+	}
+
+	for_each_extent(piece, 0, fs_.piece_size(piece),
+		[&](extent const &, std::int64_t const partition_offset, std::int64_t const len) {
+			if (partition_offset >= 0) {
+				mapping_->will_need(partition_offset, len);
+			}
+			return true;
+		});
+}
+
+bool partition_storage::aligned(std::int64_t partition_offset, iovec const *vec, int n) const
+{
+	std::int64_t const a = direct_align_;
+	if (partition_offset % a != 0) {
+		return false;
+	}
+	for (int i = 0; i < n; i++) {
+		if (reinterpret_cast<std::uintptr_t>(vec[i].iov_base) % a != 0 || vec[i].iov_len % a != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool partition_storage::direct_aligned(iovec const *iov, int const iovcnt, libtorrent::piece_index_t const piece, int const offset) const
+{
+	if (direct_align_ == 0) {
+		return true;
+	}
+
+	bool ok = true;
+	for_each_iov(iov, iovcnt, piece, offset,
+		[&](extent const &, std::int64_t const partition_offset, iovec const *vec, int const n) {
+			ok = aligned(partition_offset, vec, n);
+			return ok;
+		});
+	return ok;
+}
+
+ssize_t partition_storage::read_at(char *buffer, std::size_t length, std::int64_t partition_offset)
+{
+	iovec const vec{buffer, length};
+	if (direct_align_ == 0 || aligned(partition_offset, &vec, 1)) {
+		return pread_full(fd_, buffer, length, partition_offset);
+	}
+
+	// whole sectors around the range
+	std::int64_t const a = direct_align_;
+	std::int64_t const begin = partition_offset / a * a;
+	std::int64_t const end = (partition_offset + std::int64_t(length) + a - 1) / a * a;
+	char *bounce = bounce_buffer(std::size_t(end - begin));
+	if (!bounce) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	// the last sector may end past the partition, only the range is needed
+	std::size_t const needed = std::size_t(partition_offset - begin) + length;
+	std::size_t done = 0;
+	while (done < needed) {
+		ssize_t const ret = pread(fd_, bounce + done, std::size_t(end - begin) - done, begin + std::int64_t(done));
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret < 0) {
+			return ret;
+		}
+		if (ret == 0) {
+			errno = EIO;
+			return -1;
+		}
+		done += std::size_t(ret);
+	}
+	std::memcpy(buffer, bounce + (partition_offset - begin), length);
+	return ssize_t(length);
+}
+
+ssize_t partition_storage::write_at(iovec const *vec, int n, std::int64_t partition_offset)
+{
+	if (direct_align_ == 0 || aligned(partition_offset, vec, n)) {
+		return pwritev_full(fd_, vec, n, partition_offset);
+	}
+
+	std::int64_t length = 0;
+	for (int i = 0; i < n; i++) {
+		length += vec[i].iov_len;
+	}
+
+	std::int64_t const a = direct_align_;
+	std::int64_t const begin = partition_offset / a * a;
+	std::int64_t const end = (partition_offset + length + a - 1) / a * a;
+	char *bounce = bounce_buffer(std::size_t(end - begin));
+	if (!bounce) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	// aligned writes own whole sectors, only unaligned ones share the
+	// first or last sector with a neighbour
+	std::lock_guard<std::mutex> l(bounce_mutex_);
+
+	// keep the rest of the first and last sector, zeros past the end
+	bool const head = begin < partition_offset;
+	bool const tail = partition_offset + length < end && !(head && end - begin == a);
+	if (head) {
+		std::memset(bounce, 0, std::size_t(a));
+		if (pread(fd_, bounce, std::size_t(a), begin) < 0) {
+			return -1;
+		}
+	}
+	if (tail) {
+		std::memset(bounce + (end - begin - a), 0, std::size_t(a));
+		if (pread(fd_, bounce + (end - begin - a), std::size_t(a), end - a) < 0) {
+			return -1;
+		}
+	}
+
+	char *p = bounce + (partition_offset - begin);
+	for (int i = 0; i < n; i++) {
+		std::memcpy(p, vec[i].iov_base, vec[i].iov_len);
+		p += vec[i].iov_len;
+	}
+
+	iovec const whole{bounce, std::size_t(end - begin)};
+	if (pwritev_full(fd_, &whole, 1, begin) < 0) {
+		return -1;
+	}
+	return ssize_t(length);
+}
+
+int partition_storage::read(char *buffer, libtorrent::piece_index_t const piece, int const offset,
+	int const length, libtorrent::storage_error &error)
+{
+	BOOST_ASSERT(buffer != nullptr);
+
+	int ret = 0;
+	bool const in_range = for_each_extent(piece, offset, length,
+		[&](extent const &e, std::int64_t const partition_offset, std::int64_t const len) {
+			if (partition_offset < 0) {
+				// pad file
+				std::memset(buffer, 0, len);
+			} else if (read_at(buffer, std::size_t(len), partition_offset) < 0) {
+				error.file(e.file_index);
+				error.ec = libtorrent::error_code(errno, libtorrent::system_category());
+				error.operation = libtorrent::operation_t::file_read;
+				return false;
+			}
+			ret += len;
+			buffer += len;
+			return true;
+		});
+
+	if (!in_range) {
+		error.ec = libtorrent::errors::invalid_request;
+		error.operation = libtorrent::operation_t::file_read;
+	}
+	return ret;
+}
+
+void partition_storage::write(char *buffer, libtorrent::piece_index_t const piece, int const offset,
+	int const length, libtorrent::storage_error &error)
+{
+	BOOST_ASSERT(buffer != nullptr);
+
+	bool const in_range = for_each_extent(piece, offset, length,
+		[&](extent const &e, std::int64_t const partition_offset, std::int64_t const len) {
+			iovec const vec{buffer, std::size_t(len)};
+			if (partition_offset >= 0 && write_at(&vec, 1, partition_offset) < 0) {
+				error.file(e.file_index);
+				error.ec = libtorrent::error_code(errno, libtorrent::system_category());
+				error.operation = libtorrent::operation_t::file_write;
+				return false;
+			}
+			buffer += len;
+			return true;
+		});
+
+	if (!in_range) {
+		error.ec = libtorrent::errors::invalid_request;
+		error.operation = libtorrent::operation_t::file_write;
+	}
+}
+
+bool partition_storage::zero(libtorrent::piece_index_t const piece, int const offset, int const length,
+	libtorrent::storage_error &error)
+{
+	bool zeroed = true;
+	bool const in_range = for_each_extent(piece, offset, length,
+		[&](extent const &e, std::int64_t const partition_offset, std::int64_t const len) {
+			if (partition_offset < 0) {
+				return true;
+			}
+			if (partition_offset % ZERO_ALIGNMENT != 0 || len % ZERO_ALIGNMENT != 0) {
+				zeroed = false;
+				return false;
+			}
+
+			while (true) {
+				int mode = zero_mode_;
+				if (mode == zero_unsupported) {
+					zeroed = false;
+					return false;
+				}
+
+				int const flags = (mode == zero_punch_hole ? FALLOC_FL_PUNCH_HOLE : FALLOC_FL_ZERO_RANGE) | FALLOC_FL_KEEP_SIZE;
+				if (fallocate(fd_, flags, partition_offset, len) == 0) {
+					return true;
+				}
+
+				if (errno == EINVAL) {
+					// sector size larger than 512, write this one
+					zeroed = false;
+					return false;
+				}
+				if (errno != EOPNOTSUPP) {
+					error.file(e.file_index);
+					error.ec = libtorrent::error_code(errno, libtorrent::system_category());
+					error.operation = libtorrent::operation_t::file_write;
+					zeroed = false;
+					return false;
+				}
+
+				// punch hole needs discard which reads back zeros, then
+				// try write zeroes offload
+				if (zero_mode_.compare_exchange_strong(mode, mode + 1)) {
+					SPDLOG_INFO("fallocate mode {} is not supported, fallback", flags);
+				}
+			}
+		});
+
+	if (!in_range) {
+		error.ec = libtorrent::errors::invalid_request;
+		error.operation = libtorrent::operation_t::file_write;
+		return false;
+	}
+	return zeroed;
+}
+
+void partition_storage::start_writeback(libtorrent::piece_index_t const piece, int const offset, int const length)
+{
+	// no dirty pages
+	if (direct_align_ > 0) {
+		return;
+	}
+
+	for_each_extent(piece, offset, length,
+		[&](extent const &, std::int64_t const partition_offset, std::int64_t const len) {
+			if (partition_offset >= 0 && sync_file_range(fd_, partition_offset, len, SYNC_FILE_RANGE_WRITE)) {
+				SPDLOG_WARN("sync_file_range: {}", strerror(errno));
+				return false;
+			}
+			return true;
+		});
+}
+
+void partition_storage::wait_writeback()
+{
+	if (direct_align_ > 0) {
+		return;
+	}
+
+	if (sync_file_range(fd_, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE)) {
+		SPDLOG_WARN("sync_file_range: {}", strerror(errno));
+	}
+}
+
+void partition_storage::sync(libtorrent::storage_error &error)
+{
+	if (fdatasync(fd_)) {
+		error.ec = libtorrent::error_code(errno, libtorrent::system_category());
+		error.operation = libtorrent::operation_t::file_write;
+	}
+}
+
+int partition_storage::writev(iovec const *iov, int const iovcnt, libtorrent::piece_index_t const piece,
+	int const offset, int &slices, libtorrent::storage_error &error)
+{
+	BOOST_ASSERT(iov != nullptr);
+
+	int syscalls = 0;
+	slices = 0;
+
+	bool const in_range = for_each_iov(iov, iovcnt, piece, offset,
+		[&](extent const &e, std::int64_t const partition_offset, iovec const *vec, int const n) {
+			slices += n;
+			syscalls++;
+			if (write_at(vec, n, partition_offset) < 0) {
+				error.file(e.file_index);
+				error.ec = libtorrent::error_code(errno, libtorrent::system_category());
+				error.operation = libtorrent::operation_t::file_write;
+				return false;
+			}
+			return true;
+		});
+
+	if (!in_range) {
+		error.ec = libtorrent::errors::invalid_request;
+		error.operation = libtorrent::operation_t::file_write;
+	}
+	return syscalls;
+}
+
+}  // namespace ezio
@@ -0,0 +1,325 @@
+#ifndef __PARTITION_STORAGE_HPP__
+#define __PARTITION_STORAGE_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/uio.h>
+#include <libtorrent/libtorrent.hpp>
+
+namespace ezio
+{
+// one contiguous run of the torrent mapped onto the partition.
+// partclone stores the partition offset in hex as the file name, so
+// each file is an extent. adjacent files which are also adjacent on
+// the partition are merged into a single extent.
+struct extent {
+	// offset in the torrent (concatenation of all files)
+	std::int64_t torrent_offset;
+	// offset in the partition, -1 for pad files
+	std::int64_t partition_offset;
+	std::int64_t length;
+	// first file covered by this extent, for error reporting
+	libtorrent::file_index_t file_index;
+};
+
+// read only mapping of the whole partition for seeding. async_read hands
+// out buffers pointing into it, free_disk_buffer only drops a reference.
+// it's unmapped when the storage and all buffers are gone.
+class partition_mapping final : public libtorrent::buffer_allocator_interface
+{
+public:
+	// nullptr if mmap fails
+	static partition_mapping *create(int fd);
+
+	char const *data() const
+	{
+		return static_cast<char const *>(mapping_addr_);
+	}
+
+	std::size_t size() const
+	{
+		return mapping_len_;
+	}
+
+	void acquire()
+	{
+		refs_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void free_disk_buffer(char *) override;
+
+	// drop the reference of partition_storage
+	void release()
+	{
+		free_disk_buffer(nullptr);
+	}
+
+	// start reading [offset, offset + length) in background
+	void will_need(std::int64_t offset, std::int64_t length) const;
+
+private:
+	partition_mapping(void *addr, std::size_t len) :
+		mapping_addr_(addr),
+		mapping_len_(len)
+	{
+	}
+	~partition_mapping();
+
+	void *mapping_addr_;
+	size_t mapping_len_;
+	std::atomic<int> refs_{1};
+};
+
+class partition_storage
+{
+private:
+	// fd to partition.
+	int fd_{0};
+	// logical sector size if opened with O_DIRECT, 0 for buffered I/O
+	int direct_align_{0};
+	// read-modify-write of sectors shared by unaligned writes
+	std::mutex bounce_mutex_;
+	// only for seeding mode
+	partition_mapping *mapping_{nullptr};
+
+	libtorrent::file_storage const &fs_;
+
+	// sorted by torrent_offset, built once in constructor
+	std::vector<extent> extents_;
+	// indices of non pad extents sorted by partition_offset
+	std::vector<std::size_t> by_partition_;
+
+	// set when the torrent cannot be mapped onto the partition
+	libtorrent::storage_error init_error_;
+
+	// how fallocate zeroes ranges, moves on when the target refuses
+	enum zero_mode {
+		zero_punch_hole,
+		zero_range,
+		zero_unsupported,
+	};
+	std::atomic<int> zero_mode_{zero_punch_hole};
+
+	void build_extents();
+
+	// find the extent contains torrent_offset
+	std::vector<extent>::const_iterator find_extent(std::int64_t torrent_offset) const;
+
+	bool aligned(std::int64_t partition_offset, iovec const *vec, int n) const;
+	// pread/pwritev of the whole range, through an aligned bounce buffer if
+	// O_DIRECT can't take the buffers as they are. short transfers are
+	// retried, -1 and errno (EIO past the end) on failure
+	ssize_t read_at(char *buffer, std::size_t length, std::int64_t partition_offset);
+	ssize_t write_at(iovec const *vec, int n, std::int64_t partition_offset);
+
+public:
+	// mmap_read maps the partition for zero copy read, read_only is for
+	// tools which only hash the partition. direct_io opens it with
+	// O_DIRECT, falls back to buffered I/O if the target refuses
+	partition_storage(const std::string &path, libtorrent::file_storage const &fs, bool mmap_read = false, bool read_only = false,
+		bool direct_io = false);
+	~partition_storage();
+
+	// error found while building the extent table
+	libtorrent::storage_error const &init_error() const
+	{
+		return init_error_;
+	}
+
+	std::size_t num_extents() const
+	{
+		return extents_.size();
+	}
+
+	int piece_size(libtorrent::piece_index_t const piece)
+	{
+		return fs_.piece_size(piece);
+	}
+
+	// piece size without tail padding for v2 torrent
+	int piece_size2(libtorrent::piece_index_t const piece)
+	{
+		return fs_.piece_size2(piece);
+	}
+
+	bool v2() const
+	{
+		return fs_.v2();
+	}
+
+	int fd() const
+	{
+		return fd_;
+	}
+
+	bool direct_io() const
+	{
+		return direct_align_ > 0;
+	}
+
+	// false if I/O of the range with these buffers needs the bounce
+	// buffer, then it can't be submitted to io_uring as it is
+	bool direct_aligned(iovec const *iov, int const iovcnt, libtorrent::piece_index_t const piece, int const offset) const;
+
+	partition_mapping *mapping() const
+	{
+		return mapping_;
+	}
+
+	// pointer into the mapping if the range is in one extent on partition,
+	// otherwise nullptr. caller must acquire() the mapping before use.
+	char const *mapped(libtorrent::piece_index_t const piece, int const offset, int const length) const;
+
+	// partition offset of the first non pad byte at or after offset, -1 if
+	// the rest of the piece is pad
+	std::int64_t partition_offset(libtorrent::piece_index_t const piece, int const offset) const;
+
+	// read ahead the piece in the mapping
+	void will_need(libtorrent::piece_index_t const piece) const;
+
+	// call f(extent, partition_offset, length) for each part of the range
+	// return false if the range is out of the torrent
+	template<typename Fun>
+	bool for_each_extent(libtorrent::piece_index_t const piece, int const offset, int const length, Fun f) const
+	{
+		std::int64_t torrent_offset = static_cast<std::int64_t>(static_cast<int>(piece)) * fs_.piece_length() + offset;
+		std::int64_t left = length;
+
+		auto it = find_extent(torrent_offset);
+		while (left > 0) {
+			if (it == extents_.end()) {
+				return false;
+			}
+
+			std::int64_t const extent_offset = torrent_offset - it->torrent_offset;
+			std::int64_t const len = std::min(left, it->length - extent_offset);
+			std::int64_t const partition_offset = (it->partition_offset < 0) ? -1 : it->partition_offset + extent_offset;
+
+			if (!f(*it, partition_offset, len)) {
+				return true;
+			}
+
+			torrent_offset += len;
+			left -= len;
+			++it;
+		}
+		return true;
+	}
+
+	// call f(partition_offset, length, torrent_offset) for each part of the
+	// partition range in order. torrent_offset is -1 where the torrent has
+	// no data, e.g. unused blocks of the filesystem
+	template<typename Fun>
+	void for_each_partition_range(std::int64_t offset, std::int64_t length, Fun f) const
+	{
+		// first extent ends after offset
+		auto it = std::upper_bound(by_partition_.begin(), by_partition_.end(), offset,
+			[this](std::int64_t o, std::size_t i) {
+				return o < extents_[i].partition_offset + extents_[i].length;
+			});
+
+		while (length > 0) {
+			if (it == by_partition_.end()) {
+				f(offset, length, std::int64_t(-1));
+				return;
+			}
+
+			extent const &e = extents_[*it];
+			if (offset < e.partition_offset) {
+				std::int64_t const len = std::min(length, e.partition_offset - offset);
+				f(offset, len, std::int64_t(-1));
+				offset += len;
+				length -= len;
+				continue;
+			}
+
+			std::int64_t const len = std::min(length, e.partition_offset + e.length - offset);
+			f(offset, len, e.torrent_offset + (offset - e.partition_offset));
+			offset += len;
+			length -= len;
+			++it;
+		}
+	}
+
+	// split contiguous blocks start from offset along extents, call
+	// f(extent, partition_offset, iov, iovcnt) for each run on partition.
+	// pad files are skipped. iovcnt is at most IOV_MAX.
+	template<typename Fun>
+	bool for_each_iov(iovec const *iov, int const iovcnt, libtorrent::piece_index_t const piece, int const offset, Fun f) const
+	{
+		std::int64_t length = 0;
+		for (int i = 0; i < iovcnt; i++) {
+			length += iov[i].iov_len;
+		}
+
+		// cursor in iov
+		int cur = 0;
+		std::size_t cur_offset = 0;
+		iovec vec[IOV_MAX];
+
+		return for_each_extent(piece, offset, length,
+			[&](extent const &e, std::int64_t partition_offset, std::int64_t len) {
+				while (len > 0) {
+					int n = 0;
+					std::int64_t batch = 0;
+					while (len > batch && n < IOV_MAX) {
+						std::size_t const l = std::min(static_cast<std::size_t>(len - batch), iov[cur].iov_len - cur_offset);
+						vec[n].iov_base = static_cast<char *>(iov[cur].iov_base) + cur_offset;
+						vec[n].iov_len = l;
+						n++;
+						batch += l;
+						cur_offset += l;
+						if (cur_offset == iov[cur].iov_len) {
+							cur++;
+							cur_offset = 0;
+						}
+					}
+
+					if (partition_offset >= 0) {
+						if (!f(e, partition_offset, vec, n)) {
+							return false;
+						}
+						partition_offset += batch;
+					}
+					len -= batch;
+				}
+				return true;
+			});
+	}
+
+	int read(char *buffer, libtorrent::piece_index_t const piece, int const offset,
+		int const length, libtorrent::storage_error &error);
+
+	void write(char *buffer, libtorrent::piece_index_t const piece, int const offset,
+		int const length, libtorrent::storage_error &error);
+
+	// start writeback of the range in background
+	void start_writeback(libtorrent::piece_index_t const piece, int const offset, int const length);
+
+	// wait writeback started before, to bound dirty pages
+	void wait_writeback();
+
+	// zero the range without writing it, discard or write zeroes offload
+	// on block devices, hole in image files. false if the target can't,
+	// then error is only set for real I/O errors
+	bool zero(libtorrent::piece_index_t const piece, int const offset, int const length,
+		libtorrent::storage_error &error);
+
+	// fdatasync the partition
+	void sync(libtorrent::storage_error &error);
+
+	// write contiguous blocks start from offset with pwritev().
+	// return the number of syscalls issued, slices is how many pwrite()
+	// would be issued if the blocks were written one by one.
+	int writev(iovec const *iov, int const iovcnt, libtorrent::piece_index_t const piece,
+		int const offset, int &slices, libtorrent::storage_error &error);
+};
+
+}  // namespace ezio
+
+#endif
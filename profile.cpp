@@ -0,0 +1,287 @@
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+
+#include "profile.hpp"
+
+namespace ezio
+{
+namespace
+{
+	struct profile {
+		char const *name;
+		std::function<void(lt::settings_pack &, torrent_defaults &)> apply;
+	};
+
+	// tuned for a LAN where every peer is a classroom machine. receivers
+	// become seeds right after they finish, so they upload a lot too
+	std::vector<profile> const &profiles()
+	{
+		static std::vector<profile> const list = {
+			// the first seed of a deployment, serves many receivers
+			{"lan-seed", [](lt::settings_pack &p, torrent_defaults &d) {
+				p.set_int(lt::settings_pack::connections_limit, 1000);
+				p.set_int(lt::settings_pack::unchoke_slots_limit, 64);
+				p.set_int(lt::settings_pack::choking_algorithm, lt::settings_pack::fixed_slots_choker);
+				// spread pieces to all receivers, they trade them later
+				p.set_int(lt::settings_pack::seed_choking_algorithm, lt::settings_pack::round_robin);
+				p.set_int(lt::settings_pack::send_buffer_watermark, 8 * 1024 * 1024);
+				p.set_int(lt::settings_pack::send_buffer_low_watermark, 1024 * 1024);
+				p.set_int(lt::settings_pack::send_buffer_watermark_factor, 150);
+				p.set_int(lt::settings_pack::max_queued_disk_bytes, 32 * 1024 * 1024);
+				p.set_int(lt::settings_pack::suggest_mode, lt::settings_pack::suggest_read_cache);
+				d.max_uploads = 16;
+				d.max_connections = 64;
+				d.super_seeding = true;
+			}},
+			// downloads to disk and seeds what it has
+			{"lan-receiver", [](lt::settings_pack &p, torrent_defaults &d) {
+				p.set_int(lt::settings_pack::connections_limit, 200);
+				p.set_int(lt::settings_pack::unchoke_slots_limit, 16);
+				p.set_int(lt::settings_pack::choking_algorithm, lt::settings_pack::fixed_slots_choker);
+				p.set_int(lt::settings_pack::seed_choking_algorithm, lt::settings_pack::fastest_upload);
+				p.set_int(lt::settings_pack::send_buffer_watermark, 2 * 1024 * 1024);
+				p.set_int(lt::settings_pack::send_buffer_low_watermark, 512 * 1024);
+				p.set_int(lt::settings_pack::send_buffer_watermark_factor, 100);
+				p.set_int(lt::settings_pack::max_queued_disk_bytes, 16 * 1024 * 1024);
+				p.set_int(lt::settings_pack::suggest_mode, lt::settings_pack::no_piece_suggestions);
+				d.max_uploads = 8;
+				d.max_connections = 32;
+				d.super_seeding = false;
+			}},
+			// little RAM, e.g. a live system running from memory
+			{"low-memory", [](lt::settings_pack &p, torrent_defaults &d) {
+				p.set_int(lt::settings_pack::connections_limit, 50);
+				p.set_int(lt::settings_pack::unchoke_slots_limit, 4);
+				p.set_int(lt::settings_pack::choking_algorithm, lt::settings_pack::fixed_slots_choker);
+				p.set_int(lt::settings_pack::seed_choking_algorithm, lt::settings_pack::fastest_upload);
+				p.set_int(lt::settings_pack::send_buffer_watermark, 256 * 1024);
+				p.set_int(lt::settings_pack::send_buffer_low_watermark, 64 * 1024);
+				p.set_int(lt::settings_pack::send_buffer_watermark_factor, 50);
+				p.set_int(lt::settings_pack::max_queued_disk_bytes, 1024 * 1024);
+				p.set_int(lt::settings_pack::suggest_mode, lt::settings_pack::no_piece_suggestions);
+				d.max_uploads = 3;
+				d.max_connections = 5;
+				d.super_seeding = false;
+			}},
+		};
+		return list;
+	}
+
+	// ezio_ settings, all of torrent_defaults
+	struct ezio_setting {
+		char const *name;
+		// int or bool member, the other is nullptr
+		int torrent_defaults::*int_value;
+		bool torrent_defaults::*bool_value;
+	};
+
+	ezio_setting const ezio_settings[] = {
+		{EZIO_SETTING_PREFIX "max_uploads", &torrent_defaults::max_uploads, nullptr},
+		{EZIO_SETTING_PREFIX "max_connections", &torrent_defaults::max_connections, nullptr},
+		{EZIO_SETTING_PREFIX "super_seeding", nullptr, &torrent_defaults::super_seeding},
+	};
+
+	ezio_setting const *find_ezio_setting(std::string const &name)
+	{
+		for (auto const &s : ezio_settings) {
+			if (name == s.name) {
+				return &s;
+			}
+		}
+		return nullptr;
+	}
+
+	bool parse_int(std::string const &value, int &result)
+	{
+		if (value.empty()) {
+			return false;
+		}
+		char *end = nullptr;
+		long const v = std::strtol(value.c_str(), &end, 0);
+		if (*end != '\0' || v < INT32_MIN || v > INT32_MAX) {
+			return false;
+		}
+		result = int(v);
+		return true;
+	}
+
+	bool parse_bool(std::string const &value, bool &result)
+	{
+		if (value == "true" || value == "1") {
+			result = true;
+		} else if (value == "false" || value == "0") {
+			result = false;
+		} else {
+			return false;
+		}
+		return true;
+	}
+
+	// every index of settings_pack, names of removed settings are empty
+	template<typename Fun>
+	void for_each_setting(Fun f)
+	{
+		for (int i = 0; i < lt::settings_pack::num_string_settings; i++) {
+			f(lt::settings_pack::string_type_base + i);
+		}
+		for (int i = 0; i < lt::settings_pack::num_int_settings; i++) {
+			f(lt::settings_pack::int_type_base + i);
+		}
+		for (int i = 0; i < lt::settings_pack::num_bool_settings; i++) {
+			f(lt::settings_pack::bool_type_base + i);
+		}
+	}
+
+	std::string value_of(lt::settings_pack const &pack, int index)
+	{
+		switch (index & lt::settings_pack::type_mask) {
+		case lt::settings_pack::string_type_base:
+			return pack.get_str(index);
+		case lt::settings_pack::int_type_base:
+			return std::to_string(pack.get_int(index));
+		default:
+			return pack.get_bool(index) ? "true" : "false";
+		}
+	}
+}  // namespace
+
+std::vector<std::string> profile_names()
+{
+	std::vector<std::string> names;
+	for (auto const &p : profiles()) {
+		names.push_back(p.name);
+	}
+	return names;
+}
+
+bool apply_profile(std::string const &name, lt::settings_pack &pack, torrent_defaults &defaults)
+{
+	for (auto const &p : profiles()) {
+		if (name == p.name) {
+			p.apply(pack, defaults);
+			return true;
+		}
+	}
+	return false;
+}
+
+std::vector<std::string> setting_names()
+{
+	std::vector<std::string> names;
+	for_each_setting([&names](int index) {
+		std::string const name = lt::name_for_setting(index);
+		if (!name.empty()) {
+			names.push_back(name);
+		}
+	});
+	for (auto const &s : ezio_settings) {
+		names.push_back(s.name);
+	}
+	return names;
+}
+
+bool set_setting(std::string const &name, std::string const &value,
+	lt::settings_pack &pack, torrent_defaults &defaults, std::string &error)
+{
+	if (ezio_setting const *s = find_ezio_setting(name)) {
+		bool const ok = s->int_value ? parse_int(value, defaults.*(s->int_value))
+									 : parse_bool(value, defaults.*(s->bool_value));
+		if (!ok) {
+			error = "invalid value " + value + " of " + name;
+		}
+		return ok;
+	}
+
+	int const index = lt::setting_by_name(name);
+	if (index < 0) {
+		error = "unknown setting " + name;
+		return false;
+	}
+
+	switch (index & lt::settings_pack::type_mask) {
+	case lt::settings_pack::string_type_base:
+		pack.set_str(index, value);
+		return true;
+	case lt::settings_pack::int_type_base: {
+		int v = 0;
+		if (!parse_int(value, v)) {
+			error = "invalid value " + value + " of " + name;
+			return false;
+		}
+		pack.set_int(index, v);
+		return true;
+	}
+	default: {
+		bool v = false;
+		if (!parse_bool(value, v)) {
+			error = "invalid value " + value + " of " + name;
+			return false;
+		}
+		pack.set_bool(index, v);
+		return true;
+	}
+	}
+}
+
+bool get_setting(std::string const &name, lt::settings_pack const &pack,
+	torrent_defaults const &defaults, std::string &value)
+{
+	if (ezio_setting const *s = find_ezio_setting(name)) {
+		value = s->int_value ? std::to_string(defaults.*(s->int_value))
+							 : (defaults.*(s->bool_value) ? "true" : "false");
+		return true;
+	}
+
+	int const index = lt::setting_by_name(name);
+	if (index < 0) {
+		return false;
+	}
+	value = value_of(pack, index);
+	return true;
+}
+
+setting_list changed_settings(lt::settings_pack const &pack,
+	torrent_defaults const &before, torrent_defaults const &after)
+{
+	setting_list changed;
+	for_each_setting([&](int index) {
+		std::string const name = lt::name_for_setting(index);
+		if (!name.empty() && pack.has_val(index)) {
+			changed.emplace_back(name, value_of(pack, index));
+		}
+	});
+
+	for (auto const &s : ezio_settings) {
+		std::string old_value;
+		std::string new_value;
+		get_setting(s.name, pack, before, old_value);
+		get_setting(s.name, pack, after, new_value);
+		if (old_value != new_value) {
+			changed.emplace_back(s.name, new_value);
+		}
+	}
+	return changed;
+}
+
+void merge_settings(lt::settings_pack &to, lt::settings_pack const &from)
+{
+	for_each_setting([&](int index) {
+		if (!from.has_val(index)) {
+			return;
+		}
+		switch (index & lt::settings_pack::type_mask) {
+		case lt::settings_pack::string_type_base:
+			to.set_str(index, from.get_str(index));
+			break;
+		case lt::settings_pack::int_type_base:
+			to.set_int(index, from.get_int(index));
+			break;
+		default:
+			to.set_bool(index, from.get_bool(index));
+			break;
+		}
+	});
+}
+
+}  // namespace ezio
@@ -0,0 +1,46 @@
+#ifndef __PROFILE_HPP__
+#define __PROFILE_HPP__
+
+#include <string>
+#include <utility>
+#include <vector>
+#include <libtorrent/libtorrent.hpp>
+
+// settings of ezio itself are listed with libtorrent ones under this prefix
+#define EZIO_SETTING_PREFIX "ezio_"
+
+namespace ezio
+{
+// per torrent values libtorrent has no session setting for
+struct torrent_defaults {
+	// used when AddRequest leaves them 0
+	int max_uploads{3};
+	int max_connections{5};
+	// super seeding for torrents added in seeding mode
+	bool super_seeding{false};
+};
+
+// name and value as text, bool is true or false
+using setting_list = std::vector<std::pair<std::string, std::string>>;
+
+std::vector<std::string> profile_names();
+// set values of a built-in profile, false if the name is unknown
+bool apply_profile(std::string const &name, lt::settings_pack &pack, torrent_defaults &defaults);
+
+// all libtorrent and ezio_ setting names
+std::vector<std::string> setting_names();
+// parse value into pack or defaults, error is set on failure
+bool set_setting(std::string const &name, std::string const &value,
+	lt::settings_pack &pack, torrent_defaults &defaults, std::string &error);
+// false if the name is unknown
+bool get_setting(std::string const &name, lt::settings_pack const &pack,
+	torrent_defaults const &defaults, std::string &value);
+// values set in pack, and ezio_ values which differ between before and after
+setting_list changed_settings(lt::settings_pack const &pack,
+	torrent_defaults const &before, torrent_defaults const &after);
+// copy values set in from into to
+void merge_settings(lt::settings_pack &to, lt::settings_pack const &from);
+
+}  // namespace ezio
+
+#endif
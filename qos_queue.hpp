@@ -0,0 +1,185 @@
+#ifndef __QOS_QUEUE_HPP__
+#define __QOS_QUEUE_HPP__
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include <boost/asio.hpp>
+#include <boost/core/noncopyable.hpp>
+#include <libtorrent/libtorrent.hpp>
+
+namespace ezio
+{
+enum class io_class {
+	read = 0,
+	write = 1,
+};
+
+#define IO_CLASSES 2
+
+// jobs of one disk. classes share the threads by weight, reads waiting
+// longer than the deadline go first. in a class, jobs of each key (storage)
+// are queued separately and picked in round robin, so a busy torrent
+// doesn't starve others.
+class qos_queue : boost::noncopyable
+{
+public:
+	qos_queue(boost::asio::thread_pool &pool, std::array<int, IO_CLASSES> const &weights,
+		std::chrono::microseconds read_deadline) :
+		pool_(pool),
+		weights_(weights),
+		credits_(weights),
+		read_deadline_(read_deadline)
+	{
+	}
+
+	// job might be move only
+	template<typename F>
+	void post(io_class c, libtorrent::storage_index_t key, F &&f)
+	{
+		auto job = std::make_shared<typename std::decay<F>::type>(std::forward<F>(f));
+		{
+			std::lock_guard<std::mutex> l(mutex_);
+			classes_[int(c)].jobs[key].push_back({std::chrono::steady_clock::now(), [job]() {
+				(*job)();
+			}});
+			classes_[int(c)].pending++;
+		}
+		queued_++;
+
+		// one runner for each job, runner picks the class and key
+		boost::asio::post(pool_, [this]() {
+			run_one();
+		});
+	}
+
+	// jobs waiting in all classes
+	int queued() const
+	{
+		return queued_;
+	}
+
+	// stats of a class
+	std::int64_t jobs(io_class c) const
+	{
+		return classes_[int(c)].done;
+	}
+
+	std::int64_t total_wait_us(io_class c) const
+	{
+		return classes_[int(c)].total_wait_us;
+	}
+
+	std::int64_t max_wait_us(io_class c) const
+	{
+		return classes_[int(c)].max_wait_us;
+	}
+
+private:
+	struct job {
+		std::chrono::steady_clock::time_point queued;
+		std::function<void()> fun;
+	};
+
+	struct job_class {
+		std::map<libtorrent::storage_index_t, std::deque<job>> jobs;
+		int pending{0};
+		// key served last time
+		libtorrent::storage_index_t last{};
+
+		std::atomic<std::int64_t> done{0};
+		std::atomic<std::int64_t> total_wait_us{0};
+		std::atomic<std::int64_t> max_wait_us{0};
+	};
+
+	// under mutex_
+	int pick_class(std::chrono::steady_clock::time_point now)
+	{
+		// late reads first
+		job_class &reads = classes_[int(io_class::read)];
+		if (reads.pending) {
+			for (auto const &q : reads.jobs) {
+				if (now - q.second.front().queued > read_deadline_) {
+					return int(io_class::read);
+				}
+			}
+		}
+
+		// weighted round robin
+		for (int round = 0; round < 2; round++) {
+			for (int c = 0; c < IO_CLASSES; c++) {
+				if (classes_[c].pending && credits_[c] > 0) {
+					credits_[c]--;
+					return c;
+				}
+			}
+			credits_ = weights_;
+		}
+
+		// weight 0, only runs when nothing else
+		for (int c = 0; c < IO_CLASSES; c++) {
+			if (classes_[c].pending) {
+				return c;
+			}
+		}
+		return -1;
+	}
+
+	void run_one()
+	{
+		std::function<void()> fun;
+		job_class *jc = nullptr;
+		std::chrono::microseconds wait{0};
+		{
+			std::lock_guard<std::mutex> l(mutex_);
+			auto const now = std::chrono::steady_clock::now();
+			int const c = pick_class(now);
+			if (c < 0) {
+				return;
+			}
+
+			jc = &classes_[c];
+			auto it = jc->jobs.upper_bound(jc->last);
+			if (it == jc->jobs.end()) {
+				it = jc->jobs.begin();
+			}
+
+			jc->last = it->first;
+			wait = std::chrono::duration_cast<std::chrono::microseconds>(now - it->second.front().queued);
+			fun = std::move(it->second.front().fun);
+			it->second.pop_front();
+			if (it->second.empty()) {
+				jc->jobs.erase(it);
+			}
+			jc->pending--;
+		}
+		queued_--;
+
+		jc->done++;
+		jc->total_wait_us += wait.count();
+		std::int64_t max = jc->max_wait_us;
+		while (max < wait.count() && !jc->max_wait_us.compare_exchange_weak(max, wait.count())) {
+		}
+
+		fun();
+	}
+
+	boost::asio::thread_pool &pool_;
+	std::mutex mutex_;
+	std::array<job_class, IO_CLASSES> classes_;
+	std::array<int, IO_CLASSES> const weights_;
+	std::array<int, IO_CLASSES> credits_;
+	std::chrono::microseconds const read_deadline_;
+	std::atomic<int> queued_{0};
+};
+
+}  // namespace ezio
+
+#endif
@@ -1,5 +1,13 @@
+#include <algorithm>
+#include <cstring>
+#include <iterator>
 #include <string>
-#include <sys/mman.h>
+#include <fstream>
+#include <future>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
 
 #include <boost/assert.hpp>
 #include <spdlog/spdlog.h>
@@ -8,160 +16,326 @@
 #include "raw_disk_io.hpp"
 #include "buffer_pool.hpp"
 #include "store_buffer.hpp"
+#include "partition_storage.hpp"
+#include "config.hpp"
+#include "affinity.hpp"
 
 namespace ezio
 {
-class partition_storage
+std::unique_ptr<libtorrent::disk_interface> raw_disk_io_constructor(libtorrent::io_context &ioc,
+	libtorrent::settings_interface const &s,
+	libtorrent::counters &c,
+	config const &cfg)
 {
-private:
-	// fd to partition.
-	int fd_{0};
-	void *mapping_addr_{nullptr};
-	size_t mapping_len_{0};
-
-	libtorrent::file_storage const &fs_;
+	return std::make_unique<raw_disk_io>(ioc, s, cfg);
+}
 
-public:
-	partition_storage(const std::string &path, libtorrent::file_storage const &fs) :
-		fs_(fs)
+namespace
+{
+	// whole disk of the path, so partitions on the same disk share threads
+	dev_t disk_of(std::string const &path)
 	{
-		fd_ = open(path.c_str(), O_RDWR);
-		if (fd_ < 0) {
-			SPDLOG_CRITICAL("failed to open ({}) = {}", path, strerror(fd_));
-			exit(1);
+		struct stat st;
+		if (stat(path.c_str(), &st)) {
+			return 0;
+		}
+
+		dev_t dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+		std::string const sys = "/sys/dev/block/" + std::to_string(major(dev)) + ":" + std::to_string(minor(dev));
+		if (access((sys + "/partition").c_str(), F_OK) == 0) {
+			// parent of partition in sysfs is the disk
+			std::ifstream f(sys + "/../dev");
+			unsigned maj = 0;
+			unsigned min = 0;
+			char colon = 0;
+			if (f >> maj >> colon >> min) {
+				dev = makedev(maj, min);
+			}
 		}
+		return dev;
 	}
 
-	~partition_storage()
+	// rotational flag is on the whole disk
+	bool rotational(std::string const &path)
 	{
-		int ec = close(fd_);
-		if (ec) {
-			SPDLOG_ERROR("close: {}", strerror(ec));
-		}
+		dev_t const dev = disk_of(path);
+		std::ifstream f("/sys/dev/block/" + std::to_string(major(dev)) + ":" + std::to_string(minor(dev))
+			+ "/queue/rotational");
+		int flag = 0;
+		return (f >> flag) && flag == 1;
 	}
 
-	int piece_size(libtorrent::piece_index_t const piece)
+	std::chrono::microseconds since(std::chrono::steady_clock::time_point t)
 	{
-		return fs_.piece_size(piece);
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t);
 	}
 
-	int read(char *buffer, libtorrent::piece_index_t const piece, int const offset,
-		int const length, libtorrent::storage_error &error)
+	// OR 64 bytes at a time and stop at the first non zero chunk, the
+	// compiler turns the inner OR into SSE2/AVX2 or NEON
+	bool all_zero(char const *buf, int length)
 	{
-		BOOST_ASSERT(buffer != nullptr);
-
-		auto file_slices = fs_.map_block(piece, offset, length);
-		int ret = 0;
-
-		for (const auto &file_slice : file_slices) {
-			const auto &file_index = file_slice.file_index;
-
-			int64_t partition_offset = 0;
-
-			// to find partition_offset from file name.
-			std::string file_name(fs_.file_name(file_index));
-			try {
-				partition_offset = std::stoll(file_name, 0, 16);
-				partition_offset += file_slice.offset;
-			} catch (const std::exception &e) {
-				SPDLOG_CRITICAL("failed to parse file_name({}) at ({}): {}",
-					file_name, static_cast<std::int32_t>(file_index), e.what());
-				error.file(file_index);
-				error.ec = libtorrent::errors::parse_failed;
-				error.operation = libtorrent::operation_t::file_read;
-				return ret;
+		int i = 0;
+		for (; i + 64 <= length; i += 64) {
+			std::uint64_t w[8];
+			std::memcpy(w, buf + i, sizeof(w));
+			if ((w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) != 0) {
+				return false;
 			}
-
-			pread(fd_, buffer, file_slice.size, partition_offset);
-			ret += file_slice.size;
-			buffer += file_slice.size;
 		}
-		return ret;
+		for (; i < length; i++) {
+			if (buf[i] != 0) {
+				return false;
+			}
+		}
+		return true;
 	}
 
-	void write(char *buffer, libtorrent::piece_index_t const piece, int const offset,
-		int const length, libtorrent::storage_error &error)
+	// a run is traced from its first block in, as one job
+	void trace_run(std::vector<pending_write> &run)
 	{
-		BOOST_ASSERT(buffer != nullptr);
-
-		auto file_slices = fs_.map_block(piece, offset, length);
-
-		for (const auto &file_slice : file_slices) {
-			const auto &file_index = file_slice.file_index;
-
-			int64_t partition_offset = 0;
-
-			// to find partition_offset from file name.
-			std::string file_name(fs_.file_name(file_index));
-			try {
-				partition_offset = std::stoll(file_name, 0, 16);
-				partition_offset += file_slice.offset;
-			} catch (const std::exception &e) {
-				SPDLOG_CRITICAL("failed to parse file_name({}) at ({}): {}",
-					file_name, static_cast<std::int32_t>(file_index), e.what());
-				error.file(file_index);
-				error.ec = libtorrent::errors::parse_failed;
-				error.operation = libtorrent::operation_t::file_write;
-				return;
+		job_trace &t = run.front().trace;
+		for (auto const &w : run) {
+			if (w.trace.enqueue && (!t.enqueue || w.trace.enqueue < t.enqueue)) {
+				t.enqueue = w.trace.enqueue;
 			}
-
-			pwrite(fd_, buffer, file_slice.size, partition_offset);
-			buffer += file_slice.size;
 		}
+		t.on_queue();
 	}
-};
 
-std::unique_ptr<libtorrent::disk_interface> raw_disk_io_constructor(libtorrent::io_context &ioc,
-	libtorrent::settings_interface const &s,
-	libtorrent::counters &c)
-{
-	return std::make_unique<raw_disk_io>(ioc);
-}
+	std::vector<int> cpus_from(std::string const &list, char const *name)
+	{
+		std::vector<int> cpus;
+		if (!list.empty() && !parse_cpu_list(list, cpus)) {
+			SPDLOG_WARN("invalid {} ({}), ignored", name, list);
+		}
+		return cpus;
+	}
+}  // namespace
 
-raw_disk_io::raw_disk_io(libtorrent::io_context &ioc) :
+raw_disk_io::raw_disk_io(libtorrent::io_context &ioc, libtorrent::settings_interface const &s, config const &cfg) :
 	ioc_(ioc),
-	read_buffer_pool_(ioc),
-	write_buffer_pool_(ioc),
-	read_thread_pool_(8),
-	write_thread_pool_(8),
-	hash_thread_pool_(8)
+	read_buffer_pool_(ioc, std::size_t(cfg.buffer_pool_size) * 1024 * 1024, cfg.hugepage_flag),
+	write_buffer_pool_(ioc, std::size_t(cfg.buffer_pool_size) * 1024 * 1024, cfg.hugepage_flag,
+		std::size_t(cfg.buffer_pool_max_size) * 1024 * 1024),
+	read_cache_(std::int64_t(cfg.read_cache_size) * 1024 * 1024),
+	uring_(cfg.io_uring_flag ? uring_io::create(cfg.io_uring_entries) : nullptr),
+	per_disk_queue_(cfg.per_disk_queue_flag),
+	qos_weights_{{std::max(cfg.read_weight, 0), std::max(cfg.write_weight, 0)}},
+	read_deadline_(std::chrono::milliseconds(cfg.read_deadline)),
+	mmap_seed_(cfg.mmap_seed_flag),
+	direct_io_(cfg.direct_io_flag),
+	elevator_(cfg.elevator),
+	sync_policy_(cfg.sync_policy),
+	zero_blocks_(cfg.zero_blocks),
+	writeback_size_(std::int64_t(cfg.writeback_size) * 1024 * 1024),
+	// read and write go through io_uring, keep one thread for sync fallback
+	io_threads_(uring_ ? 1 : std::max(s.get_int(libtorrent::settings_pack::aio_threads), 1)),
+	io_cpus_(cpus_from(cfg.io_cpus, "io-cpus")),
+	hash_thread_pool_(std::max(s.get_int(libtorrent::settings_pack::hashing_threads), 1)),
+	storages_(MAX_STORAGES),
+	flush_timer_(ioc)
 {
+	int const hash_threads = std::max(s.get_int(libtorrent::settings_pack::hashing_threads), 1);
+	std::vector<int> hash_cpus = cpus_from(cfg.hash_cpus, "hash-cpus");
+	if (hash_cpus.empty() && cfg.hash_numa_node >= 0 && !numa_node_cpus(cfg.hash_numa_node, hash_cpus)) {
+		SPDLOG_WARN("failed to get cpus of NUMA node {}", cfg.hash_numa_node);
+	}
+	pin_thread_pool(hash_thread_pool_, hash_threads, hash_cpus);
+	read_buffer_pool_.set_name("read pool");
+	write_buffer_pool_.set_name("write pool");
+
+	if (cfg.buffer_pool_max_size > cfg.buffer_pool_size) {
+		// grow for fast disk or shrink for slow disk, down to 1/4
+		write_buffer_pool_.enable_adaptive(std::size_t(cfg.buffer_pool_size) * 1024 * 1024 / 4,
+			std::chrono::milliseconds(cfg.write_latency_target));
+		SPDLOG_INFO("adaptive write buffer pool, {} MB to {} MB, latency target {} ms",
+			cfg.buffer_pool_size / 4, cfg.buffer_pool_max_size, cfg.write_latency_target);
+	}
+
+	if (!per_disk_queue_) {
+		create_queue("");
+	}
+	SPDLOG_INFO("disk threads: {} read and write for {}, {} hash", io_threads_ * 2,
+		per_disk_queue_ ? "each disk" : "all disks", hash_threads);
+	SPDLOG_INFO("disk QoS: read weight {}, write weight {}, read deadline {} ms",
+		qos_weights_[int(io_class::read)], qos_weights_[int(io_class::write)], cfg.read_deadline);
+	config const defaults;
+	if (uring_ && (cfg.read_weight != defaults.read_weight || cfg.write_weight != defaults.write_weight ||
+					  cfg.read_deadline != defaults.read_deadline)) {
+		// reads and writes go to io_uring directly, disk queues only run
+		// bounce buffer, zero and sync jobs
+		SPDLOG_WARN("--read-weight, --write-weight and --read-deadline only apply to jobs outside io_uring");
+	}
+
+	if (uring_ && elevator_ != "off") {
+		// io_uring runs are submitted at once, there is no queue to sort
+		SPDLOG_WARN("--elevator is ignored with --io-uring");
+		elevator_ = "off";
+	}
+
+	if (uring_) {
+		// same order as READ_BUFFER_INDEX and WRITE_BUFFER_INDEX
+		std::vector<iovec> bufs{
+			{read_buffer_pool_.slab(), read_buffer_pool_.slab_size()},
+			{write_buffer_pool_.slab(), write_buffer_pool_.slab_size()}};
+		uring_->register_buffers(bufs);
+	}
 }
 
 raw_disk_io::~raw_disk_io()
 {
-	read_thread_pool_.join();
-	write_thread_pool_.join();
+	if (uring_) {
+		uring_->stop();
+	}
+	for (auto &q : disk_queues_) {
+		q.second->pool.join();
+	}
 	hash_thread_pool_.join();
 }
 
+disk_queue *raw_disk_io::create_queue(std::string const &path)
+{
+	dev_t const dev = per_disk_queue_ ? disk_of(path) : 0;
+
+	std::lock_guard<std::mutex> l(published_mutex_);
+	auto &q = disk_queues_[dev];
+	if (!q) {
+		// as many threads as separate read and write pools would have
+		q = std::make_unique<disk_queue>(io_threads_ * 2, qos_weights_, read_deadline_);
+		pin_thread_pool(q->pool, io_threads_ * 2, io_cpus_);
+		if (per_disk_queue_) {
+			SPDLOG_INFO("new disk queue for {}:{} ({})", major(dev), minor(dev), path);
+		}
+	}
+	return q.get();
+}
+
 libtorrent::storage_holder raw_disk_io::new_torrent(libtorrent::storage_params const &p,
 	std::shared_ptr<void> const &)
 {
 	const std::string &target_partition = p.path;
 
-	int idx = storages_.size();
-	if (!free_slots_.empty()) {
-		// TODO need a lock
-		idx = free_slots_.front();
-		free_slots_.pop_front();
+	// reuse the lowest free slot
+	int idx = -1;
+	for (int i = 0; i < MAX_STORAGES; i++) {
+		if (!storages_[i]) {
+			if (idx < 0) {
+				idx = i;
+			}
+		} else if (storages_[i]->path == target_partition) {
+			SPDLOG_WARN("{} is already used by storage {}", target_partition, i);
+		}
+	}
+
+	if (idx < 0) {
+		SPDLOG_ERROR("too many torrents, at most {}", MAX_STORAGES);
+		throw boost::system::system_error(libtorrent::error_code(
+			boost::system::errc::too_many_files_open, libtorrent::system_category()));
+	}
+
+	bool direct = direct_io_;
+	{
+		std::lock_guard<std::mutex> l(published_mutex_);
+		direct = direct_paths_.erase(target_partition) > 0 || direct;
+	}
+
+	auto entry = std::make_shared<storage_entry>();
+	entry->index = libtorrent::storage_index_t(idx);
+	entry->path = target_partition;
+	entry->storage = std::make_unique<partition_storage>(target_partition, p.files, mmap_seed_, false, direct);
+	entry->queue = create_queue(target_partition);
+	entry->blocks_per_piece = p.files.piece_length() / DEFAULT_BLOCK_SIZE;
+	entry->written_blocks.resize(std::size_t(p.files.num_pieces()) * std::size_t(entry->blocks_per_piece));
+	entry->pieces.resize(std::size_t(p.files.num_pieces()));
+	if (elevator_ == "on" || (elevator_ == "auto" && rotational(target_partition))) {
+		SPDLOG_INFO("write elevator enabled for {}", target_partition);
+		entry->elevator = std::make_unique<write_elevator>();
+	}
+	if (uring_) {
+		entry->uring_slot = uring_->register_file(entry->storage->fd());
+	}
+	{
+		std::lock_guard<std::mutex> l(published_mutex_);
+		published_[target_partition] = entry;
 	}
+	storages_[idx] = std::move(entry);
+
+	SPDLOG_INFO("new_torrent {} => storage {}", target_partition, idx);
+	return libtorrent::storage_holder(libtorrent::storage_index_t(idx), *this);
+}
+
+void raw_disk_io::use_direct_io(std::string const &path)
+{
+	std::lock_guard<std::mutex> l(published_mutex_);
+	direct_paths_.insert(path);
+}
+
+void raw_disk_io::cancel_direct_io(std::string const &path)
+{
+	std::lock_guard<std::mutex> l(published_mutex_);
+	direct_paths_.erase(path);
+}
 
-	auto storage = std::make_unique<partition_storage>(target_partition, p.files);
-	storages_.emplace(idx, std::move(storage));
+void raw_disk_io::on_piece_written(piece_written_handler h)
+{
+	piece_written_ = std::move(h);
+}
 
-	if (idx > 0) {
-		SPDLOG_WARN("new_torrent current idx => {}, should be 0", idx);
+bool raw_disk_io::piece_pending(std::string const &path, libtorrent::piece_index_t piece)
+{
+	if (store_buffer_.size() == 0) {
+		return false;
 	}
 
-	return libtorrent::storage_holder(idx, *this);
+	storage_ptr entry;
+	{
+		std::lock_guard<std::mutex> l(published_mutex_);
+		auto it = published_.find(path);
+		if (it == published_.end()) {
+			return false;
+		}
+		entry = it->second;
+	}
+
+	int const size = entry->storage->piece_size(piece);
+	for (int offset = 0; offset < size; offset += DEFAULT_BLOCK_SIZE) {
+		if (store_buffer_.get({entry->index, piece, offset}, [](char const *) {})) {
+			return true;
+		}
+	}
+	return false;
 }
 
 void raw_disk_io::remove_torrent(libtorrent::storage_index_t idx)
 {
-	// TODO need a lock
-	storages_.erase(idx);
-	free_slots_.push_back(idx);
+	storage_ptr &entry = storages_[static_cast<std::uint32_t>(idx)];
+	if (!entry) {
+		return;
+	}
+
+	storage_stats const &stats = entry->stats;
+	SPDLOG_INFO("remove_torrent {} (storage {}): read {} bytes in {} jobs, write {} bytes in {} jobs, hash {} bytes in {} jobs",
+		entry->path, static_cast<std::uint32_t>(idx), stats.read_bytes.load(), stats.read_jobs.load(),
+		stats.write_bytes.load(), stats.write_jobs.load(), stats.hash_bytes.load(), stats.hash_jobs.load());
+	if (entry->elevator) {
+		SPDLOG_INFO("write elevator {}: {} runs in {} sweeps", entry->path,
+			entry->elevator->runs(), entry->elevator->sweeps());
+	}
+
+	if (uring_) {
+		uring_->unregister_file(entry->uring_slot);
+	}
+	erase_hash_states(idx);
+	read_cache_.erase_storage(idx);
+	{
+		std::lock_guard<std::mutex> l(published_mutex_);
+		auto it = published_.find(entry->path);
+		if (it != published_.end() && it->second == entry) {
+			published_.erase(it);
+		}
+	}
+	// jobs still running keep their own reference
+	entry.reset();
 }
 
 void raw_disk_io::async_read(
@@ -179,6 +353,22 @@ void raw_disk_io::async_read(
 		return;
 	}
 
+	// seeding, point into the mapping. if any write is pending, the block
+	// on disk might be stale, use the normal path for store_buffer.
+	partition_storage *st = storage(idx)->storage.get();
+	if (st->mapping() && store_buffer_.size() == 0) {
+		char const *data = st->mapped(r.piece, r.start, r.length);
+		if (data) {
+			if (r.start == 0) {
+				st->will_need(r.piece);
+			}
+			mmap_reads_++;
+			st->mapping()->acquire();
+			handler(libtorrent::disk_buffer_holder(*st->mapping(), const_cast<char *>(data), r.length), error);
+			return;
+		}
+	}
+
 	char *buf = read_buffer_pool_.allocate_buffer();
 	libtorrent::disk_buffer_holder buffer(read_buffer_pool_, buf, DEFAULT_BLOCK_SIZE);
 	if (!buf) {
@@ -213,24 +403,17 @@ void raw_disk_io::async_read(
 		if (ret == 3) {
 			// success get whole piece
 			// return immediately
+			memory_reads_++;
 			handler(std::move(buffer), error);
 			return;
 		}
 
 		if (ret != 0) {
 			// partial
-			boost::asio::post(read_thread_pool_,
-				[=, this, handler = std::move(handler), buffer = std::move(buffer)]() mutable {
-					libtorrent::storage_error error;
-					auto offset = (ret == 1) ? r.start : block_offset + DEFAULT_BLOCK_SIZE;
-					auto len = (ret == 1) ? len1 : r.length - len1;
-					auto buf_offset = (ret == 1) ? 0 : len1;
-					storages_[idx]->read(buf + buf_offset, r.piece, offset, len, error);
-
-					post(ioc_, [h = std::move(handler), b = std::move(buffer), error]() mutable {
-						h(std::move(b), error);
-					});
-				});
+			auto offset = (ret == 1) ? r.start : block_offset + DEFAULT_BLOCK_SIZE;
+			auto len = (ret == 1) ? len1 : r.length - len1;
+			auto buf_offset = (ret == 1) ? 0 : len1;
+			read_job(idx, r.piece, offset, len, buf + buf_offset, std::move(buffer), std::move(handler));
 			return;
 		}
 
@@ -240,19 +423,165 @@ void raw_disk_io::async_read(
 		if (store_buffer_.get({idx, r.piece, block_offset}, [&](char const *buf1) {
 				std::memcpy(buf, buf1 + read_offset, std::size_t(r.length));
 			})) {
+			memory_reads_++;
 			handler(std::move(buffer), error);
 			return;
 		}
 	}
 
-	boost::asio::post(read_thread_pool_,
-		[=, this, handler = std::move(handler), buffer = std::move(buffer)]() mutable {
-			libtorrent::storage_error error;
-			storages_[idx]->read(buf, r.piece, r.start, r.length, error);
+	if (read_cache_.enabled()) {
+		cached_read(idx, r, buf, std::move(buffer), std::move(handler));
+		return;
+	}
+
+	read_job(idx, r.piece, r.start, r.length, buf, std::move(buffer), std::move(handler));
+}
 
+void raw_disk_io::cached_read(libtorrent::storage_index_t idx, libtorrent::peer_request const &r,
+	char *buf, libtorrent::disk_buffer_holder buffer,
+	std::function<void(libtorrent::disk_buffer_holder, libtorrent::storage_error const &)> handler)
+{
+	// std::function needs copyable
+	auto b = std::make_shared<libtorrent::disk_buffer_holder>(std::move(buffer));
+	auto h = std::make_shared<std::function<void(libtorrent::disk_buffer_holder, libtorrent::storage_error const &)>>(
+		std::move(handler));
+	read_cache::waiter w = [this, idx, r, buf, b, h](char const *data) {
+		if (!data) {
+			// not cached, read the block only
+			read_job(idx, r.piece, r.start, r.length, buf, std::move(*b), std::move(*h));
+			return;
+		}
+		std::memcpy(buf, data + r.start, std::size_t(r.length));
+		(*h)(std::move(*b), libtorrent::storage_error());
+	};
+
+	read_cache::key const k{idx, r.piece};
+	bool queued = false;
+	char const *data = read_cache_.get(k, w, queued);
+	if (data || queued) {
+		if (data) {
+			memory_reads_++;
+			w(data);
+		}
+		return;
+	}
+
+	storage_ptr const entry = storage(idx);
+	int const size = entry->storage->piece_size(r.piece);
+	std::uint64_t id = 0;
+	std::shared_ptr<char> piece_buf = read_cache_.insert(k, size, w, id);
+	if (!piece_buf) {
+		w(nullptr);
+		return;
+	}
+
+	// one large read for the whole piece
+	entry->stats.read_jobs++;
+	entry->stats.read_bytes += size;
+	reads_inflight_++;
+	auto const start = std::chrono::steady_clock::now();
+	job_trace trace = job_trace::begin();
+	entry->queue->jobs.post(io_class::read, idx, [=, this]() mutable {
+		libtorrent::storage_error error;
+		trace.on_start();
+		// blocks still in coalescing or the write queue are newer than the
+		// disk, a write coming later erases the entry and drops this load
+		read_chunk(entry->storage.get(), idx, r.piece, 0, size, piece_buf.get(), error);
+		trace.on_io_done("read piece", idx, r.piece, 0, size);
+		read_latency_.record(since(start));
+		blocks_read_ += (size + DEFAULT_BLOCK_SIZE - 1) / DEFAULT_BLOCK_SIZE;
+		reads_inflight_--;
+		if (error) {
+			SPDLOG_WARN("failed to read piece {} for cache: {}", static_cast<int>(r.piece), error.ec.message());
+		}
+
+		post(ioc_, [=, this]() {
+			trace.on_callback();
+			read_cache_.loaded(k, id, !error);
+		});
+	});
+}
+
+void raw_disk_io::read_job(libtorrent::storage_index_t idx, libtorrent::piece_index_t piece, int offset, int len,
+	char *buf, libtorrent::disk_buffer_holder buffer,
+	std::function<void(libtorrent::disk_buffer_holder, libtorrent::storage_error const &)> handler)
+{
+	storage_ptr const &entry = storage(idx);
+	entry->stats.read_jobs++;
+	entry->stats.read_bytes += len;
+	reads_inflight_++;
+	auto const queued = std::chrono::steady_clock::now();
+	job_trace trace = job_trace::begin();
+
+	iovec const read_vec{buf, static_cast<std::size_t>(len)};
+	// unaligned O_DIRECT reads take the bounce buffer in a disk thread
+	if (uring_ && entry->storage->direct_aligned(&read_vec, 1, piece, offset)) {
+		partition_storage *st = entry->storage.get();
+		int const slot = entry->uring_slot;
+		auto job = std::make_unique<uring_job>();
+
+		bool const in_range = st->for_each_extent(piece, offset, len,
+			[&](extent const &, std::int64_t const partition_offset, std::int64_t const l) {
+				if (partition_offset < 0) {
+					// pad file
+					std::memset(buf, 0, l);
+				} else {
+					iovec const vec{buf, static_cast<std::size_t>(l)};
+					job->add(false, st->fd(), slot, partition_offset, &vec, 1, READ_BUFFER_INDEX);
+				}
+				buf += l;
+				return true;
+			});
+
+		if (!in_range) {
+			libtorrent::storage_error error;
+			error.ec = libtorrent::errors::invalid_request;
+			error.operation = libtorrent::operation_t::file_read;
+			reads_inflight_--;
 			post(ioc_, [h = std::move(handler), b = std::move(buffer), error]() mutable {
 				h(std::move(b), error);
 			});
+			return;
+		}
+
+		// std::function needs copyable, entry keeps fd open until done
+		auto b = std::make_shared<libtorrent::disk_buffer_holder>(std::move(buffer));
+		// io is from submit to completion
+		trace.on_start();
+		job->done = [=, this, h = std::move(handler)](libtorrent::error_code const &ec) {
+			libtorrent::storage_error error;
+			if (ec) {
+				error.ec = ec;
+				error.operation = libtorrent::operation_t::file_read;
+			}
+			read_latency_.record(since(queued));
+			blocks_read_++;
+			reads_inflight_--;
+			job_trace t = trace;
+			t.on_io_done("read", idx, piece, offset, len);
+			post(ioc_, [=]() mutable {
+				t.on_callback();
+				h(std::move(*b), error);
+			});
+		};
+		uring_->submit(std::move(job));
+		return;
+	}
+
+	entry->queue->jobs.post(io_class::read, idx,
+		[=, this, handler = std::move(handler), buffer = std::move(buffer)]() mutable {
+			libtorrent::storage_error error;
+			trace.on_start();
+			entry->storage->read(buf, piece, offset, len, error);
+			trace.on_io_done("read", idx, piece, offset, len);
+			read_latency_.record(since(queued));
+			blocks_read_++;
+			reads_inflight_--;
+
+			post(ioc_, [=, h = std::move(handler), b = std::move(buffer)]() mutable {
+				trace.on_callback();
+				h(std::move(b), error);
+			});
 		});
 }
 
@@ -263,6 +592,7 @@ bool raw_disk_io::async_write(libtorrent::storage_index_t storage, libtorrent::p
 {
 	BOOST_ASSERT(DEFAULT_BLOCK_SIZE >= r.length);
 
+	job_trace trace = job_trace::begin();
 	bool exceeded = false;
 	libtorrent::disk_buffer_holder buffer(write_buffer_pool_, write_buffer_pool_.allocate_buffer(exceeded, o), DEFAULT_BLOCK_SIZE);
 
@@ -270,86 +600,848 @@ bool raw_disk_io::async_write(libtorrent::storage_index_t storage, libtorrent::p
 		// async
 		memcpy(buffer.data(), buf, r.length);
 		store_buffer_.insert({storage, r.piece, r.start}, buffer.data());
+		read_cache_.erase({storage, r.piece});
 
-		libtorrent::peer_request r2(r);
-		boost::asio::post(write_thread_pool_,
-			[=, this, handler = std::move(handler), buffer = std::move(buffer)]() {
-				libtorrent::storage_error error;
-				storages_[storage]->write(buffer.data(), r.piece, r.start, r.length, error);
-
-				store_buffer_.erase({storage, r.piece, r.start});
+		auto b = std::make_shared<libtorrent::disk_buffer_holder>(std::move(buffer));
+		feed_hash(storage, r, b);
+		queue_write(storage, r, std::move(b), std::move(handler), trace);
 
-				post(ioc_, [=, h = std::move(handler)] {
-					h(error);
-				});
-			});
+		// pool is almost full, don't hold buffers for coalescing
+		if (exceeded) {
+			flush_all();
+			drop_waiting_hash();
+		}
 		return exceeded;
 	}
 
 	// sync
 	libtorrent::storage_error error;
-	storages_[storage]->write(const_cast<char *>(buf), r.piece, r.start, r.length, error);
+	read_cache_.erase({storage, r.piece});
+	trace.on_start();
+	storage_entry &entry = *this->storage(storage);
+	std::uint32_t const resets = piece_resets(entry, r.piece);
+	entry.storage->write(const_cast<char *>(buf), r.piece, r.start, r.length, error);
+	trace.on_io_done("write", storage, r.piece, r.start, r.length);
+	if (!error) {
+		entry.stats.written_bytes += r.length;
+		mark_written(entry, r.piece, r.start, r.length, resets);
+	}
 
 	post(ioc_, [=, h = std::move(handler)] {
+		trace.on_callback();
 		h(error);
 	});
 	return exceeded;
 }
 
+void raw_disk_io::queue_write(libtorrent::storage_index_t storage, libtorrent::peer_request const &r,
+	std::shared_ptr<libtorrent::disk_buffer_holder> buffer, std::function<void(libtorrent::storage_error const &)> handler,
+	job_trace trace)
+{
+	piece_key const key{storage, r.piece};
+	auto it = pending_writes_.find(key);
+
+	// same block is written again, flush the old one first
+	if (it != pending_writes_.end() && it->second.blocks.count(r.start)) {
+		flush_piece(it);
+		it = pending_writes_.end();
+	}
+
+	if (it == pending_writes_.end()) {
+		it = pending_writes_.emplace(key, pending_piece{}).first;
+		it->second.since = std::chrono::steady_clock::now();
+	}
+
+	pending_piece &p = it->second;
+	auto const block = p.blocks.emplace(r.start,
+		pending_write{r.start, r.length, std::move(buffer), std::move(handler), trace}).first;
+	p.bytes += r.length;
+
+	// whole piece is here
+	if (p.bytes >= this->storage(storage)->storage->piece_size(r.piece)) {
+		flush_piece(it);
+		return;
+	}
+
+	// find the contiguous run around this block
+	auto first = block;
+	while (first != p.blocks.begin()) {
+		auto prev = std::prev(first);
+		if (prev->second.offset + prev->second.length != first->second.offset) {
+			break;
+		}
+		first = prev;
+	}
+
+	int run_bytes = 0;
+	auto last = first;
+	for (auto prev = p.blocks.end(); last != p.blocks.end(); prev = last++) {
+		if (prev != p.blocks.end() && prev->second.offset + prev->second.length != last->second.offset) {
+			break;
+		}
+		run_bytes += last->second.length;
+	}
+
+	if (run_bytes >= MAX_COALESCE_SIZE) {
+		flush_run(key, p, first, last);
+		if (p.blocks.empty()) {
+			pending_writes_.erase(it);
+		}
+	}
+
+	arm_flush_timer();
+}
+
+void raw_disk_io::flush_run(piece_key const &key, pending_piece &p,
+	std::map<int, pending_write>::iterator first, std::map<int, pending_write>::iterator last)
+{
+	libtorrent::storage_index_t const storage = key.first;
+	libtorrent::piece_index_t const piece = key.second;
+	storage_ptr const &entry = this->storage(storage);
+	std::uint32_t const resets = piece_resets(*entry, piece);
+
+	std::vector<pending_write> run;
+	for (auto it = first; it != last; ++it) {
+		p.bytes -= it->second.length;
+		run.push_back(std::move(it->second));
+		run.back().resets = resets;
+	}
+	p.blocks.erase(first, last);
+
+	entry->stats.write_jobs++;
+	for (auto const &w : run) {
+		entry->stats.write_bytes += w.length;
+	}
+	// for write latency, including time in queue
+	auto const queued = std::chrono::steady_clock::now();
+
+	if (zero_blocks_ == "write") {
+		write_run(entry, storage, piece, std::move(run), queued);
+		return;
+	}
+
+	// split into runs of all zero blocks and the others, blocks are
+	// contiguous so each part is still a run
+	std::size_t begin = 0;
+	while (begin < run.size()) {
+		bool const zero = all_zero(run[begin].buffer->data(), run[begin].length);
+		std::size_t end = begin + 1;
+		while (end < run.size() && all_zero(run[end].buffer->data(), run[end].length) == zero) {
+			end++;
+		}
+
+		std::vector<pending_write> part(std::make_move_iterator(run.begin() + begin), std::make_move_iterator(run.begin() + end));
+		if (zero) {
+			zero_run(entry, storage, piece, std::move(part), queued);
+		} else {
+			write_run(entry, storage, piece, std::move(part), queued);
+		}
+		begin = end;
+	}
+}
+
+void raw_disk_io::zero_run(storage_ptr const &entry, libtorrent::storage_index_t storage, libtorrent::piece_index_t piece,
+	std::vector<pending_write> run, std::chrono::steady_clock::time_point queued)
+{
+	std::int64_t bytes = 0;
+	for (auto const &w : run) {
+		bytes += w.length;
+	}
+	zero_blocks_found_ += std::int64_t(run.size());
+	trace_run(run);
+
+	if (zero_blocks_ == "skip") {
+		// target is cleared before deployment, nothing to write
+		zero_bytes_saved_ += bytes;
+		entry->stats.written_bytes += bytes;
+		run.front().trace.on_io_done("write", storage, piece, run.front().offset, int(bytes));
+		complete_run(entry, piece, run, libtorrent::storage_error());
+		return;
+	}
+
+	std::uint64_t const seq = begin_write(entry);
+	entry->queue->jobs.post(io_class::write, storage, [=, this, run = std::move(run)]() mutable {
+		libtorrent::storage_error error;
+		run.front().trace.on_start();
+		if (entry->storage->zero(piece, run.front().offset, int(bytes), error)) {
+			zero_bytes_saved_ += bytes;
+		} else if (!error) {
+			// not supported by the target, the blocks are zeros anyway
+			std::vector<iovec> iov(run.size());
+			for (std::size_t i = 0; i < run.size(); i++) {
+				iov[i].iov_base = run[i].buffer->data();
+				iov[i].iov_len = run[i].length;
+			}
+			int slices = 0;
+			entry->storage->writev(iov.data(), int(iov.size()), piece, run.front().offset, slices, error);
+		}
+		run.front().trace.on_io_done("write", storage, piece, run.front().offset, int(bytes));
+
+		written(entry, seq, piece, run.front().offset, int(bytes), !error, false, queued);
+		complete_run(entry, piece, run, error);
+	});
+}
+
+void raw_disk_io::write_run(storage_ptr const &entry, libtorrent::storage_index_t storage, libtorrent::piece_index_t piece,
+	std::vector<pending_write> run, std::chrono::steady_clock::time_point queued)
+{
+	trace_run(run);
+	std::vector<iovec> iov(run.size());
+	std::int64_t bytes = 0;
+	for (std::size_t i = 0; i < run.size(); i++) {
+		iov[i].iov_base = run[i].buffer->data();
+		iov[i].iov_len = run[i].length;
+		bytes += run[i].length;
+	}
+
+	// unaligned O_DIRECT runs, e.g. the short last block of the torrent,
+	// take the bounce buffer in a disk thread
+	if (uring_ && entry->storage->direct_aligned(iov.data(), int(iov.size()), piece, run.front().offset)) {
+		partition_storage *st = entry->storage.get();
+		int const slot = entry->uring_slot;
+		auto job = std::make_unique<uring_job>();
+		int slices = 0;
+
+		bool const in_range = st->for_each_iov(iov.data(), int(iov.size()), piece, run.front().offset,
+			[&](extent const &, std::int64_t const partition_offset, iovec const *vec, int const n) {
+				job->add(true, st->fd(), slot, partition_offset, vec, n, WRITE_BUFFER_INDEX);
+				slices += n;
+				return true;
+			});
+
+		coalesced_bytes_ += bytes;
+		coalesced_syscalls_ += job->ops.size();
+		saved_syscalls_ += slices - int(job->ops.size());
+
+		if (!in_range) {
+			libtorrent::storage_error error;
+			error.ec = libtorrent::errors::invalid_request;
+			error.operation = libtorrent::operation_t::file_write;
+			complete_run(entry, piece, run, error);
+			return;
+		}
+
+		// entry keeps fd open until done
+		std::uint64_t const seq = begin_write(entry);
+		// io is from submit to completion
+		run.front().trace.on_start();
+		auto r = std::make_shared<std::vector<pending_write>>(std::move(run));
+		job->done = [this, entry, seq, storage, piece, r, bytes, queued](libtorrent::error_code const &ec) {
+			libtorrent::storage_error error;
+			if (ec) {
+				error.ec = ec;
+				error.operation = libtorrent::operation_t::file_write;
+			}
+			r->front().trace.on_io_done("write", storage, piece, r->front().offset, int(bytes));
+			written(entry, seq, piece, r->front().offset, int(bytes), !ec, true, queued);
+			complete_run(entry, piece, *r, error);
+		};
+		uring_->submit(std::move(job));
+		return;
+	}
+
+	std::int64_t const run_offset = entry->storage->partition_offset(piece, run.front().offset);
+	std::uint64_t const seq = begin_write(entry);
+
+	// iov points into buffers the run keeps alive
+	auto job = [=, this, run = std::move(run)]() mutable {
+		libtorrent::storage_error error;
+		int slices = 0;
+		run.front().trace.on_start();
+		int const syscalls = entry->storage->writev(iov.data(), int(iov.size()), piece, run.front().offset, slices, error);
+		run.front().trace.on_io_done("write", storage, piece, run.front().offset, int(bytes));
+
+		coalesced_bytes_ += bytes;
+		coalesced_syscalls_ += syscalls;
+		saved_syscalls_ += slices - syscalls;
+
+		written(entry, seq, piece, run.front().offset, int(bytes), !error, false, queued);
+		complete_run(entry, piece, run, error);
+	};
+
+	if (entry->elevator) {
+		// one drain at a time for each storage, it writes in offset order
+		if (entry->elevator->push(run_offset, bytes, std::move(job))) {
+			drain_elevator(entry);
+		}
+		return;
+	}
+
+	entry->queue->jobs.post(io_class::write, storage, std::move(job));
+}
+
+void raw_disk_io::drain_elevator(storage_ptr const &entry)
+{
+	// one run for each job, so reads still get their share
+	entry->queue->jobs.post(io_class::write, entry->index, [this, entry]() {
+		if (entry->elevator->drain_one()) {
+			drain_elevator(entry);
+		}
+	});
+}
+
+std::uint64_t raw_disk_io::begin_write(storage_ptr const &entry)
+{
+	entry->writes_inflight++;
+	writes_inflight_++;
+
+	std::lock_guard<std::mutex> l(entry->sync_mutex);
+	std::uint64_t const seq = entry->next_write++;
+	entry->running_writes.insert(seq);
+	return seq;
+}
+
+void raw_disk_io::written(storage_ptr const &entry, std::uint64_t seq, libtorrent::piece_index_t piece, int offset,
+	int length, bool ok, bool uring, std::chrono::steady_clock::time_point queued)
+{
+	std::chrono::microseconds const latency = since(queued);
+	// blocks in coalescing, the elevator and the write queue
+	write_buffer_pool_.record_latency(latency, int(store_buffer_.size()));
+	write_latency_.record(latency);
+	blocks_written_ += (length + DEFAULT_BLOCK_SIZE - 1) / DEFAULT_BLOCK_SIZE;
+	writes_inflight_--;
+
+	if (ok) {
+		entry->stats.written_bytes += length;
+
+		if (writeback_size_ > 0) {
+			// rolling writeback behind the write front, and wait for the
+			// previous window so dirty pages don't pile up
+			entry->storage->start_writeback(piece, offset, length);
+			if (entry->unsynced_bytes.fetch_add(length) + length >= writeback_size_) {
+				entry->unsynced_bytes = 0;
+				if (uring) {
+					// never block the io_uring thread, it reaps every job
+					entry->queue->jobs.post(io_class::write, entry->index, [entry]() {
+						entry->storage->wait_writeback();
+					});
+				} else {
+					entry->storage->wait_writeback();
+				}
+			}
+		}
+	}
+
+	entry->writes_inflight--;
+
+	bool sync = false;
+	{
+		std::lock_guard<std::mutex> l(entry->sync_mutex);
+		entry->running_writes.erase(seq);
+		// every run before the oldest one still running is done
+		std::uint64_t const done = entry->running_writes.empty() ? entry->next_write : *entry->running_writes.begin();
+		while (!entry->sync_barriers.empty() && entry->sync_barriers.front() <= done) {
+			entry->sync_barriers.pop_front();
+			sync = true;
+		}
+	}
+	if (sync) {
+		queue_sync(entry);
+	}
+}
+
+void raw_disk_io::request_sync(storage_ptr const &entry)
+{
+	if (sync_policy_ == "none") {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> l(entry->sync_mutex);
+		// runs started later are not part of this request
+		if (!entry->running_writes.empty()) {
+			entry->sync_barriers.push_back(entry->next_write);
+			return;
+		}
+	}
+	queue_sync(entry);
+}
+
+void raw_disk_io::queue_sync(storage_ptr const &entry)
+{
+	// requests before the sync starts are batched into one
+	if (entry->sync_queued.exchange(true)) {
+		return;
+	}
+
+	entry->queue->jobs.post(io_class::write, entry->index, [entry]() {
+		entry->sync_queued = false;
+		sync_entry(entry);
+	});
+}
+
+bool raw_disk_io::sync_entry(storage_ptr const &entry)
+{
+	// complete before the sync starts, so it covers them
+	std::vector<std::pair<libtorrent::piece_index_t, std::uint32_t>> pieces;
+	{
+		std::lock_guard<std::mutex> l(entry->sync_mutex);
+		pieces.swap(entry->unsynced_pieces);
+	}
+
+	libtorrent::storage_error error;
+	entry->storage->sync(error);
+
+	std::lock_guard<std::mutex> l(entry->sync_mutex);
+	if (error) {
+		SPDLOG_ERROR("fdatasync {}: {}", entry->path, error.ec.message());
+		// the next sync tries them again
+		entry->unsynced_pieces.insert(entry->unsynced_pieces.end(), pieces.begin(), pieces.end());
+		return false;
+	}
+
+	for (auto const &p : pieces) {
+		piece_sync_state &ps = entry->pieces[std::size_t(static_cast<int>(p.first))];
+		// written again while syncing, it waits for the next sync
+		if (ps.writes != p.second || ps.durable) {
+			continue;
+		}
+		ps.durable = true;
+		entry->stats.durable_bytes += entry->storage->piece_size(p.first);
+	}
+	return true;
+}
+
+std::uint32_t raw_disk_io::piece_resets(storage_entry &entry, libtorrent::piece_index_t piece)
+{
+	std::lock_guard<std::mutex> l(entry.sync_mutex);
+	return entry.pieces[std::size_t(static_cast<int>(piece))].resets;
+}
+
+void raw_disk_io::mark_written(storage_entry &entry, libtorrent::piece_index_t piece, int offset, int length,
+	std::uint32_t resets)
+{
+	int const p = static_cast<int>(piece);
+	int const size = entry.storage->piece_size(piece);
+	int const blocks = (size + DEFAULT_BLOCK_SIZE - 1) / DEFAULT_BLOCK_SIZE;
+	std::size_t const base = std::size_t(p) * std::size_t(entry.blocks_per_piece);
+
+	std::lock_guard<std::mutex> l(entry.sync_mutex);
+	piece_sync_state &ps = entry.pieces[std::size_t(p)];
+	if (ps.resets != resets) {
+		// flushed before the piece failed its hash check
+		return;
+	}
+
+	for (int b = offset / DEFAULT_BLOCK_SIZE; b * DEFAULT_BLOCK_SIZE < offset + length; b++) {
+		if (!entry.written_blocks[base + std::size_t(b)]) {
+			entry.written_blocks[base + std::size_t(b)] = true;
+			ps.blocks++;
+		}
+	}
+	ps.writes++;
+	if (ps.durable) {
+		// rewritten, only in page cache again
+		ps.durable = false;
+		entry.stats.durable_bytes -= size;
+	}
+	if (ps.blocks == blocks) {
+		entry.unsynced_pieces.emplace_back(piece, ps.writes);
+	}
+}
+
+void raw_disk_io::mark_durable(storage_entry &entry, libtorrent::piece_index_t piece)
+{
+	int const p = static_cast<int>(piece);
+	int const size = entry.storage->piece_size(piece);
+	int const blocks = (size + DEFAULT_BLOCK_SIZE - 1) / DEFAULT_BLOCK_SIZE;
+	std::size_t const base = std::size_t(p) * std::size_t(entry.blocks_per_piece);
+
+	std::lock_guard<std::mutex> l(entry.sync_mutex);
+	piece_sync_state &ps = entry.pieces[std::size_t(p)];
+	for (int b = 0; b < blocks; b++) {
+		entry.written_blocks[base + std::size_t(b)] = true;
+	}
+	ps.blocks = blocks;
+	if (!ps.durable) {
+		ps.durable = true;
+		entry.stats.durable_bytes += size;
+	}
+}
+
+void raw_disk_io::sync_storage(std::string const &path, std::function<void(bool)> done)
+{
+	storage_ptr entry;
+	{
+		std::lock_guard<std::mutex> l(published_mutex_);
+		auto it = published_.find(path);
+		if (it != published_.end()) {
+			entry = it->second;
+		}
+	}
+
+	if (!entry) {
+		done(false);
+		return;
+	}
+
+	// pieces libtorrent reports as have are already written, so one
+	// fdatasync after now covers the bitmap taken before
+	entry->queue->jobs.post(io_class::write, entry->index, [entry, done = std::move(done)]() {
+		done(sync_entry(entry));
+	});
+}
+
+std::int64_t raw_disk_io::durable_bytes(std::string const &path) const
+{
+	std::lock_guard<std::mutex> l(published_mutex_);
+	auto it = published_.find(path);
+	if (it == published_.end()) {
+		return -1;
+	}
+	return it->second->stats.durable_bytes;
+}
+
+void raw_disk_io::complete_run(storage_ptr const &entry, libtorrent::piece_index_t piece,
+	std::vector<pending_write> &run, libtorrent::storage_error const &error)
+{
+	std::vector<std::function<void(libtorrent::storage_error const &)>> handlers;
+	handlers.reserve(run.size());
+	for (auto &w : run) {
+		store_buffer_.erase({entry->index, piece, w.offset});
+		handlers.push_back(std::move(w.handler));
+	}
+
+	if (!error) {
+		int const length = run.back().offset + run.back().length - run.front().offset;
+		mark_written(*entry, piece, run.front().offset, length, run.front().resets);
+	}
+
+	// blocks are on disk and out of store_buffer now
+	if (!error && piece_written_) {
+		piece_written_(entry->path, piece);
+	}
+
+	job_trace const trace = run.front().trace;
+	post(ioc_, [=, handlers = std::move(handlers)] {
+		trace.on_callback();
+		for (auto const &h : handlers) {
+			h(error);
+		}
+	});
+}
+
+void raw_disk_io::flush_piece(std::map<piece_key, pending_piece>::iterator it)
+{
+	pending_piece &p = it->second;
+
+	// split into contiguous runs
+	while (!p.blocks.empty()) {
+		auto first = p.blocks.begin();
+		auto last = std::next(first);
+		auto prev = first;
+		while (last != p.blocks.end() && prev->second.offset + prev->second.length == last->second.offset) {
+			prev = last++;
+		}
+		flush_run(it->first, p, first, last);
+	}
+
+	pending_writes_.erase(it);
+}
+
+void raw_disk_io::flush_storage(libtorrent::storage_index_t storage)
+{
+	for (auto it = pending_writes_.begin(); it != pending_writes_.end();) {
+		auto cur = it++;
+		if (cur->first.first == storage) {
+			flush_piece(cur);
+		}
+	}
+}
+
+void raw_disk_io::flush_all()
+{
+	while (!pending_writes_.empty()) {
+		flush_piece(pending_writes_.begin());
+	}
+}
+
+void raw_disk_io::arm_flush_timer()
+{
+	if (flush_timer_armed_ || pending_writes_.empty()) {
+		return;
+	}
+
+	flush_timer_armed_ = true;
+	flush_timer_.expires_after(std::chrono::milliseconds(COALESCE_TIMEOUT_MS));
+	flush_timer_.async_wait([this](boost::system::error_code const &ec) {
+		flush_timer_armed_ = false;
+		if (ec) {
+			return;
+		}
+
+		auto const deadline = std::chrono::steady_clock::now() - std::chrono::milliseconds(COALESCE_TIMEOUT_MS);
+		for (auto it = pending_writes_.begin(); it != pending_writes_.end();) {
+			auto cur = it++;
+			if (cur->second.since <= deadline) {
+				flush_piece(cur);
+			}
+		}
+
+		arm_flush_timer();
+	});
+}
+
+void raw_disk_io::feed_hash(libtorrent::storage_index_t storage, libtorrent::peer_request const &r,
+	std::shared_ptr<libtorrent::disk_buffer_holder> buffer)
+{
+	auto &state = hash_states_[{storage, r.piece}];
+	if (!state) {
+		state = std::make_shared<piece_hash_state>(hash_thread_pool_);
+		partition_storage *st = this->storage(storage)->storage.get();
+		if (st->v2()) {
+			state->v2 = true;
+			state->piece_size2 = st->piece_size2(r.piece);
+		}
+	}
+
+	boost::asio::post(state->strand, [state, r, buffer = std::move(buffer)]() {
+		if (state->failed) {
+			return;
+		}
+
+		if (r.start < state->cursor || state->waiting.count(r.start) || state->block_hashes.count(r.start)) {
+			// written twice, we don't know which one is on disk
+			state->failed = true;
+			state->waiting.clear();
+			return;
+		}
+
+		// block hash doesn't depend on order
+		if (state->v2 && r.start < state->piece_size2) {
+			int const len2 = std::min(r.length, state->piece_size2 - r.start);
+			state->block_hashes.emplace(r.start, libtorrent::hasher256(buffer->data(), len2).final());
+		}
+
+		state->waiting.emplace(r.start, std::make_pair(r.length, buffer));
+		while (!state->waiting.empty() && state->waiting.begin()->first == state->cursor) {
+			auto const &w = state->waiting.begin()->second;
+			state->ph.update(w.second->data(), w.first);
+			state->cursor += w.first;
+			state->waiting.erase(state->waiting.begin());
+		}
+	});
+}
+
+void raw_disk_io::drop_waiting_hash()
+{
+	// release out of order blocks to buffer pool, those pieces fallback to read
+	for (auto const &s : hash_states_) {
+		auto state = s.second;
+		boost::asio::post(state->strand, [state]() {
+			if (!state->waiting.empty()) {
+				state->failed = true;
+				state->waiting.clear();
+			}
+		});
+	}
+}
+
+void raw_disk_io::erase_hash_states(libtorrent::storage_index_t storage)
+{
+	for (auto it = hash_states_.begin(); it != hash_states_.end();) {
+		if (it->first.first == storage) {
+			it = hash_states_.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+namespace
+{
+	// double buffer for reading pieces back, one set for each hash thread
+	struct hash_read_buffers {
+		char *buf[2]{nullptr, nullptr};
+
+		hash_read_buffers()
+		{
+			for (auto &b : buf) {
+				// aligned for O_DIRECT
+				if (posix_memalign(reinterpret_cast<void **>(&b), 4096, HASH_READ_SIZE)) {
+					b = nullptr;
+				}
+			}
+		}
+
+		~hash_read_buffers()
+		{
+			for (auto b : buf) {
+				free(b);
+			}
+		}
+	};
+}  // namespace
+
+int raw_disk_io::read_chunk(partition_storage *st, libtorrent::storage_index_t storage, libtorrent::piece_index_t piece,
+	int const offset, int const length, char *buf, libtorrent::storage_error &error)
+{
+	// blocks not written yet are only in store_buffer, check it before
+	// reading disk. a block not found is already on disk.
+	int run_start = -1;
+	for (int pos = 0; pos < length; pos += DEFAULT_BLOCK_SIZE) {
+		int const len = std::min(DEFAULT_BLOCK_SIZE, length - pos);
+		bool const hit = store_buffer_.get({storage, piece, offset + pos}, [&](char const *buf1) {
+			std::memcpy(buf + pos, buf1, len);
+		});
+
+		if (!hit && run_start < 0) {
+			run_start = pos;
+		}
+
+		if (hit && run_start >= 0) {
+			st->read(buf + run_start, piece, offset + run_start, pos - run_start, error);
+			run_start = -1;
+			if (error) {
+				return 0;
+			}
+		}
+	}
+
+	if (run_start >= 0) {
+		st->read(buf + run_start, piece, offset + run_start, length - run_start, error);
+		if (error) {
+			return 0;
+		}
+	}
+	return length;
+}
+
+libtorrent::sha1_hash raw_disk_io::hash_piece(storage_ptr const &entry, libtorrent::storage_index_t storage, libtorrent::piece_index_t piece,
+	libtorrent::span<libtorrent::sha256_hash> v2, bool v1, libtorrent::storage_error &error)
+{
+	static thread_local hash_read_buffers buffers;
+	if (!buffers.buf[0] || !buffers.buf[1]) {
+		error.ec = libtorrent::errors::no_memory;
+		error.operation = libtorrent::operation_t::alloc_cache_piece;
+		return libtorrent::sha1_hash{};
+	}
+
+	libtorrent::hasher ph;
+	partition_storage *st = entry->storage.get();
+
+	int const piece_size = v1 ? st->piece_size(piece) : 0;
+	int const piece_size2 = v2.empty() ? 0 : st->piece_size2(piece);
+	int const read_size = std::max(piece_size, piece_size2);
+	int const chunks = (read_size + HASH_READ_SIZE - 1) / HASH_READ_SIZE;
+	entry->stats.hash_jobs++;
+	entry->stats.hash_bytes += read_size;
+	blocks_hashed_ += (read_size + DEFAULT_BLOCK_SIZE - 1) / DEFAULT_BLOCK_SIZE;
+
+	// read next chunk in read thread while hashing this one
+	read_chunk(st, storage, piece, 0, std::min(HASH_READ_SIZE, read_size), buffers.buf[0], error);
+	for (int i = 0; i < chunks && !error; i++) {
+		int const offset = i * HASH_READ_SIZE;
+		int const len = std::min(HASH_READ_SIZE, read_size - offset);
+
+		std::future<void> next;
+		libtorrent::storage_error next_error;
+		if (i + 1 < chunks) {
+			int const next_offset = offset + HASH_READ_SIZE;
+			int const next_len = std::min(HASH_READ_SIZE, read_size - next_offset);
+			char *next_buf = buffers.buf[(i + 1) & 1];
+			std::packaged_task<void()> task([&, next_offset, next_len, next_buf]() {
+				read_chunk(st, storage, piece, next_offset, next_len, next_buf, next_error);
+			});
+			next = task.get_future();
+			entry->queue->jobs.post(io_class::read, storage, std::move(task));
+		}
+
+		char const *buf = buffers.buf[i & 1];
+		if (v1) {
+			ph.update(buf, std::min(len, piece_size - offset));
+		}
+
+		// SHA-256 for each block in v2 part of this chunk
+		for (int pos = 0; pos < len; pos += DEFAULT_BLOCK_SIZE) {
+			int const block = (offset + pos) / DEFAULT_BLOCK_SIZE;
+			if (block >= v2.size() || offset + pos >= piece_size2) {
+				break;
+			}
+			int const len2 = std::min(DEFAULT_BLOCK_SIZE, piece_size2 - offset - pos);
+			v2[block] = libtorrent::hasher256(buf + pos, len2).final();
+		}
+
+		if (next.valid()) {
+			next.wait();
+			error = next_error;
+		}
+	}
+
+	return v1 ? ph.final() : libtorrent::sha1_hash{};
+}
+
 void raw_disk_io::async_hash(
 	libtorrent::storage_index_t storage, libtorrent::piece_index_t piece, libtorrent::span<libtorrent::sha256_hash> v2,
 	libtorrent::disk_job_flags_t flags,
 	std::function<void(libtorrent::piece_index_t, libtorrent::sha1_hash const &, libtorrent::storage_error const &)>
 		handler)
 {
-	libtorrent::storage_error error;
-	char *buf = read_buffer_pool_.allocate_buffer();
+	// v1 hash is always needed for v1 only torrent
+	bool const v1 = (flags & libtorrent::disk_interface::v1_hash) || v2.empty();
 
-	if (!buf) {
-		error.ec = libtorrent::errors::no_memory;
-		error.operation = libtorrent::operation_t::alloc_cache_piece;
-		post(ioc_, [=, h = std::move(handler)] {
-			h(piece, libtorrent::sha1_hash{}, error);
-		});
-		return;
+	// all blocks of the piece are written
+	if (sync_policy_ == "piece") {
+		request_sync(this->storage(storage));
 	}
 
-	auto buffer = libtorrent::disk_buffer_holder(read_buffer_pool_, buf, DEFAULT_BLOCK_SIZE);
+	auto it = hash_states_.find({storage, piece});
+	if (it != hash_states_.end()) {
+		// all blocks written are already posted to the strand before this
+		auto state = std::move(it->second);
+		hash_states_.erase(it);
+		storage_ptr const entry = this->storage(storage);
+		int const piece_size = entry->storage->piece_size(piece);
+		auto const queued = std::chrono::steady_clock::now();
+		job_trace trace = job_trace::begin();
+
+		boost::asio::post(state->strand,
+			[=, this, handler = std::move(handler)]() mutable {
+				libtorrent::storage_error error;
+				libtorrent::sha1_hash hash;
+				trace.on_start();
 
-	boost::asio::post(hash_thread_pool_,
-		[=, this, handler = std::move(handler), buffer = std::move(buffer)]() {
-			libtorrent::storage_error error;
-			libtorrent::hasher ph;
-			partition_storage *st = storages_[storage].get();
-
-			int const piece_size = st->piece_size(piece);
-			int const blocks_in_piece = (piece_size + DEFAULT_BLOCK_SIZE - 1) / DEFAULT_BLOCK_SIZE;
-
-			int offset = 0;
-			int const blocks_to_read = blocks_in_piece;
-			int len = 0;
-			int ret = 0;
-			for (int i = 0; i < blocks_to_read; i++) {
-				len = std::min(DEFAULT_BLOCK_SIZE, piece_size - offset);
-				bool hit = store_buffer_.get({storage, piece, offset}, [&](char const *buf1) {
-					ph.update(buf1, len);
-					ret = len;
-				});
-				if (!hit) {
-					ret = st->read(buf, piece, offset, len, error);
-					if (ret > 0) {
-						ph.update(buf, ret);
-					}
+				bool hit = !state->failed && (!v1 || state->cursor == piece_size);
+				for (int i = 0; hit && i < v2.size(); i++) {
+					hit = state->block_hashes.count(i * DEFAULT_BLOCK_SIZE) > 0;
 				}
-				if (ret <= 0) {
-					break;
+
+				if (hit) {
+					hash_hits_++;
+					if (v1) {
+						hash = state->ph.final();
+					}
+					for (int i = 0; i < v2.size(); i++) {
+						v2[i] = state->block_hashes[i * DEFAULT_BLOCK_SIZE];
+					}
+				} else {
+					hash_misses_++;
+					hash = hash_piece(entry, storage, piece, v2, v1, error);
 				}
-				offset += ret;
-			}
+				trace.on_io_done(hit ? "hash cached" : "hash", storage, piece, 0, piece_size);
+				hash_latency_.record(since(queued));
 
-			libtorrent::sha1_hash const hash = ph.final();
+				post(ioc_, [=, h = std::move(handler)] {
+					trace.on_callback();
+					h(piece, hash, error);
+				});
+			});
+		return;
+	}
+
+	hash_misses_++;
+	auto const queued = std::chrono::steady_clock::now();
+	job_trace trace = job_trace::begin();
+	boost::asio::post(hash_thread_pool_,
+		[=, this, entry = this->storage(storage), handler = std::move(handler)]() mutable {
+			libtorrent::storage_error error;
+			trace.on_start();
+			libtorrent::sha1_hash const hash = hash_piece(entry, storage, piece, v2, v1, error);
+			trace.on_io_done("hash", storage, piece, 0, entry->storage->piece_size(piece));
+			hash_latency_.record(since(queued));
 
 			post(ioc_, [=, h = std::move(handler)] {
+				trace.on_callback();
 				h(piece, hash, error);
 			});
 		});
@@ -361,8 +1453,40 @@ void raw_disk_io::async_hash2(
 	std::function<void(libtorrent::piece_index_t, libtorrent::sha256_hash const &, libtorrent::storage_error const &)>
 		handler)
 {
-}
+	auto const queued = std::chrono::steady_clock::now();
+	job_trace trace = job_trace::begin();
+	boost::asio::post(hash_thread_pool_,
+		[=, this, entry = this->storage(storage), handler = std::move(handler)]() mutable {
+			libtorrent::storage_error error;
+			libtorrent::sha256_hash hash;
+			trace.on_start();
+
+			partition_storage *st = entry->storage.get();
+			entry->stats.hash_jobs++;
+			int const len = std::min(DEFAULT_BLOCK_SIZE, st->piece_size2(piece) - offset);
+
+			char *buf = read_buffer_pool_.allocate_buffer();
+			if (!buf) {
+				error.ec = libtorrent::errors::no_memory;
+				error.operation = libtorrent::operation_t::alloc_cache_piece;
+			} else if (len > 0) {
+				libtorrent::disk_buffer_holder buffer(read_buffer_pool_, buf, DEFAULT_BLOCK_SIZE);
+				if (read_chunk(st, storage, piece, offset, len, buf, error) > 0) {
+					hash = libtorrent::hasher256(buf, len).final();
+				}
+			} else {
+				read_buffer_pool_.free_disk_buffer(buf);
+			}
+			trace.on_io_done("hash2", storage, piece, offset, len);
+			blocks_hashed_++;
+			hash_latency_.record(since(queued));
 
+			post(ioc_, [=, h = std::move(handler)] {
+				trace.on_callback();
+				h(piece, hash, error);
+			});
+		});
+}
 void raw_disk_io::async_move_storage(
 	libtorrent::storage_index_t storage, std::string p, libtorrent::move_flags_t flags,
 	std::function<void(libtorrent::status_t, std::string const &, libtorrent::storage_error const &)>
@@ -378,6 +1502,10 @@ void raw_disk_io::async_move_storage(
 void raw_disk_io::async_release_files(libtorrent::storage_index_t storage,
 	std::function<void()> handler)
 {
+	// torrent is finished or paused
+	flush_storage(storage);
+	request_sync(this->storage(storage));
+	post(ioc_, handler);
 }
 
 void raw_disk_io::async_check_files(
@@ -385,6 +1513,32 @@ void raw_disk_io::async_check_files(
 	libtorrent::aux::vector<std::string, libtorrent::file_index_t> links,
 	std::function<void(libtorrent::status_t, libtorrent::storage_error const &)> handler)
 {
+	// torrent doesn't fit partclone layout, fail it before any transfer.
+	libtorrent::storage_error const &error = this->storage(storage)->storage->init_error();
+	if (error) {
+		post(ioc_, [=] {
+			handler(libtorrent::status_t::fatal_disk_error, error);
+		});
+		return;
+	}
+
+	// pieces in resume data are trusted, the daemon only passes a bitmap
+	// saved after fdatasync. without it libtorrent starts from zero.
+	storage_entry &entry = *this->storage(storage);
+	if (resume_data && !resume_data->have_pieces.empty()) {
+		SPDLOG_INFO("{} resumes with {} pieces", entry.path, resume_data->have_pieces.count());
+	}
+
+	// libtorrent counts them in total_done, so they count as durable too.
+	// in seed mode the whole partition is on disk already
+	bool const seed = resume_data && (resume_data->flags & libtorrent::torrent_flags::seed_mode);
+	for (int p = 0; p < int(entry.pieces.size()); p++) {
+		libtorrent::piece_index_t const piece(p);
+		if (seed || (resume_data && p < resume_data->have_pieces.size() && resume_data->have_pieces.get_bit(piece))) {
+			mark_durable(entry, piece);
+		}
+	}
+
 	post(ioc_, [=] {
 		handler(libtorrent::status_t::no_error, libtorrent::storage_error());
 	});
@@ -393,6 +1547,9 @@ void raw_disk_io::async_check_files(
 void raw_disk_io::async_stop_torrent(libtorrent::storage_index_t storage,
 	std::function<void()> handler)
 {
+	flush_storage(storage);
+	erase_hash_states(storage);
+	request_sync(this->storage(storage));
 	post(ioc_, handler);
 }
 
@@ -432,6 +1589,30 @@ void raw_disk_io::async_clear_piece(libtorrent::storage_index_t storage,
 	libtorrent::piece_index_t index,
 	std::function<void(libtorrent::piece_index_t)> handler)
 {
+	auto it = pending_writes_.find({storage, index});
+	if (it != pending_writes_.end()) {
+		flush_piece(it);
+	}
+	// piece will be downloaded again
+	hash_states_.erase({storage, index});
+	read_cache_.erase({storage, index});
+
+	{
+		// runs flushed above are stale once they finish
+		storage_entry &entry = *this->storage(storage);
+		int const p = static_cast<int>(index);
+		std::size_t const base = std::size_t(p) * std::size_t(entry.blocks_per_piece);
+		std::lock_guard<std::mutex> l(entry.sync_mutex);
+		piece_sync_state &ps = entry.pieces[std::size_t(p)];
+		std::fill_n(entry.written_blocks.begin() + std::ptrdiff_t(base), entry.blocks_per_piece, false);
+		ps.blocks = 0;
+		ps.resets++;
+		if (ps.durable) {
+			ps.durable = false;
+			entry.stats.durable_bytes -= entry.storage->piece_size(index);
+		}
+	}
+
 	post(ioc_, [=] {
 		handler(index);
 	});
@@ -439,15 +1620,136 @@ void raw_disk_io::async_clear_piece(libtorrent::storage_index_t storage,
 
 void raw_disk_io::update_stats_counters(libtorrent::counters &c) const
 {
+	int queued = 0;
+	for (auto const &q : disk_queues_) {
+		queued += q.second->jobs.queued();
+	}
+	int const reads = reads_inflight_;
+	int const writes = writes_inflight_;
+
+	// gauges
+	c.set_value(libtorrent::counters::num_read_jobs, reads);
+	c.set_value(libtorrent::counters::num_write_jobs, writes);
+	c.set_value(libtorrent::counters::num_jobs, reads + writes);
+	c.set_value(libtorrent::counters::queued_disk_jobs, queued);
+	c.set_value(libtorrent::counters::disk_blocks_in_use, read_buffer_pool_.size() + write_buffer_pool_.size());
+	// every write buffer is waiting for coalescing or in flight
+	c.set_value(libtorrent::counters::queued_write_bytes, std::int64_t(write_buffer_pool_.size()) * DEFAULT_BLOCK_SIZE);
+
+	// totals are only changed here, so set them directly
+	c.set_value(libtorrent::counters::num_blocks_read, blocks_read_);
+	c.set_value(libtorrent::counters::num_blocks_written, blocks_written_);
+	c.set_value(libtorrent::counters::num_blocks_hashed, blocks_hashed_);
+	c.set_value(libtorrent::counters::num_blocks_cache_hits, memory_reads_ + mmap_reads_);
+	c.set_value(libtorrent::counters::num_read_ops, read_latency_.count());
+	c.set_value(libtorrent::counters::num_write_ops, write_latency_.count());
+	c.set_value(libtorrent::counters::disk_read_time, read_latency_.sum_us());
+	c.set_value(libtorrent::counters::disk_write_time, write_latency_.sum_us());
+	c.set_value(libtorrent::counters::disk_hash_time, hash_latency_.sum_us());
+	c.set_value(libtorrent::counters::disk_job_time,
+		read_latency_.sum_us() + write_latency_.sum_us() + hash_latency_.sum_us());
+}
+
+std::vector<libtorrent::open_file_state> raw_disk_io::get_status(libtorrent::storage_index_t idx) const
+{
+	storage_ptr const &entry = storage(idx);
+	if (!entry) {
+		return {};
+	}
+
+	// the partition is the only file, open as long as the storage
+	libtorrent::file_open_mode_t mode = libtorrent::file_open_mode::read_write;
+	if (entry->storage->mapping()) {
+		mode |= libtorrent::file_open_mode::mmapped;
+	}
+	return {libtorrent::open_file_state{libtorrent::file_index_t(0), mode, libtorrent::clock_type::now()}};
 }
 
-std::vector<libtorrent::open_file_state> raw_disk_io::get_status(libtorrent::storage_index_t) const
+disk_stats raw_disk_io::get_disk_stats() const
 {
-	return {};
+	disk_stats s;
+
+	for (auto const &p : {std::make_pair("read", &read_buffer_pool_), std::make_pair("write", &write_buffer_pool_)}) {
+		buffer_pool const &pool = *p.second;
+		s.pools.push_back({p.first, pool.size(), pool.limit(), int(pool.slab_size() / DEFAULT_BLOCK_SIZE),
+			pool.stalls(), pool.latency_us()});
+	}
+
+	s.read_latency = read_latency_.summary();
+	s.write_latency = write_latency_.summary();
+	s.hash_latency = hash_latency_.summary();
+
+	s.memory_reads = memory_reads_;
+	s.mmap_reads = mmap_reads_;
+	s.read_cache_hits = read_cache_.hits();
+	s.read_cache_misses = read_cache_.misses();
+	s.read_cache_evictions = read_cache_.evictions();
+	s.read_cache_size = read_cache_.size();
+	s.read_cache_capacity = read_cache_.capacity();
+	s.hash_hits = hash_hits_;
+	s.hash_misses = hash_misses_;
+	s.coalesced_bytes = coalesced_bytes_;
+	s.coalesced_syscalls = coalesced_syscalls_;
+	s.saved_syscalls = saved_syscalls_;
+	s.store_buffer_blocks = store_buffer_.size();
+	s.zero_blocks = zero_blocks_found_;
+	s.zero_bytes_saved = zero_bytes_saved_;
+
+	std::lock_guard<std::mutex> l(published_mutex_);
+	for (auto const &q : disk_queues_) {
+		qos_queue const &jobs = q.second->jobs;
+		std::int64_t const reads = jobs.jobs(io_class::read);
+		std::int64_t const writes = jobs.jobs(io_class::write);
+		s.queues.push_back({std::to_string(major(q.first)) + ":" + std::to_string(minor(q.first)), jobs.queued(),
+			reads, reads ? jobs.total_wait_us(io_class::read) / reads : 0, jobs.max_wait_us(io_class::read),
+			writes, writes ? jobs.total_wait_us(io_class::write) / writes : 0, jobs.max_wait_us(io_class::write)});
+	}
+
+	for (auto const &p : published_) {
+		storage_entry const &e = *p.second;
+		storage_stats const &st = e.stats;
+		s.storages.push_back({int(static_cast<std::uint32_t>(e.index)), e.path,
+			st.read_jobs, st.read_bytes, st.write_jobs, st.write_bytes, st.hash_jobs, st.hash_bytes,
+			st.written_bytes, st.durable_bytes, e.writes_inflight, e.elevator != nullptr});
+	}
+	return s;
 }
 
 void raw_disk_io::abort(bool wait)
 {
+	flush_timer_.cancel();
+	flush_all();
+
+	std::int64_t const syscalls = coalesced_syscalls_;
+	SPDLOG_INFO("write coalescing: {} bytes in {} writes, avg {} bytes, {} syscalls saved",
+		coalesced_bytes_.load(), syscalls, syscalls ? coalesced_bytes_ / syscalls : 0, saved_syscalls_.load());
+	SPDLOG_INFO("hash on receive: {} hits, {} misses", hash_hits_.load(), hash_misses_.load());
+	SPDLOG_INFO("write buffer pool: limit {} blocks, {} stalls, write latency {} us",
+		write_buffer_pool_.limit(), write_buffer_pool_.stalls(), write_buffer_pool_.latency_us());
+	if (mmap_seed_) {
+		SPDLOG_INFO("zero copy reads: {}", mmap_reads_.load());
+	}
+	SPDLOG_INFO("reads from memory without queue: {}", memory_reads_.load());
+	for (auto const &h : {std::make_pair("read", &read_latency_), std::make_pair("write", &write_latency_),
+			 std::make_pair("hash", &hash_latency_)}) {
+		latency_summary const l = h.second->summary();
+		SPDLOG_INFO("{} latency: {} jobs, p50 {} us, p99 {} us, max {} us", h.first, l.count, l.p50_us, l.p99_us, l.max_us);
+	}
+	for (auto const &q : disk_queues_) {
+		qos_queue const &jobs = q.second->jobs;
+		for (io_class const c : {io_class::read, io_class::write}) {
+			std::int64_t const n = jobs.jobs(c);
+			SPDLOG_INFO("disk queue {}:{} {}: {} jobs, avg wait {} us, max wait {} us",
+				major(q.first), minor(q.first), c == io_class::read ? "read" : "write",
+				n, n ? jobs.total_wait_us(c) / n : 0, jobs.max_wait_us(c));
+		}
+	}
+	if (read_cache_.enabled()) {
+		std::int64_t const lookups = read_cache_.hits() + read_cache_.misses();
+		SPDLOG_INFO("read cache: {} hits, {} misses, hit rate {}%, {} evictions",
+			read_cache_.hits(), read_cache_.misses(), lookups ? read_cache_.hits() * 100 / lookups : 0,
+			read_cache_.evictions());
+	}
 }
 
 void raw_disk_io::submit_jobs()
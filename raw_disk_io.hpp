@@ -3,21 +3,167 @@
 
 #include <map>
 #include <memory>
+#include <set>
+#include <mutex>
+#include <string>
 #include <deque>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <sys/types.h>
 #include <libtorrent/libtorrent.hpp>
 #include <boost/asio.hpp>
 #include "buffer_pool.hpp"
 #include "store_buffer.hpp"
+#include "uring_io.hpp"
+#include "qos_queue.hpp"
+#include "read_cache.hpp"
+#include "write_elevator.hpp"
+#include "disk_stats.hpp"
+#include "trace.hpp"
+
+// flush contiguous pending writes once they reach 1 MB
+#define MAX_COALESCE_SIZE (1024 * 1024)
+// flush pending writes which wait longer than this
+#define COALESCE_TIMEOUT_MS 50
+
+// read pieces back in chunks of 1 MB for hashing
+#define HASH_READ_SIZE (1024 * 1024)
+
+// max torrents at the same time, e.g. all partitions of a disk
+#define MAX_STORAGES 64
+
+// registered buffer index of buffer pools in io_uring
+#define READ_BUFFER_INDEX 0
+#define WRITE_BUFFER_INDEX 1
 
 namespace ezio
 {
+class config;
+
 std::unique_ptr<libtorrent::disk_interface>
 raw_disk_io_constructor(libtorrent::io_context &ioc,
 	libtorrent::settings_interface const &,
-	libtorrent::counters &);
+	libtorrent::counters &,
+	config const &);
 
 class partition_storage;
 
+// block waiting in write coalescing
+struct pending_write {
+	int offset;
+	int length;
+	// shared with piece_hash_state until the block is hashed
+	std::shared_ptr<libtorrent::disk_buffer_holder> buffer;
+	std::function<void(libtorrent::storage_error const &)> handler;
+	// the front block of a disk job carries the trace of the whole run
+	job_trace trace;
+	// resets of the piece when the block was flushed, blocks written
+	// before async_clear_piece don't count for durability
+	std::uint32_t resets{0};
+};
+
+struct pending_piece {
+	// keyed by offset in piece
+	std::map<int, pending_write> blocks;
+	int bytes{0};
+	std::chrono::steady_clock::time_point since;
+};
+
+// threads of one block device, reads and writes share them by QoS weights
+struct disk_queue {
+	disk_queue(int threads, std::array<int, IO_CLASSES> const &weights, std::chrono::microseconds read_deadline) :
+		pool(threads),
+		jobs(pool, weights, read_deadline)
+	{
+	}
+
+	boost::asio::thread_pool pool;
+	qos_queue jobs;
+};
+
+// I/O accounting of each storage
+struct storage_stats {
+	std::atomic<std::int64_t> read_jobs{0};
+	std::atomic<std::int64_t> read_bytes{0};
+	std::atomic<std::int64_t> write_jobs{0};
+	std::atomic<std::int64_t> write_bytes{0};
+	std::atomic<std::int64_t> hash_jobs{0};
+	std::atomic<std::int64_t> hash_bytes{0};
+	// written to the partition, might be in page cache only
+	std::atomic<std::int64_t> written_bytes{0};
+	// pieces fully written before a successful fdatasync
+	std::atomic<std::int64_t> durable_bytes{0};
+};
+
+// durability of one piece, under storage_entry::sync_mutex
+struct piece_sync_state {
+	// distinct blocks written
+	int blocks{0};
+	// runs done, a sync only covers the runs done before it started
+	std::uint32_t writes{0};
+	// async_clear_piece calls, the piece is downloaded again after each
+	std::uint32_t resets{0};
+	bool durable{false};
+};
+
+// one torrent. jobs hold a reference, so remove_torrent never frees it
+// while a disk thread is still using it.
+struct storage_entry {
+	libtorrent::storage_index_t index;
+	std::string path;
+	std::unique_ptr<partition_storage> storage;
+	disk_queue *queue{nullptr};
+	// fixed file slot in io_uring, -1 if not registered
+	int uring_slot{-1};
+	// nullptr if writes are not reordered
+	std::unique_ptr<write_elevator> elevator;
+
+	// flush policy
+	std::atomic<int> writes_inflight{0};
+	std::atomic<std::int64_t> unsynced_bytes{0};
+	// write runs are numbered when they start. a sync waits for the runs
+	// started before it was asked for, not for the storage to be idle
+	std::mutex sync_mutex;
+	std::uint64_t next_write{0};
+	std::set<std::uint64_t> running_writes;
+	// next_write of each sync request still waiting, ascending
+	std::deque<std::uint64_t> sync_barriers;
+	std::atomic<bool> sync_queued{false};
+	// a piece is durable once all its blocks are written and a sync
+	// started after the last run is done, so rewrites count once
+	int blocks_per_piece{0};
+	std::vector<bool> written_blocks;
+	std::vector<piece_sync_state> pieces;
+	// complete pieces and their writes since the last sync started
+	std::vector<std::pair<libtorrent::piece_index_t, std::uint32_t>> unsynced_pieces;
+	storage_stats stats;
+};
+
+using storage_ptr = std::shared_ptr<storage_entry>;
+
+// SHA-1 of a piece computed while its blocks arrive, so async_hash
+// doesn't need to read it back. jobs of a piece run on its strand.
+struct piece_hash_state {
+	explicit piece_hash_state(boost::asio::thread_pool &pool) :
+		strand(boost::asio::make_strand(pool))
+	{
+	}
+
+	boost::asio::strand<boost::asio::thread_pool::executor_type> strand;
+	libtorrent::hasher ph;
+	// bytes hashed in order
+	int cursor{0};
+	// out of order blocks wait for the gap, keyed by offset
+	std::map<int, std::pair<int, std::shared_ptr<libtorrent::disk_buffer_holder>>> waiting;
+	// a block is missing or written twice, fallback to read
+	bool failed{false};
+	// v2 block hashes keyed by offset, only for v2 torrents
+	bool v2{false};
+	int piece_size2{0};
+	std::map<int, libtorrent::sha256_hash> block_hashes;
+};
+
 class raw_disk_io final : public libtorrent::disk_interface
 {
 private:
@@ -26,20 +172,183 @@ private:
 
 	store_buffer store_buffer_;
 
-	boost::asio::thread_pool read_thread_pool_;
-	boost::asio::thread_pool write_thread_pool_;
+	// whole piece cache for seeding, separate from buffer pools
+	read_cache read_cache_;
+
+	// optional io_uring backend for read and write, nullptr if disabled
+	std::unique_ptr<uring_io> uring_;
+
+	// read and write threads for each disk, keyed by whole disk device.
+	// all storages share key 0 without --per-disk-queue
+	std::map<dev_t, std::unique_ptr<disk_queue>> disk_queues_;
+	bool per_disk_queue_;
+	// QoS of disk queues
+	std::array<int, IO_CLASSES> qos_weights_;
+	std::chrono::microseconds read_deadline_;
+	bool mmap_seed_;
+	// O_DIRECT for all storages
+	bool direct_io_;
+	// on, off or auto
+	std::string elevator_;
+	// when to fdatasync: none, piece or torrent
+	std::string sync_policy_;
+	// sync_file_range window in bytes, 0 to disable
+	std::int64_t writeback_size_;
+	// all zero blocks: write, zeroout or skip
+	std::string zero_blocks_;
+
+	// set before torrents are added, read only then
+	std::function<void(std::string const &, libtorrent::piece_index_t)> piece_written_;
+
+	// storages by path for other threads, e.g. gRPC. it also guards
+	// inserts to disk_queues_
+	mutable std::mutex published_mutex_;
+	std::map<std::string, storage_ptr> published_;
+	// paths of torrents being added with O_DIRECT, taken by new_torrent
+	std::set<std::string> direct_paths_;
+	int io_threads_;
+	std::vector<int> io_cpus_;
+
 	boost::asio::thread_pool hash_thread_pool_;
 
 	// callbacks are posted on this
 	libtorrent::io_context &ioc_;
 
-	std::map<libtorrent::storage_index_t, std::unique_ptr<partition_storage>> storages_;
-	std::deque<libtorrent::storage_index_t> free_slots_;
+	// fixed size table indexed by storage_index_t, only changed and looked up
+	// on the network thread. disk jobs capture the entry, so they need no lock.
+	std::vector<storage_ptr> storages_;
+
+	// write coalescing, blocks wait here (and in store_buffer_) until
+	// the piece completes, the run is large enough or the timer fires.
+	// only touched from the network thread, so there is no lock.
+	using piece_key = std::pair<libtorrent::storage_index_t, libtorrent::piece_index_t>;
+	std::map<piece_key, pending_piece> pending_writes_;
+	boost::asio::steady_timer flush_timer_;
+	bool flush_timer_armed_{false};
+
+	// hash on receive, only touched from the network thread
+	std::map<piece_key, std::shared_ptr<piece_hash_state>> hash_states_;
+	std::atomic<std::int64_t> hash_hits_{0};
+	std::atomic<std::int64_t> hash_misses_{0};
+
+	// write coalescing stats
+	std::atomic<std::int64_t> coalesced_bytes_{0};
+	std::atomic<std::int64_t> coalesced_syscalls_{0};
+	std::atomic<std::int64_t> saved_syscalls_{0};
+	// all zero blocks received, and bytes not written for them
+	std::atomic<std::int64_t> zero_blocks_found_{0};
+	std::atomic<std::int64_t> zero_bytes_saved_{0};
+
+	// reads served from mmap without copy
+	std::atomic<std::int64_t> mmap_reads_{0};
+	// reads served from store_buffer or read cache, never queued
+	std::atomic<std::int64_t> memory_reads_{0};
+
+	// disk job latency, from queued to done
+	latency_histogram read_latency_;
+	latency_histogram write_latency_;
+	latency_histogram hash_latency_;
+	// for libtorrent counters
+	std::atomic<int> reads_inflight_{0};
+	std::atomic<int> writes_inflight_{0};
+	std::atomic<std::int64_t> blocks_read_{0};
+	std::atomic<std::int64_t> blocks_written_{0};
+	std::atomic<std::int64_t> blocks_hashed_{0};
+
+	disk_queue *create_queue(std::string const &path);
+	storage_ptr const &storage(libtorrent::storage_index_t idx) const
+	{
+		return storages_[static_cast<std::uint32_t>(idx)];
+	}
+
+	// serve the read from read_cache_, read whole piece on miss
+	void cached_read(libtorrent::storage_index_t idx, libtorrent::peer_request const &r,
+		char *buf, libtorrent::disk_buffer_holder buffer,
+		std::function<void(libtorrent::disk_buffer_holder, libtorrent::storage_error const &)> handler);
+
+	// a write run starts, return its number for written
+	std::uint64_t begin_write(storage_ptr const &entry);
+	// a write run is done, for writeback and fdatasync. uring is set on
+	// the io_uring thread, which must not wait for writeback
+	void written(storage_ptr const &entry, std::uint64_t seq, libtorrent::piece_index_t piece, int offset, int length,
+		bool ok, bool uring, std::chrono::steady_clock::time_point queued);
+	// fdatasync once the writes running now are done
+	void request_sync(storage_ptr const &entry);
+	void drain_elevator(storage_ptr const &entry);
+	void queue_sync(storage_ptr const &entry);
+	// fdatasync and mark the pieces complete before it durable, run in
+	// disk thread
+	static bool sync_entry(storage_ptr const &entry);
+	// [offset, offset + length) of piece is on disk, resets is the one the
+	// blocks were flushed with. run in the thread which wrote them
+	static void mark_written(storage_entry &entry, libtorrent::piece_index_t piece, int offset, int length,
+		std::uint32_t resets);
+	static std::uint32_t piece_resets(storage_entry &entry, libtorrent::piece_index_t piece);
+	// the piece is on disk and durable already, e.g. from resume data
+	static void mark_durable(storage_entry &entry, libtorrent::piece_index_t piece);
+
+	void read_job(libtorrent::storage_index_t idx, libtorrent::piece_index_t piece, int offset, int len,
+		char *buf, libtorrent::disk_buffer_holder buffer,
+		std::function<void(libtorrent::disk_buffer_holder, libtorrent::storage_error const &)> handler);
+
+	void queue_write(libtorrent::storage_index_t storage, libtorrent::peer_request const &r,
+		std::shared_ptr<libtorrent::disk_buffer_holder> buffer, std::function<void(libtorrent::storage_error const &)> handler,
+		job_trace trace);
+	void flush_run(piece_key const &key, pending_piece &p,
+		std::map<int, pending_write>::iterator first, std::map<int, pending_write>::iterator last);
+	// write a contiguous run, or zero it out if all blocks are zeros
+	void write_run(storage_ptr const &entry, libtorrent::storage_index_t storage, libtorrent::piece_index_t piece,
+		std::vector<pending_write> run, std::chrono::steady_clock::time_point queued);
+	void zero_run(storage_ptr const &entry, libtorrent::storage_index_t storage, libtorrent::piece_index_t piece,
+		std::vector<pending_write> run, std::chrono::steady_clock::time_point queued);
+	void complete_run(storage_ptr const &entry, libtorrent::piece_index_t piece,
+		std::vector<pending_write> &run, libtorrent::storage_error const &error);
+	void flush_piece(std::map<piece_key, pending_piece>::iterator it);
+	void flush_storage(libtorrent::storage_index_t storage);
+	void flush_all();
+	void arm_flush_timer();
+
+	void feed_hash(libtorrent::storage_index_t storage, libtorrent::peer_request const &r,
+		std::shared_ptr<libtorrent::disk_buffer_holder> buffer);
+	void drop_waiting_hash();
+	void erase_hash_states(libtorrent::storage_index_t storage);
+	// read [offset, offset + length) of piece into buf, store_buffer first
+	int read_chunk(partition_storage *st, libtorrent::storage_index_t storage, libtorrent::piece_index_t piece,
+		int const offset, int const length, char *buf, libtorrent::storage_error &error);
+	// read back the piece and hash it, run in hash thread.
+	// SHA-1 is computed if v1 is set, v2 is filled with block hashes
+	libtorrent::sha1_hash hash_piece(storage_ptr const &entry, libtorrent::storage_index_t storage, libtorrent::piece_index_t piece,
+		libtorrent::span<libtorrent::sha256_hash> v2, bool v1, libtorrent::storage_error &error);
 
 public:
-	raw_disk_io(libtorrent::io_context &);
+	raw_disk_io(libtorrent::io_context &, libtorrent::settings_interface const &, config const &);
 	~raw_disk_io();
 
+	// bytes of the storage on path which are safe on disk, -1 if not found.
+	// it's thread safe.
+	std::int64_t durable_bytes(std::string const &path) const;
+
+	// fdatasync the storage on path regardless of --sync, for resume files.
+	// done(ok) is called in a disk thread, with false if it's not found
+	void sync_storage(std::string const &path, std::function<void(bool)> done);
+
+	// snapshot of pools, queues, latency and storages, it's thread safe
+	disk_stats get_disk_stats() const;
+
+	// open the next storage on path with O_DIRECT even without
+	// --direct-io, call it before adding the torrent. it's thread safe
+	void use_direct_io(std::string const &path);
+	// undo use_direct_io when the add failed before a storage was opened
+	void cancel_direct_io(std::string const &path);
+
+	// path and piece of a write run that is on disk, called in the thread
+	// which wrote it. set it before any torrent is added
+	using piece_written_handler = std::function<void(std::string const &, libtorrent::piece_index_t)>;
+	void on_piece_written(piece_written_handler h);
+	// true if blocks of the piece on path still wait to be written, so the
+	// partition has old data there. it's thread safe
+	bool piece_pending(std::string const &path, libtorrent::piece_index_t piece);
+
 	// this is called when a new torrent is added. The shared_ptr can be
 	// used to hold the internal torrent object alive as long as there are
 	// outstanding disk operations on the storage.
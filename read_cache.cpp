@@ -0,0 +1,171 @@
+#include <cstdlib>
+
+#include "read_cache.hpp"
+
+namespace ezio
+{
+read_cache::read_cache(std::int64_t capacity) :
+	capacity_(capacity)
+{
+}
+
+char const *read_cache::get(key const &k, waiter &w, bool &queued)
+{
+	queued = false;
+
+	auto it = pieces_.find(k);
+	if (it == pieces_.end()) {
+		misses_++;
+		return nullptr;
+	}
+
+	hits_++;
+	entry &e = it->second;
+	if (!e.ready) {
+		// already reading
+		e.waiters.push_back(std::move(w));
+		queued = true;
+		return nullptr;
+	}
+
+	touch(k, e);
+	return e.data.get();
+}
+
+std::shared_ptr<char> read_cache::insert(key const &k, int size, waiter &w, std::uint64_t &id)
+{
+	if (size <= 0 || size > capacity_ || pieces_.count(k)) {
+		return nullptr;
+	}
+
+	while (size_ + size > capacity_) {
+		if (!evict_one()) {
+			// all pieces are being read
+			return nullptr;
+		}
+	}
+
+	void *p = nullptr;
+	if (posix_memalign(&p, 4096, std::size_t(size))) {
+		return nullptr;
+	}
+
+	entry &e = pieces_[k];
+	e.data = std::shared_ptr<char>(static_cast<char *>(p), free);
+	e.size = size;
+	e.id = id = next_id_++;
+	e.waiters.push_back(std::move(w));
+	e.pos = probation_.insert(probation_.begin(), k);
+	size_ += size;
+
+	return e.data;
+}
+
+void read_cache::loaded(key const &k, std::uint64_t id, bool ok)
+{
+	auto it = pieces_.find(k);
+	if (it == pieces_.end() || it->second.id != id) {
+		// erased while reading, waiters are done
+		return;
+	}
+
+	entry &e = it->second;
+	std::vector<waiter> waiters;
+	waiters.swap(e.waiters);
+	// waiters might start other reads and evict it
+	std::shared_ptr<char> data = e.data;
+
+	if (ok) {
+		e.ready = true;
+	} else {
+		remove(it);
+		data.reset();
+	}
+
+	for (auto &w : waiters) {
+		w(data.get());
+	}
+}
+
+void read_cache::erase(key const &k)
+{
+	auto it = pieces_.find(k);
+	if (it == pieces_.end()) {
+		return;
+	}
+
+	std::vector<waiter> waiters;
+	waiters.swap(it->second.waiters);
+	remove(it);
+
+	for (auto &w : waiters) {
+		w(nullptr);
+	}
+}
+
+void read_cache::erase_storage(libtorrent::storage_index_t storage)
+{
+	auto it = pieces_.lower_bound({storage, libtorrent::piece_index_t(0)});
+	while (it != pieces_.end() && it->first.first == storage) {
+		key const k = it->first;
+		++it;
+		erase(k);
+		// erase might run waiters which change pieces_
+		it = pieces_.upper_bound(k);
+	}
+}
+
+void read_cache::touch(key const &k, entry &e)
+{
+	if (e.hot) {
+		protected_.splice(protected_.begin(), protected_, e.pos);
+		return;
+	}
+
+	// hit again, promote
+	probation_.erase(e.pos);
+	e.pos = protected_.insert(protected_.begin(), k);
+	e.hot = true;
+	protected_size_ += e.size;
+
+	// demote the least recently used of protected
+	std::int64_t const max_protected = capacity_ / 100 * READ_CACHE_PROTECTED_PERCENT;
+	while (protected_size_ > max_protected && protected_.size() > 1) {
+		key const last_key = protected_.back();
+		protected_.pop_back();
+		entry &last = pieces_.find(last_key)->second;
+		last.hot = false;
+		protected_size_ -= last.size;
+		last.pos = probation_.insert(probation_.begin(), last_key);
+	}
+}
+
+bool read_cache::evict_one()
+{
+	for (auto *segment : {&probation_, &protected_}) {
+		for (auto it = segment->rbegin(); it != segment->rend(); ++it) {
+			auto const p = pieces_.find(*it);
+			if (p->second.ready) {
+				evictions_++;
+				remove(p);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void read_cache::remove(std::map<key, entry>::iterator it)
+{
+	entry &e = it->second;
+	if (e.hot) {
+		protected_.erase(e.pos);
+		protected_size_ -= e.size;
+	} else {
+		probation_.erase(e.pos);
+	}
+	size_ -= e.size;
+	pieces_.erase(it);
+}
+
+}  // namespace ezio
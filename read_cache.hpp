@@ -0,0 +1,112 @@
+#ifndef __READ_CACHE_HPP__
+#define __READ_CACHE_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <boost/core/noncopyable.hpp>
+#include <libtorrent/libtorrent.hpp>
+
+// pieces hit twice move to protected segment, at most 80% of cache
+#define READ_CACHE_PROTECTED_PERCENT 80
+
+namespace ezio
+{
+// whole pieces read for seeding, so later block requests of the piece are
+// served from memory. eviction is segmented LRU: new pieces go probation,
+// pieces hit again go protected, one-time reads are evicted first.
+// only used on the network thread, so there is no lock. stats can be
+// read from any thread.
+class read_cache : boost::noncopyable
+{
+public:
+	using key = std::pair<libtorrent::storage_index_t, libtorrent::piece_index_t>;
+	// called with piece data, or nullptr if the piece can't be cached
+	using waiter = std::function<void(char const *)>;
+
+	explicit read_cache(std::int64_t capacity);
+
+	bool enabled() const
+	{
+		return capacity_ > 0;
+	}
+
+	// return piece data if cached. if the piece is being read, w is queued
+	// and queued is set. nullptr for miss.
+	char const *get(key const &k, waiter &w, bool &queued);
+
+	// start caching piece, w is queued if success. return buffer to read
+	// the piece into, nullptr if there is no room.
+	std::shared_ptr<char> insert(key const &k, int size, waiter &w, std::uint64_t &id);
+
+	// piece read into buffer from insert is done
+	void loaded(key const &k, std::uint64_t id, bool ok);
+
+	// piece is changed
+	void erase(key const &k);
+	void erase_storage(libtorrent::storage_index_t storage);
+
+	std::int64_t hits() const
+	{
+		return hits_;
+	}
+
+	std::int64_t misses() const
+	{
+		return misses_;
+	}
+
+	std::int64_t evictions() const
+	{
+		return evictions_;
+	}
+
+	std::int64_t size() const
+	{
+		return size_;
+	}
+
+	std::int64_t capacity() const
+	{
+		return capacity_;
+	}
+
+private:
+	struct entry {
+		std::shared_ptr<char> data;
+		int size;
+		std::uint64_t id;
+		bool ready{false};
+		// in protected segment
+		bool hot{false};
+		std::vector<waiter> waiters;
+		std::list<key>::iterator pos;
+	};
+
+	void touch(key const &k, entry &e);
+	bool evict_one();
+	void remove(std::map<key, entry>::iterator it);
+
+	std::map<key, entry> pieces_;
+	// most recently used at front
+	std::list<key> probation_;
+	std::list<key> protected_;
+
+	std::int64_t capacity_;
+	std::atomic<std::int64_t> size_{0};
+	std::int64_t protected_size_{0};
+	std::uint64_t next_id_{0};
+
+	std::atomic<std::int64_t> hits_{0};
+	std::atomic<std::int64_t> misses_{0};
+	std::atomic<std::int64_t> evictions_{0};
+};
+
+}  // namespace ezio
+
+#endif
@@ -0,0 +1,160 @@
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+#include "resume.hpp"
+
+namespace ezio
+{
+namespace
+{
+	// saves of the same torrent might run on two disk threads
+	std::atomic<unsigned> g_tmp_seq{0};
+
+	bool write_all(int fd, char const *buf, std::size_t len)
+	{
+		while (len > 0) {
+			ssize_t const n = ::write(fd, buf, len);
+			if (n < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return false;
+			}
+			buf += n;
+			len -= std::size_t(n);
+		}
+		return true;
+	}
+}  // namespace
+
+bool apply_resume_data(std::string const &buf, lt::add_torrent_params &atp, bool require_durable)
+{
+	lt::error_code ec;
+	lt::bdecode_node const node = lt::bdecode(lt::span<char const>(buf), ec);
+	if (ec) {
+		SPDLOG_WARN("failed to decode resume data: {}", ec.message());
+		return false;
+	}
+
+	lt::add_torrent_params const resume = lt::read_resume_data(node, ec);
+	if (ec) {
+		SPDLOG_WARN("failed to read resume data: {}", ec.message());
+		return false;
+	}
+
+	if (!(resume.info_hashes == atp.ti->info_hashes())) {
+		SPDLOG_WARN("resume data is for another torrent, ignored");
+		return false;
+	}
+
+	// without fdatasync, pieces in page cache are lost by a crash
+	if (require_durable && node.dict_find_int_value(RESUME_DURABLE_KEY, 0) != 1) {
+		SPDLOG_WARN("resume data of {} is not durable, ignored", atp.ti->name());
+		return false;
+	}
+
+	// trackers, peers and flags still come from the request
+	atp.have_pieces = resume.have_pieces;
+	atp.unfinished_pieces = resume.unfinished_pieces;
+	atp.total_uploaded = resume.total_uploaded;
+	atp.total_downloaded = resume.total_downloaded;
+	atp.active_time = resume.active_time;
+	atp.finished_time = resume.finished_time;
+	atp.seeding_time = resume.seeding_time;
+
+	SPDLOG_INFO("resume {} with {} of {} pieces", atp.ti->name(), atp.have_pieces.count(), atp.ti->num_pieces());
+	return true;
+}
+
+resume_store::resume_store(std::string dir) :
+	dir_(std::move(dir))
+{
+	if (mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+		SPDLOG_ERROR("failed to create resume dir {}: {}", dir_, strerror(errno));
+	}
+}
+
+std::string resume_store::path(std::string const &hash) const
+{
+	return dir_ + "/" + hash + ".resume";
+}
+
+bool resume_store::load(std::string const &hash, std::string &buf) const
+{
+	int const fd = open(path(hash).c_str(), O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			SPDLOG_WARN("failed to open resume file {}: {}", path(hash), strerror(errno));
+		}
+		return false;
+	}
+
+	buf.clear();
+	char chunk[16 * 1024];
+	ssize_t n = 0;
+	while ((n = read(fd, chunk, sizeof(chunk))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			SPDLOG_WARN("failed to read resume file {}: {}", path(hash), strerror(errno));
+			close(fd);
+			return false;
+		}
+		buf.append(chunk, std::size_t(n));
+	}
+	close(fd);
+	return true;
+}
+
+bool resume_store::save(std::string const &hash, lt::add_torrent_params const &params, bool durable) const
+{
+	lt::entry e = lt::write_resume_data(params);
+	if (durable) {
+		e[RESUME_DURABLE_KEY] = 1;
+	}
+	std::vector<char> buf;
+	lt::bencode(std::back_inserter(buf), e);
+
+	std::string const target = path(hash);
+	std::string const tmp = target + ".tmp" + std::to_string(g_tmp_seq++);
+	int const fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		SPDLOG_ERROR("failed to create resume file {}: {}", tmp, strerror(errno));
+		return false;
+	}
+
+	if (!write_all(fd, buf.data(), buf.size()) || fsync(fd) != 0) {
+		SPDLOG_ERROR("failed to write resume file {}: {}", tmp, strerror(errno));
+		close(fd);
+		unlink(tmp.c_str());
+		return false;
+	}
+	close(fd);
+
+	if (rename(tmp.c_str(), target.c_str()) != 0) {
+		SPDLOG_ERROR("failed to rename resume file {}: {}", target, strerror(errno));
+		unlink(tmp.c_str());
+		return false;
+	}
+
+	// make the rename itself durable
+	int const dir_fd = open(dir_.c_str(), O_RDONLY | O_DIRECTORY);
+	if (dir_fd >= 0) {
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+
+	SPDLOG_DEBUG("resume file {} saved, {} pieces", target, params.have_pieces.count());
+	return true;
+}
+
+}  // namespace ezio
@@ -0,0 +1,38 @@
+#ifndef __RESUME_HPP__
+#define __RESUME_HPP__
+
+#include <string>
+#include <libtorrent/libtorrent.hpp>
+
+// key added to libtorrent resume data, set when the partition was
+// fdatasync'ed after the bitmap is taken
+#define RESUME_DURABLE_KEY "ezio-durable"
+
+namespace ezio
+{
+// copy piece bitmap and counters of bencoded resume data into atp, atp.ti
+// must be set. return false if it's broken, for another torrent, or not
+// durable while require_durable is set
+bool apply_resume_data(std::string const &buf, lt::add_torrent_params &atp, bool require_durable);
+
+// one <info hash>.resume file for each torrent in dir
+class resume_store
+{
+public:
+	explicit resume_store(std::string dir);
+
+	// false if there is no resume file
+	bool load(std::string const &hash, std::string &buf) const;
+	// write to a temporary file, fsync and rename, so a crash leaves the
+	// old file or the new one. safe to call from any thread
+	bool save(std::string const &hash, lt::add_torrent_params const &params, bool durable) const;
+
+private:
+	std::string path(std::string const &hash) const;
+
+	std::string dir_;
+};
+
+}  // namespace ezio
+
+#endif
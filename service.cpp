@@ -1,11 +1,358 @@
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include "service.hpp"
 #include <spdlog/spdlog.h>
 #include "daemon.hpp"
+#include "trace.hpp"
 
 namespace ezio
 {
-gRPCService::gRPCService(ezio &daemon) :
-	daemon_(daemon)
+namespace
+{
+	// set fields changed from prev, or all fields if prev is nullptr.
+	// field numbers are added to changed if it's not nullptr
+	void fill_torrent(Torrent *t, torrent_status const &cur, torrent_status const *prev,
+		google::protobuf::RepeatedField<std::int32_t> *changed)
+	{
+#define SET_TORRENT_FIELD(field, number) \
+	if (!prev || prev->field != cur.field) { \
+		t->set_##field(cur.field); \
+		if (changed) { \
+			changed->Add(Torrent::number); \
+		} \
+	}
+
+		t->set_hash(cur.hash);
+		SET_TORRENT_FIELD(name, kNameFieldNumber)
+		SET_TORRENT_FIELD(progress, kProgressFieldNumber)
+		SET_TORRENT_FIELD(download_rate, kDownloadRateFieldNumber)
+		SET_TORRENT_FIELD(upload_rate, kUploadRateFieldNumber)
+		SET_TORRENT_FIELD(active_time, kActiveTimeFieldNumber)
+		SET_TORRENT_FIELD(is_finished, kIsFinishedFieldNumber)
+		SET_TORRENT_FIELD(num_peers, kNumPeersFieldNumber)
+		SET_TORRENT_FIELD(state, kStateFieldNumber)
+		SET_TORRENT_FIELD(total_done, kTotalDoneFieldNumber)
+		SET_TORRENT_FIELD(total, kTotalFieldNumber)
+		SET_TORRENT_FIELD(num_pieces, kNumPiecesFieldNumber)
+		SET_TORRENT_FIELD(finished_time, kFinishedTimeFieldNumber)
+		SET_TORRENT_FIELD(seeding_time, kSeedingTimeFieldNumber)
+		SET_TORRENT_FIELD(total_payload_download, kTotalPayloadDownloadFieldNumber)
+		SET_TORRENT_FIELD(total_payload_upload, kTotalPayloadUploadFieldNumber)
+		SET_TORRENT_FIELD(is_paused, kIsPausedFieldNumber)
+		SET_TORRENT_FIELD(save_path, kSavePathFieldNumber)
+		SET_TORRENT_FIELD(last_upload, kLastUploadFieldNumber)
+		SET_TORRENT_FIELD(last_download, kLastDownloadFieldNumber)
+		SET_TORRENT_FIELD(bytes_durable, kBytesDurableFieldNumber)
+
+#undef SET_TORRENT_FIELD
+	}
+
+	void set_latency(LatencyHistogram *h, latency_summary const &l)
+	{
+		h->set_count(l.count);
+		h->set_sum_us(l.sum_us);
+		h->set_max_us(l.max_us);
+		h->set_p50_us(l.p50_us);
+		h->set_p90_us(l.p90_us);
+		h->set_p99_us(l.p99_us);
+		h->set_p999_us(l.p999_us);
+	}
+
+	void fill_disk_stats(DiskStats *response, disk_stats const &stats)
+	{
+		for (auto const &p : stats.pools) {
+			auto *pool = response->add_pools();
+			pool->set_name(p.name);
+			pool->set_in_use(p.in_use);
+			pool->set_limit(p.limit);
+			pool->set_capacity(p.capacity);
+			pool->set_stalls(p.stalls);
+			pool->set_latency_us(p.latency_us);
+		}
+
+		for (auto const &q : stats.queues) {
+			auto *queue = response->add_queues();
+			queue->set_disk(q.disk);
+			queue->set_pending(q.pending);
+			queue->set_read_jobs(q.read_jobs);
+			queue->set_read_avg_wait_us(q.read_wait_us);
+			queue->set_read_max_wait_us(q.read_max_wait_us);
+			queue->set_write_jobs(q.write_jobs);
+			queue->set_write_avg_wait_us(q.write_wait_us);
+			queue->set_write_max_wait_us(q.write_max_wait_us);
+		}
+
+		for (auto const &st : stats.storages) {
+			auto *storage = response->add_storages();
+			storage->set_index(st.index);
+			storage->set_save_path(st.path);
+			storage->set_read_jobs(st.read_jobs);
+			storage->set_read_bytes(st.read_bytes);
+			storage->set_write_jobs(st.write_jobs);
+			storage->set_write_bytes(st.write_bytes);
+			storage->set_hash_jobs(st.hash_jobs);
+			storage->set_hash_bytes(st.hash_bytes);
+			storage->set_written_bytes(st.written_bytes);
+			storage->set_durable_bytes(st.durable_bytes);
+			storage->set_writes_inflight(st.writes_inflight);
+			storage->set_elevator(st.elevator);
+		}
+
+		set_latency(response->mutable_read_latency(), stats.read_latency);
+		set_latency(response->mutable_write_latency(), stats.write_latency);
+		set_latency(response->mutable_hash_latency(), stats.hash_latency);
+
+		response->set_memory_reads(stats.memory_reads);
+		response->set_mmap_reads(stats.mmap_reads);
+		response->set_read_cache_hits(stats.read_cache_hits);
+		response->set_read_cache_misses(stats.read_cache_misses);
+		response->set_read_cache_evictions(stats.read_cache_evictions);
+		response->set_read_cache_size(stats.read_cache_size);
+		response->set_read_cache_capacity(stats.read_cache_capacity);
+		response->set_hash_hits(stats.hash_hits);
+		response->set_hash_misses(stats.hash_misses);
+		response->set_coalesced_bytes(stats.coalesced_bytes);
+		response->set_coalesced_syscalls(stats.coalesced_syscalls);
+		response->set_saved_syscalls(stats.saved_syscalls);
+		response->set_store_buffer_blocks(stats.store_buffer_blocks);
+		response->set_zero_blocks(stats.zero_blocks);
+		response->set_zero_bytes_saved(stats.zero_bytes_saved);
+	}
+
+	void fill_settings(google::protobuf::RepeatedPtrField<Setting> *out, setting_list const &settings)
+	{
+		for (auto const &s : settings) {
+			Setting *setting = out->Add();
+			setting->set_name(s.first);
+			setting->set_value(s.second);
+		}
+	}
+
+	add_request to_add_request(AddRequest const &request)
+	{
+		add_request r;
+		r.torrent = request.torrent();
+		r.torrent_path = request.torrent_path();
+		r.info_hash = request.info_hash();
+		r.save_path = request.save_path();
+		r.seeding_mode = request.seeding_mode();
+		r.max_uploads = request.max_uploads();
+		r.max_connections = request.max_connections();
+		r.sequential_download = request.sequential_download();
+		r.resume_data = request.resume_data();
+		r.direct_io = request.direct_io();
+		return r;
+	}
+
+	// tag of completion queue events, one for each RPC waiting for a
+	// request or in progress
+	class call
+	{
+	public:
+		virtual ~call() = default;
+		virtual void proceed(bool ok) = 0;
+	};
+
+	template<typename Request, typename Response>
+	class unary_call final : public call
+	{
+	public:
+		using request_fn = void (EZIO::AsyncService::*)(ServerContext *, Request *,
+			grpc::ServerAsyncResponseWriter<Response> *, grpc::CompletionQueue *, ServerCompletionQueue *, void *);
+		// called once, now or later from any thread
+		using done_fn = std::function<void(Status const &)>;
+		// fill response and call done, must not block
+		using handler_fn = std::function<void(Request const &, Response *, done_fn)>;
+
+		static void listen(EZIO::AsyncService *service, ServerCompletionQueue *cq, request_fn request, handler_fn handler)
+		{
+			new unary_call(service, cq, request, std::move(handler));
+		}
+
+		void proceed(bool ok) override
+		{
+			if (!ok || finished_) {
+				// shutdown, or the response is sent
+				delete this;
+				return;
+			}
+
+			// wait for next call of this method
+			listen(service_, cq_, request_, handler_);
+			handler_(request_msg_, &response_, [this](Status const &status) {
+				finished_ = true;
+				responder_.Finish(response_, status, this);
+			});
+		}
+
+	private:
+		unary_call(EZIO::AsyncService *service, ServerCompletionQueue *cq, request_fn request, handler_fn handler) :
+			service_(service),
+			cq_(cq),
+			request_(request),
+			handler_(std::move(handler)),
+			responder_(&ctx_)
+		{
+			(service_->*request_)(&ctx_, &request_msg_, &responder_, cq_, cq_, this);
+		}
+
+		EZIO::AsyncService *service_;
+		ServerCompletionQueue *cq_;
+		request_fn request_;
+		handler_fn handler_;
+
+		ServerContext ctx_;
+		Request request_msg_;
+		Response response_;
+		grpc::ServerAsyncResponseWriter<Response> responder_;
+		bool finished_{false};
+	};
+
+	// WatchTorrentStatus, one write or alarm in flight at a time
+	class watch_call final : public call
+	{
+	public:
+		static void listen(EZIO::AsyncService *service, ServerCompletionQueue *cq, ezio &daemon)
+		{
+			new watch_call(service, cq, daemon);
+		}
+
+		void proceed(bool ok) override
+		{
+			switch (state_) {
+			case state::request:
+				if (!ok) {
+					delete this;
+					return;
+				}
+				listen(service_, cq_, daemon_);
+				SPDLOG_INFO("WatchTorrentStatus");
+
+				hashes_.assign(request_.hashes().begin(), request_.hashes().end());
+				interval_ = std::chrono::milliseconds(request_.interval() > 0
+						? std::max(request_.interval(), MIN_WATCH_INTERVAL_MS)
+						: DEFAULT_WATCH_INTERVAL_MS);
+				refresh();
+				return;
+			case state::write:
+				if (!ok) {
+					// client is gone
+					finish();
+					return;
+				}
+				state_ = state::wait;
+				alarm_.Set(cq_, std::chrono::system_clock::now() + interval_, this);
+				return;
+			case state::wait:
+				if (!ok || ctx_.IsCancelled() || daemon_.get_shutdown()) {
+					finish();
+					return;
+				}
+				refresh();
+				return;
+			case state::refresh:
+				// nothing is in flight while waiting for the cache
+				return;
+			case state::finish:
+				delete this;
+				return;
+			}
+		}
+
+	private:
+		enum class state {
+			request,
+			refresh,
+			write,
+			wait,
+			finish,
+		};
+
+		watch_call(EZIO::AsyncService *service, ServerCompletionQueue *cq, ezio &daemon) :
+			service_(service),
+			cq_(cq),
+			daemon_(daemon),
+			writer_(&ctx_)
+		{
+			service_->RequestWatchTorrentStatus(&ctx_, &request_, &writer_, cq_, cq_, this);
+		}
+
+		void refresh()
+		{
+			state_ = state::refresh;
+			daemon_.request_status([this]() {
+				send();
+			});
+		}
+
+		// on the daemon event loop, after the cache is refreshed
+		void send()
+		{
+			if (daemon_.get_shutdown()) {
+				finish();
+				return;
+			}
+
+			std::map<std::string, torrent_status> current = daemon_.get_cached_status(hashes_);
+			StatusUpdate update;
+			update.set_full(first_);
+			for (const auto &iter : current) {
+				auto prev = first_ ? last_.end() : last_.find(iter.first);
+				TorrentDelta delta;
+				fill_torrent(delta.mutable_torrent(), iter.second,
+					prev == last_.end() ? nullptr : &prev->second, delta.mutable_changed());
+				if (delta.changed_size() > 0) {
+					(*update.mutable_torrents())[iter.first] = std::move(delta);
+				}
+			}
+			for (const auto &iter : last_) {
+				if (!current.count(iter.first)) {
+					update.add_removed(iter.first);
+				}
+			}
+			last_ = std::move(current);
+
+			if (!first_ && update.torrents_size() == 0 && update.removed_size() == 0) {
+				state_ = state::wait;
+				alarm_.Set(cq_, std::chrono::system_clock::now() + interval_, this);
+				return;
+			}
+
+			first_ = false;
+			state_ = state::write;
+			writer_.Write(update, this);
+		}
+
+		void finish()
+		{
+			state_ = state::finish;
+			writer_.Finish(Status::OK, this);
+		}
+
+		EZIO::AsyncService *service_;
+		ServerCompletionQueue *cq_;
+		ezio &daemon_;
+
+		ServerContext ctx_;
+		WatchRequest request_;
+		grpc::ServerAsyncWriter<StatusUpdate> writer_;
+		grpc::Alarm alarm_;
+		state state_{state::request};
+
+		std::vector<std::string> hashes_;
+		std::chrono::milliseconds interval_{DEFAULT_WATCH_INTERVAL_MS};
+		bool first_{true};
+		std::map<std::string, torrent_status> last_;
+	};
+}  // namespace
+
+gRPCService::gRPCService(ezio &daemon, int threads) :
+	daemon_(daemon),
+	threads_(std::max(threads, 1))
 {
 }
 
@@ -15,13 +362,30 @@ void gRPCService::start(std::string listen_address)
 	builder.AddListeningPort(listen_address, grpc::InsecureServerCredentials());
 	// set recv unlimit
 	builder.SetMaxReceiveMessageSize(-1);
-	builder.RegisterService(this);
+	builder.RegisterService(&service_);
+	for (int i = 0; i < threads_; i++) {
+		cqs_.push_back(builder.AddCompletionQueue());
+	}
 	server_ = builder.BuildAndStart();
+
+	for (auto &cq : cqs_) {
+		listen(cq.get());
+		workers_.emplace_back(&gRPCService::serve, this, cq.get());
+	}
+	SPDLOG_INFO("gRPC service with {} completion queues", threads_);
 }
 
 void gRPCService::stop()
 {
 	server_->Shutdown(std::chrono::system_clock::now() + std::chrono::seconds(10));
+	// after server, so pending calls are returned with ok false
+	for (auto &cq : cqs_) {
+		cq->Shutdown();
+	}
+	for (auto &t : workers_) {
+		t.join();
+	}
+	workers_.clear();
 }
 
 void gRPCService::wait()
@@ -29,104 +393,201 @@ void gRPCService::wait()
 	server_->Wait();
 }
 
-Status gRPCService::Shutdown(ServerContext *context, const Empty *e1,
-	Empty *e2)
+void gRPCService::serve(ServerCompletionQueue *cq)
 {
-	SPDLOG_INFO("shutdown");
-
-	daemon_.stop();
-	return Status::OK;
+	void *tag = nullptr;
+	bool ok = false;
+	while (cq->Next(&tag, &ok)) {
+		static_cast<call *>(tag)->proceed(ok);
+	}
 }
 
-Status gRPCService::GetTorrentStatus(ServerContext *context,
-	const UpdateRequest *request,
-	UpdateStatus *response)
+void gRPCService::listen(ServerCompletionQueue *cq)
 {
-	SPDLOG_DEBUG("GetTorrentStatus request: {}", request->DebugString());
-
-	std::vector<std::string> hashes(request->hashes().begin(), request->hashes().end());
-	auto result = daemon_.get_torrent_status(hashes);
-	for (const auto &iter : result) {
-		const auto &hash = iter.first;
-		const auto &t_stat = iter.second;
-
-		response->add_hashes(hash);
-
-		Torrent t;
-		t.set_hash(hash);
-		t.set_name(t_stat.name);
-		t.set_progress(t_stat.progress);
-		t.set_download_rate(t_stat.download_rate);
-		t.set_upload_rate(t_stat.upload_rate);
-		t.set_is_finished(t_stat.is_finished);
-		t.set_active_time(t_stat.active_time);
-		t.set_num_peers(t_stat.num_peers);
-		t.set_state(t_stat.state);
-		t.set_total_done(t_stat.total_done);
-		t.set_total(t_stat.total);
-		t.set_num_pieces(t_stat.num_pieces);
-		t.set_finished_time(t_stat.finished_time);
-		t.set_seeding_time(t_stat.seeding_time);
-		t.set_total_payload_download(t_stat.total_payload_download);
-		t.set_total_payload_upload(t_stat.total_payload_upload);
-		t.set_is_paused(t_stat.is_paused);
-		t.set_save_path(t_stat.save_path);
-		t.set_last_upload(t_stat.last_upload);
-		t.set_last_download(t_stat.last_download);
-
-		response->mutable_torrents()->insert({hash, t});
-	}
+	// one pending call of each method on each queue
+	ezio &daemon = daemon_;
 
-	return Status::OK;
-}
+	unary_call<Empty, Empty>::listen(&service_, cq, &EZIO::AsyncService::RequestShutdown,
+		[&daemon](Empty const &, Empty *, std::function<void(Status const &)> done) {
+			SPDLOG_INFO("shutdown");
+			daemon.stop();
+			done(Status::OK);
+		});
 
-Status gRPCService::AddTorrent(ServerContext *context,
-	const AddRequest *request,
-	AddResponse *response)
-{
-	SPDLOG_INFO("AddTorrent");
+	unary_call<UpdateRequest, UpdateStatus>::listen(&service_, cq, &EZIO::AsyncService::RequestGetTorrentStatus,
+		[&daemon](UpdateRequest const &request, UpdateStatus *response, std::function<void(Status const &)> done) {
+			SPDLOG_DEBUG("GetTorrentStatus request: {}", request.DebugString());
 
-	try {
-		daemon_.add_torrent(request->torrent(), request->save_path(), request->seeding_mode(), request->max_uploads(), request->max_connections(), request->sequential_download());
-	} catch (const std::exception &e) {
-		return Status(grpc::StatusCode::UNAVAILABLE, e.what());
-	}
+			std::vector<std::string> hashes(request.hashes().begin(), request.hashes().end());
+			// answer after libtorrent posts fresh status
+			daemon.request_status([&daemon, hashes, response, done]() {
+				for (const auto &iter : daemon.get_cached_status(hashes)) {
+					response->add_hashes(iter.first);
+					fill_torrent(&(*response->mutable_torrents())[iter.first], iter.second, nullptr, nullptr);
+				}
+				done(Status::OK);
+			});
+		});
 
-	return Status::OK;
-}
+	watch_call::listen(&service_, cq, daemon);
 
-Status gRPCService::PauseTorrent(ServerContext *context, const PauseTorrentRequest *request, PauseTorrentResponse *response)
-{
-	SPDLOG_INFO("PauseTorrent");
+	unary_call<AddRequest, AddResponse>::listen(&service_, cq, &EZIO::AsyncService::RequestAddTorrent,
+		[&daemon](AddRequest const &request, AddResponse *response, std::function<void(Status const &)> done) {
+			SPDLOG_INFO("AddTorrent");
 
-	try {
-		daemon_.pause_torrent(request->hash());
-	} catch (const std::exception &e) {
-		return Status(grpc::StatusCode::UNAVAILABLE, e.what());
-	}
+			daemon.add_torrent(to_add_request(request), [response, done](lt::error_code const &ec) {
+				if (ec) {
+					done(Status(grpc::StatusCode::UNAVAILABLE, ec.message()));
+					return;
+				}
+				response->set_result(true);
+				done(Status::OK);
+			});
+		});
 
-	return Status::OK;
-}
+	unary_call<AddTorrentsRequest, AddTorrentsResponse>::listen(&service_, cq, &EZIO::AsyncService::RequestAddTorrents,
+		[&daemon](AddTorrentsRequest const &request, AddTorrentsResponse *response, std::function<void(Status const &)> done) {
+			SPDLOG_INFO("AddTorrents {}", request.torrents_size());
 
-Status gRPCService::ResumeTorrent(ServerContext *context, const ResumeTorrentRequest *request, ResumeTorrentResponse *response)
-{
-	SPDLOG_INFO("ResumeTorrent");
+			if (request.torrents_size() == 0) {
+				done(Status::OK);
+				return;
+			}
 
-	try {
-		daemon_.resume_torrent(request->hash());
-	} catch (const std::exception &e) {
-		return Status(grpc::StatusCode::UNAVAILABLE, e.what());
-	}
+			// done handlers run on loader threads and the event loop
+			struct batch {
+				std::mutex mutex;
+				int left;
+			};
+			auto b = std::make_shared<batch>();
+			b->left = request.torrents_size();
+			for (int i = 0; i < request.torrents_size(); i++) {
+				response->add_results();
+			}
+			for (int i = 0; i < request.torrents_size(); i++) {
+				daemon.add_torrent(to_add_request(request.torrents(i)), [b, i, response, done](lt::error_code const &ec) {
+					std::unique_lock<std::mutex> l(b->mutex);
+					AddResult *result = response->mutable_results(i);
+					result->set_result(!ec);
+					if (ec) {
+						result->set_error(ec.message());
+					}
+					if (--b->left > 0) {
+						return;
+					}
+					l.unlock();
+					done(Status::OK);
+				});
+			}
+		});
 
-	return Status::OK;
-}
+	unary_call<PauseTorrentRequest, PauseTorrentResponse>::listen(&service_, cq, &EZIO::AsyncService::RequestPauseTorrent,
+		[&daemon](PauseTorrentRequest const &request, PauseTorrentResponse *, std::function<void(Status const &)> done) {
+			SPDLOG_INFO("PauseTorrent");
+			if (!daemon.pause_torrent(request.hash())) {
+				done(Status(grpc::StatusCode::NOT_FOUND, "torrent " + request.hash() + " not found"));
+				return;
+			}
+			done(Status::OK);
+		});
 
-Status gRPCService::GetVersion(ServerContext *context, const Empty *e, VersionResponse *response)
-{
-	SPDLOG_INFO("GetVersion");
+	unary_call<ResumeTorrentRequest, ResumeTorrentResponse>::listen(&service_, cq, &EZIO::AsyncService::RequestResumeTorrent,
+		[&daemon](ResumeTorrentRequest const &request, ResumeTorrentResponse *, std::function<void(Status const &)> done) {
+			SPDLOG_INFO("ResumeTorrent");
+			if (!daemon.resume_torrent(request.hash())) {
+				done(Status(grpc::StatusCode::NOT_FOUND, "torrent " + request.hash() + " not found"));
+				return;
+			}
+			done(Status::OK);
+		});
+
+	unary_call<Empty, VersionResponse>::listen(&service_, cq, &EZIO::AsyncService::RequestGetVersion,
+		[](Empty const &, VersionResponse *response, std::function<void(Status const &)> done) {
+			SPDLOG_INFO("GetVersion");
+			response->set_version(GIT_VERSION);
+			done(Status::OK);
+		});
+
+	unary_call<Empty, DiskStats>::listen(&service_, cq, &EZIO::AsyncService::RequestGetDiskStats,
+		[&daemon](Empty const &, DiskStats *response, std::function<void(Status const &)> done) {
+			SPDLOG_DEBUG("GetDiskStats");
+
+			disk_stats stats;
+			if (!daemon.get_disk_stats(stats)) {
+				done(Status(grpc::StatusCode::UNAVAILABLE, "raw disk I/O is not used"));
+				return;
+			}
+			fill_disk_stats(response, stats);
+			done(Status::OK);
+		});
+
+	unary_call<GetSettingsRequest, GetSettingsResponse>::listen(&service_, cq, &EZIO::AsyncService::RequestGetSettings,
+		[&daemon](GetSettingsRequest const &request, GetSettingsResponse *response, std::function<void(Status const &)> done) {
+			SPDLOG_DEBUG("GetSettings");
+
+			setting_list settings;
+			std::string error;
+			std::vector<std::string> names(request.names().begin(), request.names().end());
+			if (!daemon.get_settings(names, settings, error)) {
+				done(Status(grpc::StatusCode::INVALID_ARGUMENT, error));
+				return;
+			}
+			fill_settings(response->mutable_settings(), settings);
+			for (auto const &p : profile_names()) {
+				response->add_profiles(p);
+			}
+			done(Status::OK);
+		});
+
+	unary_call<ApplySettingsRequest, ApplySettingsResponse>::listen(&service_, cq, &EZIO::AsyncService::RequestApplySettings,
+		[&daemon](ApplySettingsRequest const &request, ApplySettingsResponse *response, std::function<void(Status const &)> done) {
+			SPDLOG_INFO("ApplySettings");
+
+			setting_list settings;
+			for (auto const &s : request.settings()) {
+				settings.emplace_back(s.name(), s.value());
+			}
+			setting_list changed;
+			std::string error;
+			if (!daemon.apply_settings(request.profile(), settings, changed, error)) {
+				done(Status(grpc::StatusCode::INVALID_ARGUMENT, error));
+				return;
+			}
+			fill_settings(response->mutable_changed(), changed);
+			done(Status::OK);
+		});
+
+	unary_call<Empty, Empty>::listen(&service_, cq, &EZIO::AsyncService::RequestStartTrace,
+		[](Empty const &, Empty *, std::function<void(Status const &)> done) {
+			SPDLOG_INFO("StartTrace");
+			start_trace();
+			done(Status::OK);
+		});
+
+	unary_call<StopTraceRequest, StopTraceResponse>::listen(&service_, cq, &EZIO::AsyncService::RequestStopTrace,
+		[](StopTraceRequest const &request, StopTraceResponse *response, std::function<void(Status const &)> done) {
+			SPDLOG_INFO("StopTrace");
+
+			std::int64_t events = 0;
+			std::int64_t dropped = 0;
+			std::string trace = stop_trace(events, dropped);
+			response->set_events(events);
+			response->set_dropped(dropped);
+
+			if (request.path().empty()) {
+				response->set_trace(std::move(trace));
+				done(Status::OK);
+				return;
+			}
 
-	response->set_version(GIT_VERSION);
-	return Status::OK;
+			std::ofstream out(request.path(), std::ios::binary | std::ios::trunc);
+			if (!(out << trace) || !out.flush()) {
+				done(Status(grpc::StatusCode::UNAVAILABLE, "failed to write " + request.path()));
+				return;
+			}
+			SPDLOG_INFO("trace written to {}", request.path());
+			done(Status::OK);
+		});
 }
 
 }  // namespace ezio
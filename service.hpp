@@ -1,53 +1,78 @@
 #ifndef __SERVICE_HPP__
 #define __SERVICE_HPP__
 
+#include <cstdint>
 #include <iostream>
+#include <memory>
 #include <sstream>
+#include <thread>
 #include <vector>
 #include <libtorrent/libtorrent.hpp>
 #include <grpc++/grpc++.h>
+#include <grpc++/alarm.h>
 #include "ezio.grpc.pb.h"
 
 using grpc::Server;
 using grpc::ServerBuilder;
 using grpc::ServerContext;
+using grpc::ServerCompletionQueue;
 using grpc::Status;
 using ezio::Empty;
 using ezio::Torrent;
 using ezio::AddRequest;
 using ezio::AddResponse;
+using ezio::AddTorrentsRequest;
+using ezio::AddResult;
+using ezio::AddTorrentsResponse;
 using ezio::UpdateRequest;
 using ezio::UpdateStatus;
+using ezio::WatchRequest;
+using ezio::TorrentDelta;
+using ezio::StatusUpdate;
 using ezio::PauseTorrentRequest;
 using ezio::PauseTorrentResponse;
 using ezio::ResumeTorrentRequest;
 using ezio::ResumeTorrentResponse;
+using ezio::DiskStats;
+using ezio::LatencyHistogram;
+using ezio::Setting;
+using ezio::GetSettingsRequest;
+using ezio::GetSettingsResponse;
+using ezio::ApplySettingsRequest;
+using ezio::ApplySettingsResponse;
+using ezio::StopTraceRequest;
+using ezio::StopTraceResponse;
 using ezio::EZIO;
 
+// WatchTorrentStatus interval in ms
+#define DEFAULT_WATCH_INTERVAL_MS 1000
+#define MIN_WATCH_INTERVAL_MS 100
+
 namespace ezio
 {
 class ezio;
 
-class gRPCService final : public EZIO::Service
+// async gRPC server, each completion queue is drained by one thread.
+// handlers never block on the session, slow work is answered later from
+// the daemon event loop.
+class gRPCService final
 {
 public:
-	gRPCService(ezio &);
-	explicit gRPCService();
+	gRPCService(ezio &, int threads);
 	void start(std::string);
 	void stop();
 	void wait();
 
-
-	virtual Status Shutdown(ServerContext *context, const Empty *e1, Empty *e2) override;
-	virtual Status GetTorrentStatus(ServerContext *context, const UpdateRequest *request, UpdateStatus *response) override;
-	virtual Status AddTorrent(ServerContext *context, const AddRequest *request, AddResponse *response) override;
-	virtual Status PauseTorrent(ServerContext *context, const PauseTorrentRequest *request, PauseTorrentResponse *response) override;
-	virtual Status ResumeTorrent(ServerContext *context, const ResumeTorrentRequest *request, ResumeTorrentResponse *response) override;
-	virtual Status GetVersion(ServerContext *context, const Empty *e, VersionResponse *response) override;
-
 private:
+	void serve(ServerCompletionQueue *cq);
+	void listen(ServerCompletionQueue *cq);
+
 	ezio &daemon_;
+	int threads_;
+	EZIO::AsyncService service_;
 	std::unique_ptr<Server> server_;
+	std::vector<std::unique_ptr<ServerCompletionQueue>> cqs_;
+	std::vector<std::thread> workers_;
 };
 
 }  // namespace ezio
@@ -1,9 +1,12 @@
 #ifndef __STORE_BUFFER_HPP__
 #define __STORE_BUFFER_HPP__
 
+#include <array>
+#include <atomic>
 #include <unordered_map>
 #include <mutex>
 
+#include <boost/assert.hpp>
 #include <boost/functional/hash.hpp>
 #include <libtorrent/libtorrent.hpp>
 
@@ -47,18 +50,24 @@ struct hash<ezio::torrent_location> {
 }  // namespace std
 
 
+// number of shards in store_buffer, power of 2
+#define STORE_BUFFER_SHARDS 64
+
 namespace ezio
 {
 
+// blocks of the same piece are always in the same shard, so get2() and
+// hashing a piece only take one lock, and different pieces don't contend.
 class store_buffer
 {
 public:
 	template<typename Fun>
 	bool get(torrent_location const loc, Fun f)
 	{
-		std::unique_lock<std::mutex> l(m_mutex);
-		auto const it = m_store_buffer.find(loc);
-		if (it != m_store_buffer.end()) {
+		shard &s = shard_for(loc);
+		std::unique_lock<std::mutex> l(s.mutex);
+		auto const it = s.map.find(loc);
+		if (it != s.map.end()) {
 			f(it->second);
 			return true;
 		}
@@ -68,11 +77,14 @@ public:
 	template<typename Fun>
 	int get2(torrent_location const loc1, torrent_location const loc2, Fun f)
 	{
-		std::unique_lock<std::mutex> l(m_mutex);
-		auto const it1 = m_store_buffer.find(loc1);
-		auto const it2 = m_store_buffer.find(loc2);
-		char const *buf1 = (it1 == m_store_buffer.end()) ? nullptr : it1->second;
-		char const *buf2 = (it2 == m_store_buffer.end()) ? nullptr : it2->second;
+		BOOST_ASSERT(loc1.torrent == loc2.torrent && loc1.piece == loc2.piece);
+
+		shard &s = shard_for(loc1);
+		std::unique_lock<std::mutex> l(s.mutex);
+		auto const it1 = s.map.find(loc1);
+		auto const it2 = s.map.find(loc2);
+		char const *buf1 = (it1 == s.map.end()) ? nullptr : it1->second;
+		char const *buf2 = (it2 == s.map.end()) ? nullptr : it2->second;
 
 		if (buf1 == nullptr && buf2 == nullptr) {
 			return 0;
@@ -83,27 +95,45 @@ public:
 
 	void insert(torrent_location const loc, char const *buf)
 	{
-		std::lock_guard<std::mutex> l(m_mutex);
-		m_store_buffer.insert({loc, buf});
+		shard &s = shard_for(loc);
+		std::lock_guard<std::mutex> l(s.mutex);
+		if (s.map.insert({loc, buf}).second) {
+			m_size.fetch_add(1, std::memory_order_relaxed);
+		}
 	}
 
 	void erase(torrent_location const loc)
 	{
-		std::lock_guard<std::mutex> l(m_mutex);
-		auto it = m_store_buffer.find(loc);
-		if (it != m_store_buffer.end()) {
-			m_store_buffer.erase(it);
+		shard &s = shard_for(loc);
+		std::lock_guard<std::mutex> l(s.mutex);
+		auto it = s.map.find(loc);
+		if (it != s.map.end()) {
+			s.map.erase(it);
+			m_size.fetch_sub(1, std::memory_order_relaxed);
 		}
 	}
 
 	std::size_t size() const
 	{
-		return m_store_buffer.size();
+		return m_size.load(std::memory_order_relaxed);
 	}
 
 private:
-	std::mutex m_mutex;
-	std::unordered_map<torrent_location, char const *> m_store_buffer;
+	struct shard {
+		std::mutex mutex;
+		std::unordered_map<torrent_location, char const *> map;
+	};
+
+	shard &shard_for(torrent_location const &loc)
+	{
+		std::size_t h = 0;
+		boost::hash_combine(h, std::hash<libtorrent::storage_index_t>{}(loc.torrent));
+		boost::hash_combine(h, std::hash<libtorrent::piece_index_t>{}(loc.piece));
+		return m_shards[h & (STORE_BUFFER_SHARDS - 1)];
+	}
+
+	std::array<shard, STORE_BUFFER_SHARDS> m_shards;
+	std::atomic<std::size_t> m_size{0};
 };
 }  // namespace ezio
 
@@ -0,0 +1,185 @@
+#include <cerrno>
+#include <fstream>
+#include <iterator>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <boost/asio/connect.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <spdlog/spdlog.h>
+
+#include <libtorrent/hasher.hpp>
+
+#include "torrent_cache.hpp"
+
+namespace ezio
+{
+namespace
+{
+	// same as info_hash_t::get_best(), v2 hash is truncated
+	lt::sha1_hash best_hash(lt::bdecode_node const &info)
+	{
+		lt::span<char const> const section = info.data_section();
+		if (info.dict_find_int_value("meta version", 0) >= 2) {
+			lt::sha256_hash const h = lt::hasher256(section).final();
+			return lt::sha1_hash(h.data());
+		}
+		return lt::hasher(section).final();
+	}
+
+	bool fetch_http(std::string const &url, std::string &body, lt::error_code &ec)
+	{
+		namespace http = boost::beast::http;
+		using boost::asio::ip::tcp;
+
+		// http://host[:port]/target
+		std::string const rest = url.substr(7);
+		std::size_t const slash = rest.find('/');
+		std::string const host_port = rest.substr(0, slash);
+		std::string const target = slash == std::string::npos ? "/" : rest.substr(slash);
+		std::string host = host_port;
+		std::string port = "80";
+		std::size_t const colon = host_port.rfind(':');
+		if (colon != std::string::npos && host_port.find(']', colon) == std::string::npos) {
+			host = host_port.substr(0, colon);
+			port = host_port.substr(colon + 1);
+		}
+		if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+			host = host.substr(1, host.size() - 2);
+		}
+
+		boost::asio::io_context ioc;
+		tcp::resolver resolver(ioc);
+		tcp::socket socket(ioc);
+		auto const endpoints = resolver.resolve(host, port, ec);
+		if (ec) {
+			return false;
+		}
+		boost::asio::connect(socket, endpoints, ec);
+		if (ec) {
+			return false;
+		}
+
+		// sync reads give up after the timeout
+		timeval tv{TORRENT_FETCH_TIMEOUT, 0};
+		setsockopt(socket.native_handle(), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		http::request<http::empty_body> req{http::verb::get, target, 11};
+		req.set(http::field::host, host_port);
+		req.set(http::field::user_agent, "ezio");
+		http::write(socket, req, ec);
+		if (ec) {
+			return false;
+		}
+
+		boost::beast::flat_buffer buffer;
+		http::response_parser<http::string_body> parser;
+		parser.body_limit(MAX_TORRENT_FILE_SIZE);
+		http::read(socket, buffer, parser, ec);
+		if (ec) {
+			return false;
+		}
+		if (parser.get().result() != http::status::ok) {
+			SPDLOG_WARN("fetch {}: HTTP {}", url, parser.get().result_int());
+			ec = lt::errors::http_error;
+			return false;
+		}
+
+		body = std::move(parser.get().body());
+		lt::error_code ignored;
+		socket.shutdown(tcp::socket::shutdown_both, ignored);
+		return true;
+	}
+}  // namespace
+
+torrent_cache::torrent_cache(std::size_t capacity) :
+	capacity_(capacity)
+{
+}
+
+std::shared_ptr<lt::torrent_info> torrent_cache::find(lt::sha1_hash const &hash)
+{
+	std::lock_guard<std::mutex> l(mutex_);
+	auto it = torrents_.find(hash);
+	if (it == torrents_.end()) {
+		return nullptr;
+	}
+
+	lru_.splice(lru_.begin(), lru_, it->second.second);
+	hits_++;
+	return std::make_shared<lt::torrent_info>(*it->second.first);
+}
+
+std::shared_ptr<lt::torrent_info> torrent_cache::parse(std::string const &body, lt::error_code &ec)
+{
+	lt::bdecode_node const node = lt::bdecode(lt::span<char const>(body), ec, nullptr,
+		TORRENT_DEPTH_LIMIT, TORRENT_TOKEN_LIMIT);
+	if (ec) {
+		return nullptr;
+	}
+
+	lt::bdecode_node const info = node.dict_find_dict("info");
+	if (!info) {
+		ec = lt::errors::torrent_missing_info;
+		return nullptr;
+	}
+
+	if (auto ti = find(best_hash(info))) {
+		SPDLOG_INFO("torrent {} from cache", ti->name());
+		return ti;
+	}
+
+	misses_++;
+	auto ti = std::make_shared<lt::torrent_info>(node, std::ref(ec));
+	if (ec) {
+		return nullptr;
+	}
+	if (capacity_ > 0) {
+		// the copy is cached, ti is going to run
+		insert(ti->info_hashes().get_best(), std::make_shared<lt::torrent_info const>(*ti));
+	}
+	return ti;
+}
+
+void torrent_cache::insert(lt::sha1_hash const &hash, std::shared_ptr<lt::torrent_info const> ti)
+{
+	std::lock_guard<std::mutex> l(mutex_);
+	auto it = torrents_.find(hash);
+	if (it != torrents_.end()) {
+		it->second.first = std::move(ti);
+		lru_.splice(lru_.begin(), lru_, it->second.second);
+		return;
+	}
+
+	lru_.push_front(hash);
+	torrents_.emplace(hash, std::make_pair(std::move(ti), lru_.begin()));
+	while (torrents_.size() > capacity_) {
+		torrents_.erase(lru_.back());
+		lru_.pop_back();
+	}
+}
+
+bool load_torrent_file(std::string const &path, std::string &body, lt::error_code &ec)
+{
+	if (path.compare(0, 7, "http://") == 0) {
+		return fetch_http(path, body, ec);
+	}
+	if (path.find("://") != std::string::npos && path.compare(0, 7, "file://") != 0) {
+		ec = lt::errors::unsupported_url_protocol;
+		return false;
+	}
+
+	std::string const file = path.compare(0, 7, "file://") == 0 ? path.substr(7) : path;
+	std::ifstream in(file, std::ios::binary);
+	if (!in) {
+		ec = lt::error_code(errno, lt::system_category());
+		return false;
+	}
+	body.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	return true;
+}
+
+}  // namespace ezio
@@ -0,0 +1,65 @@
+#ifndef __TORRENT_CACHE_HPP__
+#define __TORRENT_CACHE_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <libtorrent/libtorrent.hpp>
+
+// bdecode limits of .torrent files
+#define TORRENT_DEPTH_LIMIT 100
+#define TORRENT_TOKEN_LIMIT 10000000
+// largest .torrent fetched over http
+#define MAX_TORRENT_FILE_SIZE (256 * 1024 * 1024)
+// read timeout of http fetch, in seconds
+#define TORRENT_FETCH_TIMEOUT 30
+
+namespace ezio
+{
+// parsed torrents keyed by info hash (get_best), least recently used ones
+// are dropped. torrents with many partclone extents take seconds to
+// parse, adding them again takes a copy instead. it's thread safe
+class torrent_cache
+{
+public:
+	explicit torrent_cache(std::size_t capacity);
+
+	// copy of the cached torrent, nullptr if not cached. libtorrent
+	// changes the torrent_info it runs, so the cached one is never given out
+	std::shared_ptr<lt::torrent_info> find(lt::sha1_hash const &hash);
+	// bdecode body, then copy the cached torrent of its info hash or parse
+	// and cache it. nullptr and ec on failure
+	std::shared_ptr<lt::torrent_info> parse(std::string const &body, lt::error_code &ec);
+
+	std::int64_t hits() const
+	{
+		return hits_;
+	}
+
+	std::int64_t misses() const
+	{
+		return misses_;
+	}
+
+private:
+	void insert(lt::sha1_hash const &hash, std::shared_ptr<lt::torrent_info const> ti);
+
+	std::size_t const capacity_;
+	std::mutex mutex_;
+	// most recently used first
+	std::list<lt::sha1_hash> lru_;
+	std::map<lt::sha1_hash, std::pair<std::shared_ptr<lt::torrent_info const>, std::list<lt::sha1_hash>::iterator>> torrents_;
+	std::atomic<std::int64_t> hits_{0};
+	std::atomic<std::int64_t> misses_{0};
+};
+
+// read a local file, or fetch an http:// url. it blocks
+bool load_torrent_file(std::string const &path, std::string &body, lt::error_code &ec);
+
+}  // namespace ezio
+
+#endif
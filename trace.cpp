@@ -0,0 +1,325 @@
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <spdlog/spdlog.h>
+
+#include "trace.hpp"
+
+namespace ezio
+{
+namespace detail
+{
+	std::atomic<bool> tracing{false};
+}  // namespace detail
+
+namespace
+{
+	enum record_type : std::uint8_t {
+		job_record,
+		// callback of a job record, value is its id
+		callback_record,
+		instant_record,
+		counter_record,
+	};
+
+	struct trace_record {
+		record_type type;
+		// literal, never freed
+		char const *name;
+		std::uint32_t io_tid;
+		std::uint32_t storage;
+		std::int32_t piece;
+		std::int32_t offset;
+		std::int32_t length;
+		// job timestamps
+		std::int64_t enqueue;
+		std::int64_t queued;
+		std::int64_t start;
+		std::int64_t io_done;
+		// ts of the other records
+		std::int64_t done;
+		// job id, or value of instant and counter
+		std::int64_t value;
+	};
+
+	// written by its own thread only, the lock is for stop_trace
+	struct trace_ring {
+		std::mutex mutex;
+		std::uint32_t tid;
+		std::string thread_name;
+		std::vector<trace_record> records;
+		// records written since start_trace, wraps around the vector
+		std::int64_t written{0};
+	};
+
+	std::mutex rings_mutex;
+	// rings of threads live as long as the process, threads are pools
+	std::vector<std::shared_ptr<trace_ring>> rings;
+	std::atomic<std::int64_t> trace_start{0};
+	std::atomic<std::uint64_t> next_job_id{1};
+
+	trace_ring &thread_ring()
+	{
+		thread_local std::shared_ptr<trace_ring> ring;
+		if (!ring) {
+			ring = std::make_shared<trace_ring>();
+			ring->tid = trace_tid();
+			char name[16] = {0};
+			pthread_getname_np(pthread_self(), name, sizeof(name));
+			ring->thread_name = name;
+			ring->records.resize(TRACE_RING_SIZE);
+
+			std::lock_guard<std::mutex> l(rings_mutex);
+			rings.push_back(ring);
+		}
+		return *ring;
+	}
+
+	void push_record(trace_record const &r)
+	{
+		trace_ring &ring = thread_ring();
+		std::lock_guard<std::mutex> l(ring.mutex);
+		ring.records[std::size_t(ring.written % TRACE_RING_SIZE)] = r;
+		ring.written++;
+	}
+
+	std::string json_string(std::string const &s)
+	{
+		std::string out = "\"";
+		for (char const c : s) {
+			if (c == '"' || c == '\\') {
+				out += '\\';
+			}
+			out += (static_cast<unsigned char>(c) < 0x20) ? ' ' : c;
+		}
+		return out + "\"";
+	}
+
+	// chrome trace time is in us
+	std::string us(std::int64_t ns)
+	{
+		ns = std::max<std::int64_t>(ns, 0);
+		std::ostringstream out;
+		out << ns / 1000 << "." << (ns % 1000) / 100 << (ns % 100) / 10 << ns % 10;
+		return out.str();
+	}
+
+	std::string ts(std::int64_t ns)
+	{
+		return us(ns - trace_start);
+	}
+
+	void write_event(std::ostringstream &out, bool &first)
+	{
+		out << (first ? "\n" : ",\n");
+		first = false;
+	}
+
+	// nestable async span of a job, shown as a track of its own
+	void write_span(std::ostringstream &out, bool &first, char const *name, std::uint64_t id,
+		std::uint32_t tid, std::int64_t begin, std::int64_t end, std::string const &args)
+	{
+		if (begin == 0 || end < begin) {
+			return;
+		}
+		write_event(out, first);
+		out << "{\"name\": \"" << name << "\", \"cat\": \"disk\", \"ph\": \"b\", \"id\": " << id
+			<< ", \"pid\": 1, \"tid\": " << tid << ", \"ts\": " << ts(begin) << args << "}";
+		write_event(out, first);
+		out << "{\"name\": \"" << name << "\", \"cat\": \"disk\", \"ph\": \"e\", \"id\": " << id
+			<< ", \"pid\": 1, \"tid\": " << tid << ", \"ts\": " << ts(end) << "}";
+	}
+}  // namespace
+
+std::int64_t trace_clock()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+std::uint32_t trace_tid()
+{
+	thread_local std::uint32_t const tid = std::uint32_t(syscall(SYS_gettid));
+	return tid;
+}
+
+std::uint64_t job_trace::record(char const *name, libtorrent::storage_index_t storage, libtorrent::piece_index_t piece,
+	int offset, int length) const
+{
+	// jobs queued before start_trace are left out
+	if (!tracing() || enqueue < trace_start) {
+		return 0;
+	}
+
+	std::uint64_t const job_id = next_job_id++;
+	trace_record r{};
+	r.type = job_record;
+	r.name = name;
+	r.io_tid = io_tid;
+	r.storage = static_cast<std::uint32_t>(storage);
+	r.piece = static_cast<std::int32_t>(piece);
+	r.offset = offset;
+	r.length = length;
+	r.enqueue = enqueue;
+	r.queued = queued;
+	r.start = start;
+	r.io_done = io_done;
+	r.value = std::int64_t(job_id);
+	push_record(r);
+	return job_id;
+}
+
+void job_trace::record_callback() const
+{
+	if (!tracing()) {
+		return;
+	}
+
+	trace_record r{};
+	r.type = callback_record;
+	r.done = trace_clock();
+	r.value = std::int64_t(id);
+	push_record(r);
+}
+
+void trace_instant(char const *name, std::int64_t value)
+{
+	if (!tracing()) {
+		return;
+	}
+
+	trace_record r{};
+	r.type = instant_record;
+	r.name = name;
+	r.done = trace_clock();
+	r.value = value;
+	push_record(r);
+}
+
+void trace_counter(char const *name, std::int64_t value)
+{
+	if (!tracing()) {
+		return;
+	}
+
+	trace_record r{};
+	r.type = counter_record;
+	r.name = name;
+	r.done = trace_clock();
+	r.value = value;
+	push_record(r);
+}
+
+void start_trace()
+{
+	std::lock_guard<std::mutex> l(rings_mutex);
+	for (auto const &ring : rings) {
+		std::lock_guard<std::mutex> rl(ring->mutex);
+		ring->written = 0;
+	}
+	trace_start = trace_clock();
+	detail::tracing = true;
+	SPDLOG_INFO("tracing started");
+}
+
+std::string stop_trace(std::int64_t &events, std::int64_t &dropped)
+{
+	detail::tracing = false;
+	events = 0;
+	dropped = 0;
+
+	std::ostringstream out;
+	bool first = true;
+	out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+
+	std::lock_guard<std::mutex> l(rings_mutex);
+	// callbacks are in the ring of the network thread, find them first
+	std::map<std::int64_t, std::int64_t> callbacks;
+	for (auto const &ring : rings) {
+		std::lock_guard<std::mutex> rl(ring->mutex);
+		std::int64_t const count = std::min<std::int64_t>(ring->written, TRACE_RING_SIZE);
+		for (std::int64_t i = ring->written - count; i < ring->written; i++) {
+			trace_record const &r = ring->records[std::size_t(i % TRACE_RING_SIZE)];
+			if (r.type == callback_record) {
+				callbacks[r.value] = r.done;
+			}
+		}
+	}
+
+	for (auto const &ring : rings) {
+		std::lock_guard<std::mutex> rl(ring->mutex);
+		if (ring->written == 0) {
+			continue;
+		}
+
+		write_event(out, first);
+		out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << ring->tid
+			<< ", \"args\": {\"name\": " << json_string(ring->thread_name.empty() ? "thread" : ring->thread_name) << "}}";
+
+		std::int64_t const count = std::min<std::int64_t>(ring->written, TRACE_RING_SIZE);
+		events += count;
+		dropped += ring->written - count;
+		for (std::int64_t i = ring->written - count; i < ring->written; i++) {
+			trace_record const &r = ring->records[std::size_t(i % TRACE_RING_SIZE)];
+			switch (r.type) {
+			case job_record: {
+				std::uint64_t const id = std::uint64_t(r.value);
+				auto const cb = callbacks.find(r.value);
+				// callback is lost if its record was overwritten
+				std::int64_t const done = (cb != callbacks.end()) ? cb->second : r.io_done;
+				std::ostringstream args;
+				args << ", \"args\": {\"storage\": " << r.storage << ", \"piece\": " << r.piece
+					 << ", \"offset\": " << r.offset << ", \"length\": " << r.length << "}";
+				// whole job, then its phases nested in it
+				write_span(out, first, r.name, id, ring->tid, r.enqueue, done, args.str());
+				if (r.queued > r.enqueue) {
+					write_span(out, first, "coalesce", id, ring->tid, r.enqueue, r.queued, "");
+				}
+				write_span(out, first, "queue", id, ring->tid, r.queued, r.start, "");
+				write_span(out, first, "io", id, ring->tid, r.start, r.io_done, "");
+				if (done > r.io_done) {
+					// posted to the network thread until the handler ran
+					write_span(out, first, "callback", id, ring->tid, r.io_done, done, "");
+				}
+				if (r.start && r.io_done >= r.start) {
+					// busy time of the disk or hash thread
+					write_event(out, first);
+					out << "{\"name\": \"" << r.name << "\", \"cat\": \"io\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << r.io_tid
+						<< ", \"ts\": " << ts(r.start) << ", \"dur\": " << us(r.io_done - r.start)
+						<< ", \"args\": {\"piece\": " << r.piece << ", \"length\": " << r.length << "}}";
+				}
+				break;
+			}
+			case callback_record:
+				// joined with its job
+				break;
+			case instant_record:
+				write_event(out, first);
+				out << "{\"name\": \"" << r.name << "\", \"cat\": \"pool\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 1, \"tid\": "
+					<< ring->tid << ", \"ts\": " << ts(r.done) << ", \"args\": {\"value\": " << r.value << "}}";
+				break;
+			case counter_record:
+				write_event(out, first);
+				out << "{\"name\": \"" << r.name << "\", \"cat\": \"pool\", \"ph\": \"C\", \"pid\": 1, \"tid\": "
+					<< ring->tid << ", \"ts\": " << ts(r.done) << ", \"args\": {\"value\": " << r.value << "}}";
+				break;
+			}
+		}
+		ring->written = 0;
+	}
+
+	out << "\n]}\n";
+	SPDLOG_INFO("tracing stopped, {} events, {} dropped", events, dropped);
+	return out.str();
+}
+
+}  // namespace ezio
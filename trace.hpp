@@ -0,0 +1,108 @@
+#ifndef __TRACE_HPP__
+#define __TRACE_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <libtorrent/libtorrent.hpp>
+
+// records kept for each thread, older ones are overwritten. rings are
+// allocated by the first trace, about 1 MB for each thread
+#define TRACE_RING_SIZE (16 * 1024)
+
+namespace ezio
+{
+namespace detail
+{
+	extern std::atomic<bool> tracing;
+}  // namespace detail
+
+// one relaxed load, the only cost while tracing is off
+inline bool tracing()
+{
+	return detail::tracing.load(std::memory_order_relaxed);
+}
+
+// steady clock in ns
+std::int64_t trace_clock();
+// kernel thread id, cached for each thread
+std::uint32_t trace_tid();
+
+// timestamps of one disk job, carried with it by value. all 0 if tracing
+// was off when the job came in, then every call returns at once
+struct job_trace {
+	// from libtorrent
+	std::int64_t enqueue{0};
+	// to a disk queue, later than enqueue for coalesced writes
+	std::int64_t queued{0};
+	// in a disk or hash thread
+	std::int64_t start{0};
+	std::int64_t io_done{0};
+	std::uint32_t io_tid{0};
+	// of the job record, 0 if it's not recorded
+	std::uint64_t id{0};
+
+	static job_trace begin()
+	{
+		job_trace t;
+		if (tracing()) {
+			t.enqueue = t.queued = trace_clock();
+		}
+		return t;
+	}
+
+	void on_queue()
+	{
+		if (enqueue) {
+			queued = trace_clock();
+		}
+	}
+
+	void on_start()
+	{
+		if (enqueue) {
+			start = trace_clock();
+			io_tid = trace_tid();
+		}
+	}
+
+	// on the disk or hash thread that did the work, the job is recorded in
+	// the ring of that thread then. name must be a literal
+	void on_io_done(char const *name, libtorrent::storage_index_t storage, libtorrent::piece_index_t piece,
+		int offset, int length)
+	{
+		if (enqueue) {
+			io_done = trace_clock();
+			id = record(name, storage, piece, offset, length);
+		}
+	}
+
+	// in the handler posted back to ioc_, recorded in the ring of the
+	// network thread and joined with the job by id
+	void on_callback() const
+	{
+		if (id) {
+			record_callback();
+		}
+	}
+
+private:
+	std::uint64_t record(char const *name, libtorrent::storage_index_t storage, libtorrent::piece_index_t piece,
+		int offset, int length) const;
+	void record_callback() const;
+};
+
+// e.g. a buffer pool stall, name must be a literal
+void trace_instant(char const *name, std::int64_t value);
+// value over time, e.g. blocks in use of a buffer pool
+void trace_counter(char const *name, std::int64_t value);
+
+// drop what was recorded and record from now on
+void start_trace();
+// stop recording, Chrome trace JSON for Perfetto or chrome://tracing.
+// events is how many records it has, dropped how many were overwritten
+std::string stop_trace(std::int64_t &events, std::int64_t &dropped);
+
+}  // namespace ezio
+
+#endif
@@ -0,0 +1,340 @@
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <spdlog/spdlog.h>
+
+#include "uring_io.hpp"
+
+namespace ezio
+{
+void uring_job::add(bool write, int fd, int slot, std::int64_t offset, iovec const *vec, int n, int buf_index)
+{
+	std::size_t length = 0;
+	for (int i = 0; i < n; i++) {
+		length += vec[i].iov_len;
+	}
+
+	ops.push_back({write, fd, slot, offset, length, iov.size(), n, buf_index, 0, this});
+	iov.insert(iov.end(), vec, vec + n);
+}
+
+#ifdef EZIO_HAS_IO_URING
+
+std::unique_ptr<uring_io> uring_io::create(unsigned entries)
+{
+	std::unique_ptr<uring_io> uring(new uring_io());
+
+	int ret = io_uring_queue_init(entries, &uring->ring_, 0);
+	if (ret < 0) {
+		SPDLOG_WARN("io_uring_queue_init: {}", strerror(-ret));
+		return nullptr;
+	}
+
+	uring->event_fd_ = eventfd(0, EFD_CLOEXEC);
+	if (uring->event_fd_ < 0) {
+		SPDLOG_WARN("eventfd: {}", strerror(errno));
+		io_uring_queue_exit(&uring->ring_);
+		return nullptr;
+	}
+
+	// sparse table, slots are filled by register_file
+	uring->files_.assign(URING_MAX_FILES, -1);
+	ret = io_uring_register_files(&uring->ring_, uring->files_.data(), uring->files_.size());
+	if (ret < 0) {
+		SPDLOG_WARN("io_uring_register_files: {}, fixed files disabled", strerror(-ret));
+		uring->files_.clear();
+	}
+
+	uring->thread_ = std::thread(&uring_io::run, uring.get());
+	SPDLOG_INFO("io_uring enabled, entries: {}", entries);
+	return uring;
+}
+
+uring_io::~uring_io()
+{
+	stop();
+	close(event_fd_);
+	io_uring_queue_exit(&ring_);
+}
+
+int uring_io::register_file(int fd)
+{
+	std::lock_guard<std::mutex> l(files_mutex_);
+	for (std::size_t i = 0; i < files_.size(); i++) {
+		if (files_[i] != -1) {
+			continue;
+		}
+
+		if (io_uring_register_files_update(&ring_, i, &fd, 1) < 0) {
+			return -1;
+		}
+		files_[i] = fd;
+		return int(i);
+	}
+	return -1;
+}
+
+void uring_io::unregister_file(int slot)
+{
+	if (slot < 0) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> l(files_mutex_);
+	int fd = -1;
+	io_uring_register_files_update(&ring_, slot, &fd, 1);
+	files_[slot] = -1;
+}
+
+bool uring_io::register_buffers(std::vector<iovec> const &bufs)
+{
+	int const ret = io_uring_register_buffers(&ring_, bufs.data(), bufs.size());
+	if (ret < 0) {
+		// usually RLIMIT_MEMLOCK is too small
+		SPDLOG_WARN("io_uring_register_buffers: {}, fixed buffers disabled", strerror(-ret));
+		return false;
+	}
+
+	buffers_registered_ = true;
+	return true;
+}
+
+void uring_io::submit(std::unique_ptr<uring_job> job)
+{
+	// nothing to do, e.g. only pad files
+	if (job->empty()) {
+		if (job->done) {
+			job->done(libtorrent::error_code());
+		}
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> l(mutex_);
+		queue_.push_back(std::move(job));
+	}
+
+	// wake up io_uring thread
+	std::uint64_t const v = 1;
+	if (write(event_fd_, &v, sizeof(v)) < 0) {
+		SPDLOG_ERROR("eventfd write: {}", strerror(errno));
+	}
+}
+
+void uring_io::stop()
+{
+	{
+		std::lock_guard<std::mutex> l(mutex_);
+		stop_ = true;
+	}
+
+	std::uint64_t const v = 1;
+	if (write(event_fd_, &v, sizeof(v)) < 0) {
+		SPDLOG_ERROR("eventfd write: {}", strerror(errno));
+	}
+
+	if (thread_.joinable()) {
+		thread_.join();
+	}
+}
+
+void uring_io::arm_wakeup()
+{
+	if (wakeup_armed_) {
+		return;
+	}
+
+	io_uring_sqe *sqe = io_uring_get_sqe(&ring_);
+	if (!sqe) {
+		// retry after next submit
+		return;
+	}
+
+	io_uring_prep_poll_add(sqe, event_fd_, POLLIN);
+	io_uring_sqe_set_data(sqe, nullptr);
+	wakeup_armed_ = true;
+}
+
+void uring_io::prep_op(io_uring_sqe *sqe, uring_job::op &op)
+{
+	uring_job *job = op.job;
+	int const fd = (op.slot >= 0) ? op.slot : op.fd;
+	std::int64_t const offset = op.offset + std::int64_t(op.done);
+	iovec const &vec = job->iov[op.iov_begin];
+	if (buffers_registered_ && op.buf_index >= 0 && op.iov_count == 1) {
+		if (op.write) {
+			io_uring_prep_write_fixed(sqe, fd, vec.iov_base, vec.iov_len, offset, op.buf_index);
+		} else {
+			io_uring_prep_read_fixed(sqe, fd, vec.iov_base, vec.iov_len, offset, op.buf_index);
+		}
+	} else if (op.write) {
+		io_uring_prep_writev(sqe, fd, &job->iov[op.iov_begin], op.iov_count, offset);
+	} else {
+		io_uring_prep_readv(sqe, fd, &job->iov[op.iov_begin], op.iov_count, offset);
+	}
+	if (op.slot >= 0) {
+		io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+	}
+	io_uring_sqe_set_data(sqe, &op);
+}
+
+void uring_io::prepare()
+{
+	// still counted in flight, their jobs are owned by completions
+	while (!retries_.empty()) {
+		io_uring_sqe *sqe = io_uring_get_sqe(&ring_);
+		if (!sqe) {
+			return;
+		}
+		prep_op(sqe, *retries_.front());
+		retries_.pop_front();
+	}
+
+	while (!backlog_.empty()) {
+		uring_job *job = backlog_.front().get();
+
+		while (job->next_op < job->ops.size()) {
+			io_uring_sqe *sqe = io_uring_get_sqe(&ring_);
+			if (!sqe) {
+				// SQ is full, continue after submit
+				return;
+			}
+
+			prep_op(sqe, job->ops[job->next_op]);
+
+			job->next_op++;
+			job->inflight++;
+			inflight_++;
+		}
+
+		// all SQEs are prepared, owned by completions now
+		backlog_.front().release();
+		backlog_.pop_front();
+	}
+}
+
+void uring_io::reap()
+{
+	io_uring_cqe *cqe = nullptr;
+	while (io_uring_peek_cqe(&ring_, &cqe) == 0) {
+		auto *op = static_cast<uring_job::op *>(io_uring_cqe_get_data(cqe));
+		int const res = cqe->res;
+		io_uring_cqe_seen(&ring_, cqe);
+
+		if (!op) {
+			// wakeup
+			std::uint64_t v = 0;
+			if (read(event_fd_, &v, sizeof(v)) < 0 && errno != EAGAIN) {
+				SPDLOG_ERROR("eventfd read: {}", strerror(errno));
+			}
+			wakeup_armed_ = false;
+			continue;
+		}
+
+		uring_job *job = op->job;
+		if (res > 0 && op->done + std::size_t(res) < op->length && !job->ec) {
+			// short read or write, e.g. interrupted, send the rest again
+			op->done += std::size_t(res);
+			std::size_t skip = std::size_t(res);
+			while (skip >= job->iov[op->iov_begin].iov_len) {
+				skip -= job->iov[op->iov_begin].iov_len;
+				op->iov_begin++;
+				op->iov_count--;
+			}
+			iovec &vec = job->iov[op->iov_begin];
+			vec.iov_base = static_cast<char *>(vec.iov_base) + skip;
+			vec.iov_len -= skip;
+			retries_.push_back(op);
+			continue;
+		}
+
+		inflight_--;
+		job->inflight--;
+
+		if (res < 0 && !job->ec) {
+			job->ec = libtorrent::error_code(-res, libtorrent::system_category());
+		} else if (res >= 0 && op->done + std::size_t(res) < op->length && !job->ec) {
+			// nothing more, past the end of the partition
+			job->ec = libtorrent::error_code(EIO, libtorrent::system_category());
+		}
+
+		if (job->inflight == 0 && job->next_op == job->ops.size()) {
+			if (job->done) {
+				job->done(job->ec);
+			}
+			delete job;
+		}
+	}
+}
+
+void uring_io::run()
+{
+	while (true) {
+		{
+			std::lock_guard<std::mutex> l(mutex_);
+			while (!queue_.empty()) {
+				backlog_.push_back(std::move(queue_.front()));
+				queue_.pop_front();
+			}
+
+			if (stop_ && backlog_.empty() && inflight_ == 0) {
+				break;
+			}
+		}
+
+		prepare();
+		arm_wakeup();
+
+		int const ret = io_uring_submit_and_wait(&ring_, 1);
+		if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+			SPDLOG_CRITICAL("io_uring_submit_and_wait: {}", strerror(-ret));
+			break;
+		}
+
+		reap();
+	}
+}
+
+#else
+
+std::unique_ptr<uring_io> uring_io::create(unsigned)
+{
+	SPDLOG_WARN("ezio is built without io_uring support");
+	return nullptr;
+}
+
+uring_io::~uring_io()
+{
+}
+
+int uring_io::register_file(int)
+{
+	return -1;
+}
+
+void uring_io::unregister_file(int)
+{
+}
+
+bool uring_io::register_buffers(std::vector<iovec> const &)
+{
+	return false;
+}
+
+void uring_io::submit(std::unique_ptr<uring_job> job)
+{
+	if (job->done) {
+		job->done(libtorrent::error_code(ENOSYS, libtorrent::system_category()));
+	}
+}
+
+void uring_io::stop()
+{
+}
+
+#endif
+
+}  // namespace ezio
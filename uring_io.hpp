@@ -0,0 +1,122 @@
+#ifndef __URING_IO_HPP__
+#define __URING_IO_HPP__
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/uio.h>
+#include <boost/core/noncopyable.hpp>
+#include <libtorrent/libtorrent.hpp>
+
+#ifdef EZIO_HAS_IO_URING
+#include <liburing.h>
+#endif
+
+// max number of files registered to io_uring
+#define URING_MAX_FILES 64
+
+namespace ezio
+{
+// one disk job, it might be split into several SQEs by extents.
+// completion is called on the io_uring thread when all SQEs are done.
+class uring_job
+{
+public:
+	struct op {
+		bool write;
+		int fd;
+		// fixed file slot, -1 if not registered
+		int slot;
+		std::int64_t offset;
+		std::size_t length;
+		// [iov_begin, iov_begin + iov_count) in iov
+		std::size_t iov_begin;
+		int iov_count;
+		// registered buffer contains the iov, -1 if not registered
+		int buf_index;
+		// for io_uring thread, bytes done so far, a short completion
+		// resubmits the rest
+		std::size_t done;
+		// job of the op, it's the user data of SQEs
+		uring_job *job;
+	};
+
+	void add(bool write, int fd, int slot, std::int64_t offset, iovec const *vec, int n, int buf_index = -1);
+
+	bool empty() const
+	{
+		return ops.empty();
+	}
+
+	std::vector<op> ops;
+	std::vector<iovec> iov;
+	std::function<void(libtorrent::error_code const &)> done;
+
+	// for io_uring thread
+	std::size_t next_op{0};
+	int inflight{0};
+	libtorrent::error_code ec;
+};
+
+class uring_io : boost::noncopyable
+{
+public:
+	// return nullptr if io_uring is not supported
+	static std::unique_ptr<uring_io> create(unsigned entries);
+
+	~uring_io();
+
+	// register fd as fixed file, return slot or -1
+	int register_file(int fd);
+	void unregister_file(int slot);
+
+	// register fixed buffers, must be called before any submit.
+	// index in bufs is the buf_index of uring_job::add
+	bool register_buffers(std::vector<iovec> const &bufs);
+
+	// queue job, it's submitted in batch by io_uring thread
+	void submit(std::unique_ptr<uring_job> job);
+
+	// wait all jobs done and stop the io_uring thread
+	void stop();
+
+private:
+	uring_io() = default;
+
+#ifdef EZIO_HAS_IO_URING
+	void run();
+	void arm_wakeup();
+	void prepare();
+	void prep_op(io_uring_sqe *sqe, uring_job::op &op);
+	void reap();
+
+	io_uring ring_;
+	int event_fd_{-1};
+	bool wakeup_armed_{false};
+	bool buffers_registered_{false};
+	// sum of all SQEs in flight
+	int inflight_{0};
+
+	std::mutex mutex_;
+	std::deque<std::unique_ptr<uring_job>> queue_;
+	bool stop_{false};
+
+	// only for io_uring thread
+	std::deque<std::unique_ptr<uring_job>> backlog_;
+	// rest of short completions, they go before the backlog
+	std::deque<uring_job::op *> retries_;
+
+	std::mutex files_mutex_;
+	std::vector<int> files_;
+
+	std::thread thread_;
+#endif
+};
+
+}  // namespace ezio
+
+#endif
@@ -30,5 +30,9 @@ if __name__ == '__main__':
     request.save_path = sys.argv[2]
     with open(sys.argv[1], 'rb') as f:
         request.torrent = f.read()
+    # optional resume file saved by --resume-dir
+    if len(sys.argv) > 3:
+        with open(sys.argv[3], 'rb') as f:
+            request.resume_data = f.read()
 
     stub.AddTorrent(request)
@@ -0,0 +1,44 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+import argparse
+import re
+import sys
+
+import grpc
+import ezio_pb2
+import ezio_pb2_grpc
+
+
+if __name__ == '__main__':
+
+    parser = argparse.ArgumentParser(description="add many torrents to a running ezio in one call")
+    parser.add_argument("--address", default="127.0.0.1:50051")
+    parser.add_argument("--seed", action="store_true", help="add in seeding mode")
+    parser.add_argument("--sequential", action="store_true")
+    parser.add_argument("torrents", nargs="+", metavar="torrent=save_path",
+                        help="torrent is a path or http:// url read by ezio, or info hash of a cached torrent")
+    args = parser.parse_args()
+
+    request = ezio_pb2.AddTorrentsRequest()
+    for t in args.torrents:
+        torrent, _, save_path = t.partition("=")
+        add = request.torrents.add(save_path=save_path, seeding_mode=args.seed,
+                                   sequential_download=args.sequential)
+        if re.fullmatch("[0-9a-fA-F]{40}", torrent):
+            add.info_hash = torrent.lower()
+        else:
+            add.torrent_path = torrent
+
+    channel = grpc.insecure_channel(args.address)
+    stub = ezio_pb2_grpc.EZIOStub(channel)
+    result = stub.AddTorrents(request)
+
+    failed = 0
+    for t, r in zip(args.torrents, result.results):
+        if r.result:
+            print("{}: added".format(t))
+        else:
+            print("{}: {}".format(t, r.error))
+            failed += 1
+    sys.exit(1 if failed else 0)
@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+import grpc
+import ezio_pb2
+import ezio_pb2_grpc
+
+import sys
+
+
+def print_latency(name, h):
+    avg = h.sum_us // h.count if h.count else 0
+    print("{:<6} {:>10} jobs  avg {:>8} us  p50 {:>8} us  p90 {:>8} us  p99 {:>8} us  p99.9 {:>8} us  max {:>8} us".format(
+        name, h.count, avg, h.p50_us, h.p90_us, h.p99_us, h.p999_us, h.max_us))
+
+
+if __name__ == '__main__':
+
+    address = "127.0.0.1:50051"
+    if len(sys.argv) > 1:
+        address = sys.argv[1]
+    channel = grpc.insecure_channel(address)
+    stub = ezio_pb2_grpc.EZIOStub(channel)
+
+    stats = stub.GetDiskStats(ezio_pb2.Empty())
+
+    print("latency")
+    print_latency("read", stats.read_latency)
+    print_latency("write", stats.write_latency)
+    print_latency("hash", stats.hash_latency)
+
+    print("\nbuffer pools (blocks)")
+    for p in stats.pools:
+        print("{:<6} in use {:>6} / limit {:>6} / capacity {:>6}  stalls {}  write latency {} us".format(
+            p.name, p.in_use, p.limit, p.capacity, p.stalls, p.latency_us))
+
+    print("\ndisk queues")
+    for q in stats.queues:
+        print("{:<8} pending {:>5}  read {:>10} jobs avg wait {:>8} us max {:>8} us  write {:>10} jobs avg wait {:>8} us max {:>8} us".format(
+            q.disk, q.pending, q.read_jobs, q.read_avg_wait_us, q.read_max_wait_us,
+            q.write_jobs, q.write_avg_wait_us, q.write_max_wait_us))
+
+    print("\nstorages")
+    for s in stats.storages:
+        print("{:>2} {:<20} read {:>14} B  write {:>14} B  hash {:>14} B  durable {:>14} B  inflight {}{}".format(
+            s.index, s.save_path, s.read_bytes, s.write_bytes, s.hash_bytes, s.durable_bytes,
+            s.writes_inflight, "  elevator" if s.elevator else ""))
+
+    print("\nmemory reads {}  mmap reads {}".format(stats.memory_reads, stats.mmap_reads))
+    print("read cache {} hits  {} misses  {} evictions  {} / {} bytes".format(
+        stats.read_cache_hits, stats.read_cache_misses, stats.read_cache_evictions,
+        stats.read_cache_size, stats.read_cache_capacity))
+    print("hash on receive {} hits  {} misses".format(stats.hash_hits, stats.hash_misses))
+    print("coalesced {} bytes in {} syscalls, {} syscalls saved".format(
+        stats.coalesced_bytes, stats.coalesced_syscalls, stats.saved_syscalls))
+    print("store buffer {} blocks".format(stats.store_buffer_blocks))
+    print("zero blocks {}, {} bytes not written".format(stats.zero_blocks, stats.zero_bytes_saved))
@@ -0,0 +1,38 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+import argparse
+
+import grpc
+import ezio_pb2
+import ezio_pb2_grpc
+
+
+if __name__ == '__main__':
+
+    parser = argparse.ArgumentParser(description="get or apply session settings of a running ezio")
+    parser.add_argument("--address", default="127.0.0.1:50051")
+    sub = parser.add_subparsers(dest="command", required=True)
+    get = sub.add_parser("get", help="print settings, all if no name")
+    get.add_argument("names", nargs="*")
+    apply = sub.add_parser("apply", help="apply a profile and name=value settings")
+    apply.add_argument("--profile", default="")
+    apply.add_argument("settings", nargs="*", metavar="name=value")
+    args = parser.parse_args()
+
+    channel = grpc.insecure_channel(args.address)
+    stub = ezio_pb2_grpc.EZIOStub(channel)
+
+    if args.command == "get":
+        result = stub.GetSettings(ezio_pb2.GetSettingsRequest(names=args.names))
+        for s in result.settings:
+            print("{} = {}".format(s.name, s.value))
+        print("profiles: {}".format(", ".join(result.profiles)))
+    else:
+        request = ezio_pb2.ApplySettingsRequest(profile=args.profile)
+        for s in args.settings:
+            name, _, value = s.partition("=")
+            request.settings.add(name=name, value=value)
+        result = stub.ApplySettings(request)
+        for s in result.changed:
+            print("{} = {}".format(s.name, s.value))
@@ -0,0 +1,306 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""Swarm benchmark on one host: one seed and N receivers, each ezio in its
+own network namespace on a bridge, shaped by tc netem. Needs root, iproute2
+and tc. Generated protobuf modules must be in this directory, see
+ezio_create_proto_py.sh"""
+
+import argparse
+import json
+import os
+import shutil
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+
+import grpc
+import ezio_pb2
+import ezio_pb2_grpc
+
+BRIDGE = "ezio-br0"
+NETNS_PREFIX = "ezio-n"
+SUBNET = "10.77"
+TRACKER_PORT = 6969
+RPC_PORT = 50051
+
+
+def run(*cmd, check=True):
+    return subprocess.run(cmd, check=check, stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True)
+
+
+def node_ip(i):
+    # node 0 is the seed, the bridge is .0.1
+    return "{}.{}.{}".format(SUBNET, (i + 2) // 256, (i + 2) % 256)
+
+
+class Tracker(BaseHTTPRequestHandler):
+    """Minimal HTTP tracker with compact peer lists, peers never expire"""
+
+    peers = {}
+    lock = threading.Lock()
+
+    def do_GET(self):
+        query = parse_qs(urlparse(self.path).query, keep_blank_values=True, encoding="latin-1")
+        info_hash = query.get("info_hash", [""])[0]
+        port = int(query.get("port", ["0"])[0])
+        event = query.get("event", [""])[0]
+        ip = self.client_address[0]
+
+        with Tracker.lock:
+            swarm = Tracker.peers.setdefault(info_hash, {})
+            if event == "stopped":
+                swarm.pop(ip, None)
+            else:
+                swarm[ip] = port
+            compact = b"".join(socket.inet_aton(p) + struct.pack(">H", po)
+                               for p, po in swarm.items() if p != ip)
+
+        body = b"d8:intervali30e5:peers" + str(len(compact)).encode() + b":" + compact + b"e"
+        self.send_response(200)
+        self.send_header("Content-Type", "text/plain")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, *args):
+        pass
+
+
+class Swarm:
+    def __init__(self, args):
+        self.args = args
+        self.work = os.path.abspath(args.work_dir)
+        self.nodes = args.receivers + 1
+        self.procs = []
+        self.loops = []
+        self.tracker = None
+
+    def setup_network(self):
+        run("ip", "link", "add", BRIDGE, "type", "bridge")
+        run("ip", "addr", "add", "{}.0.1/16".format(SUBNET), "dev", BRIDGE)
+        run("ip", "link", "set", BRIDGE, "up")
+        for i in range(self.nodes):
+            ns = NETNS_PREFIX + str(i)
+            host, peer = "ezv{}h".format(i), "ezv{}n".format(i)
+            run("ip", "netns", "add", ns)
+            run("ip", "link", "add", host, "type", "veth", "peer", "name", peer)
+            run("ip", "link", "set", peer, "netns", ns)
+            run("ip", "link", "set", host, "master", BRIDGE)
+            run("ip", "link", "set", host, "up")
+            run("ip", "netns", "exec", ns, "ip", "addr", "add", node_ip(i) + "/16", "dev", peer)
+            run("ip", "netns", "exec", ns, "ip", "link", "set", peer, "up")
+            run("ip", "netns", "exec", ns, "ip", "link", "set", "lo", "up")
+            # each direction gets the delay, so RTT is twice of it
+            seed_rate = self.args.seed_rate if i == 0 and self.args.seed_rate else self.args.rate
+            netem = ["netem", "delay", self.args.delay, "rate", seed_rate]
+            if self.args.loss:
+                netem += ["loss", self.args.loss]
+            run("tc", "qdisc", "add", "dev", host, "root", *netem)
+            run("ip", "netns", "exec", ns, "tc", "qdisc", "add", "dev", peer, "root", *netem)
+
+    def teardown(self):
+        for p in self.procs:
+            if p.poll() is None:
+                p.send_signal(signal.SIGTERM)
+        for p in self.procs:
+            try:
+                p.wait(timeout=15)
+            except subprocess.TimeoutExpired:
+                p.kill()
+        if self.tracker:
+            self.tracker.shutdown()
+        for i in range(self.nodes):
+            run("ip", "link", "del", "ezv{}h".format(i), check=False)
+            run("ip", "netns", "del", NETNS_PREFIX + str(i), check=False)
+        run("ip", "link", "del", BRIDGE, check=False)
+        for loop in self.loops:
+            run("losetup", "-d", loop, check=False)
+
+    def start_tracker(self):
+        self.tracker = ThreadingHTTPServer(("{}.0.1".format(SUBNET), TRACKER_PORT), Tracker)
+        threading.Thread(target=self.tracker.serve_forever, daemon=True).start()
+
+    def create_image(self):
+        """Random image on the seed and a torrent of it with one extent"""
+        image = os.path.join(self.work, "seed.img")
+        size = self.args.size * 1024 * 1024
+        with open(image, "wb") as f:
+            chunk = 4 * 1024 * 1024
+            for off in range(0, size, chunk):
+                f.write(os.urandom(min(chunk, size - off)))
+
+        info = os.path.join(self.work, "torrent.info")
+        with open(info, "w") as f:
+            f.write("offset: 0\nlength: {:x}\n".format(size))
+
+        torrent = os.path.join(self.work, "bench.torrent")
+        tracker = "http://{}.0.1:{}/announce".format(SUBNET, TRACKER_PORT)
+        run(self.args.create_torrent, "-p", "bench", "-c", "ezio_swarm_bench", "-i", info,
+            "-o", torrent, "-t", tracker, "-d", image)
+        return image, torrent
+
+    def target(self, i):
+        path = os.path.join(self.work, "r{}.img".format(i))
+        with open(path, "wb") as f:
+            f.truncate(self.args.size * 1024 * 1024)
+        if not self.args.loop:
+            return path
+        loop = run("losetup", "--find", "--show", path).stdout.strip()
+        self.loops.append(loop)
+        return loop
+
+    def start_ezio(self, i):
+        ns = NETNS_PREFIX + str(i)
+        log = open(os.path.join(self.work, "n{}.log".format(i)), "w")
+        cmd = ["ip", "netns", "exec", ns, self.args.ezio, "--listen", "{}:{}".format(node_ip(i), RPC_PORT)]
+        cmd += self.args.ezio_args.split()
+        self.procs.append(subprocess.Popen(cmd, stdout=log, stderr=subprocess.STDOUT))
+
+    def stub(self, i):
+        channel = grpc.insecure_channel("{}:{}".format(node_ip(i), RPC_PORT))
+        grpc.channel_ready_future(channel).result(timeout=30)
+        return ezio_pb2_grpc.EZIOStub(channel)
+
+    def add(self, stub, torrent, path, seed):
+        request = ezio_pb2.AddRequest()
+        request.max_uploads = self.args.max_uploads
+        request.max_connections = self.args.max_connections
+        request.sequential_download = False
+        request.seeding_mode = seed
+        request.save_path = path
+        request.torrent = torrent
+        stub.AddTorrent(request)
+
+    def run(self):
+        os.makedirs(self.work, exist_ok=True)
+        image, torrent_path = self.create_image()
+        with open(torrent_path, "rb") as f:
+            torrent = f.read()
+
+        self.setup_network()
+        self.start_tracker()
+        targets = [image] + [self.target(i) for i in range(1, self.nodes)]
+        for i in range(self.nodes):
+            self.start_ezio(i)
+        stubs = [self.stub(i) for i in range(self.nodes)]
+
+        self.add(stubs[0], torrent, image, True)
+        # receivers join after the seed is ready
+        while True:
+            t = self.status(stubs[0])
+            if t is not None and t.is_finished:
+                break
+            time.sleep(0.2)
+
+        start = time.time()
+        for i in range(1, self.nodes):
+            self.add(stubs[i], torrent, targets[i], False)
+
+        done = {}
+        curves = []
+        last = {}
+        while len(done) < self.args.receivers and time.time() - start < self.args.timeout:
+            time.sleep(self.args.interval)
+            now = time.time() - start
+            row = [round(now, 3)]
+            for i in range(self.nodes):
+                t = self.status(stubs[i])
+                if t is None:
+                    row.append(0)
+                    continue
+                last[i] = t
+                row.append(t.num_pieces)
+                if i > 0 and i not in done and t.is_finished:
+                    done[i] = now
+            curves.append(row)
+
+        return self.report(done, curves, last)
+
+    @staticmethod
+    def status(stub):
+        result = stub.GetTorrentStatus(ezio_pb2.UpdateRequest())
+        for h in result.hashes:
+            return result.torrents[h]
+        return None
+
+    def report(self, done, curves, last):
+        times = sorted(done.values())
+
+        def percentile(p):
+            return times[min(len(times) - 1, int(len(times) * p))] if times else None
+
+        downloaded = sum(last[i].total_payload_download for i in range(1, self.nodes) if i in last)
+        uploaded = last[0].total_payload_upload if 0 in last else 0
+        num_pieces = last[0].num_pieces if 0 in last else 0
+
+        # pieces held by the whole swarm over time, summed over receivers
+        swarm_curve = [[row[0], sum(row[2:]) / float(max(1, num_pieces * self.args.receivers))] for row in curves]
+
+        with open(os.path.join(self.work, "pieces.csv"), "w") as f:
+            f.write("time," + ",".join("n{}".format(i) for i in range(self.nodes)) + "\n")
+            for row in curves:
+                f.write(",".join(str(v) for v in row) + "\n")
+
+        return {
+            "receivers": self.args.receivers,
+            "size_mb": self.args.size,
+            "rate": self.args.rate,
+            "delay": self.args.delay,
+            "completed": len(times),
+            "time_to_complete": {"n{}".format(i): round(t, 3) for i, t in sorted(done.items())},
+            "p50_seconds": percentile(0.5),
+            "p90_seconds": percentile(0.9),
+            "max_seconds": times[-1] if times else None,
+            # share of receiver downloads that came from the seed
+            "seed_upload_share": round(uploaded / float(downloaded), 4) if downloaded else None,
+            "swarm_pieces": swarm_curve,
+        }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("-n", "--receivers", type=int, default=8, help="number of receivers")
+    parser.add_argument("--size", type=int, default=1024, help="image size in MB")
+    parser.add_argument("--rate", default="1gbit", help="tc rate of each node, e.g. 100mbit")
+    parser.add_argument("--seed-rate", default="", help="tc rate of the seed, default is --rate")
+    parser.add_argument("--delay", default="1ms", help="tc delay of each direction")
+    parser.add_argument("--loss", default="", help="tc loss, e.g. 0.1%%")
+    parser.add_argument("--loop", action="store_true", help="receivers write to loop devices instead of sparse files")
+    parser.add_argument("--ezio", default=shutil.which("ezio") or "./ezio", help="ezio binary")
+    parser.add_argument("--create-torrent", default=shutil.which("ezio-create-torrent") or "./ezio-create-torrent",
+                        help="ezio-create-torrent binary")
+    parser.add_argument("--ezio-args", default="", help="extra ezio options for all nodes")
+    parser.add_argument("--max-uploads", type=int, default=4)
+    parser.add_argument("--max-connections", type=int, default=8)
+    parser.add_argument("--interval", type=float, default=1.0, help="status poll interval in seconds")
+    parser.add_argument("--timeout", type=int, default=3600, help="give up after N seconds")
+    parser.add_argument("--work-dir", default="swarm_bench", help="images, torrent, logs and pieces.csv")
+    parser.add_argument("-o", "--output", default="-", help="JSON report, default is stdout")
+    args = parser.parse_args()
+
+    if os.geteuid() != 0:
+        print("network namespaces need root")
+        sys.exit(1)
+
+    swarm = Swarm(args)
+    try:
+        result = swarm.run()
+    finally:
+        swarm.teardown()
+
+    report = json.dumps(result, indent=2)
+    if args.output == "-":
+        print(report)
+    else:
+        with open(args.output, "w") as f:
+            f.write(report + "\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,34 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+import argparse
+import time
+
+import grpc
+import ezio_pb2
+import ezio_pb2_grpc
+
+
+if __name__ == '__main__':
+
+    parser = argparse.ArgumentParser(description="trace disk jobs of a running ezio, open the output in ui.perfetto.dev")
+    parser.add_argument("--address", default="127.0.0.1:50051")
+    parser.add_argument("--seconds", type=float, default=10, help="how long to trace")
+    parser.add_argument("--remote-path", default="", help="let ezio write the trace on its host instead")
+    parser.add_argument("output", nargs="?", default="ezio-trace.json")
+    args = parser.parse_args()
+
+    channel = grpc.insecure_channel(args.address)
+    stub = ezio_pb2_grpc.EZIOStub(channel)
+
+    stub.StartTrace(ezio_pb2.Empty())
+    try:
+        time.sleep(args.seconds)
+    except KeyboardInterrupt:
+        pass
+    result = stub.StopTrace(ezio_pb2.StopTraceRequest(path=args.remote_path))
+
+    if not args.remote_path:
+        with open(args.output, "wb") as f:
+            f.write(result.trace)
+    print("{} events, {} dropped, written to {}".format(result.events, result.dropped, args.remote_path or args.output))
@@ -7,6 +7,7 @@ import sys
 import math
 import time
 import datetime
+import threading
 from functools import reduce
 
 import grpc
@@ -65,11 +66,49 @@ class UIModel:
 
         self.update_data()
 
+        # server pushes changes, no need to poll
+        self.watcher = threading.Thread(target=self.watch, daemon=True)
+        self.watcher.start()
+
     def update_data(self):
+        if self.data is not None:
+            return
         request = ezio_pb2.UpdateRequest()
         result = self.stub.GetTorrentStatus(request)
         self.data = result
 
+    def watch(self):
+        request = ezio_pb2.WatchRequest()
+        request.interval = int(UPDATE_INTERVAL * 1000)
+        try:
+            for update in self.stub.WatchTorrentStatus(request):
+                data = ezio_pb2.UpdateStatus()
+                if not update.full:
+                    data.CopyFrom(self.data)
+                self.apply(data, update)
+                self.data = data
+        except grpc.RpcError:
+            # server is gone
+            pass
+
+    @staticmethod
+    def apply(data, update):
+        for info_hash in update.removed:
+            if info_hash in data.torrents:
+                del data.torrents[info_hash]
+
+        for info_hash, delta in update.torrents.items():
+            if update.full or info_hash not in data.torrents:
+                data.torrents[info_hash].CopyFrom(delta.torrent)
+                continue
+            t = data.torrents[info_hash]
+            for number in delta.changed:
+                name = ezio_pb2.Torrent.DESCRIPTOR.fields_by_number[number].name
+                setattr(t, name, getattr(delta.torrent, name))
+
+        del data.hashes[:]
+        data.hashes.extend(sorted(data.torrents.keys()))
+
     def get_data(self):
         return self.data
 
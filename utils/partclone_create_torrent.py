@@ -10,9 +10,15 @@ cat torrent.info | ./partclone_create_torrent.py -p sda1 -c CloneZilla -f ./btzo
 
 When torrent is created, you should use `transmission-edit`
 to edit the info such as `tracker` or `private`
+
+v2 or hybrid torrent needs SHA-256 of all blocks, partclone only gives SHA-1
+and each file is aligned to piece in v2, so the hashes are read from the device
+
+cat torrent.info | ./partclone_create_torrent.py -p sda1 -c CloneZilla -o sda1.torrent --hybrid -d /dev/sda1
 '''
 
 import libtorrent as lt
+import hashlib
 import sys
 import os
 import re
@@ -29,8 +35,13 @@ parser.add_argument("-o", "--output-file", help="Output torrent path and filenam
 parser.add_argument("-c", "--creator", help="Creator of this torrent", dest="creator", required=True)
 parser.add_argument("-i", "--input-file", help="Input torrent.info from file. if none, read from stdin", dest="infile", required=False)
 parser.add_argument("-t", "--tracker", help="Tracker for this torrent", dest="tracker", required=False)
+parser.add_argument("--hybrid", help="Create v1 + v2 hybrid torrent, need --device", dest="hybrid", action="store_true")
+parser.add_argument("--v2", help="Create v2 only torrent, need --device", dest="v2", action="store_true")
+parser.add_argument("-d", "--device", help="Partition or image to read hashes for v2 and hybrid torrent", dest="device", required=False)
 
 args = parser.parse_args()
+if (args.hybrid or args.v2) and not args.device:
+    parser.error("--hybrid and --v2 need --device")
 partition_name = args.partition_name
 creator_name = args.creator
 filename = args.filename
@@ -51,20 +62,90 @@ piece_hash = re.findall(r'^sha1: (.*)$', data, re.M)
 offset = re.findall(r'^offset: (.*)$', data, re.M)
 length = re.findall(r'^length: (.*)$', data, re.M)
 
+PIECE_LENGTH = 16 * 1024 * 1024 # 16MiB
+BLOCK_SIZE = 16 * 1024
+
+def merkle_root(leaves, num_leaves):
+    # pad with zero hash to num_leaves, it's power of 2
+    layer = leaves + [bytes(32)] * (num_leaves - len(leaves))
+    while len(layer) > 1:
+        layer = [hashlib.sha256(layer[i] + layer[i + 1]).digest() for i in range(0, len(layer), 2)]
+    return layer[0]
+
+def set_hashes_from_device(torrent, device, v1):
+    files = torrent.files()
+    blocks_per_piece = PIECE_LENGTH // BLOCK_SIZE
+    piece = 0
+    ph = hashlib.sha1()
+    filled = 0
+
+    with open(device, 'rb') as dev:
+        for i in range(files.num_files()):
+            size = files.file_size(i)
+            pad = files.file_flags(i) & lt.file_storage.flag_pad_file
+
+            if pad:
+                # pad file only fills the tail of v1 piece
+                ph.update(bytes(size))
+                filled += size
+            else:
+                base = int(os.path.basename(files.file_path(i)), 16)
+                num_pieces = (size + PIECE_LENGTH - 1) // PIECE_LENGTH
+                for p in range(num_pieces):
+                    dev.seek(base + p * PIECE_LENGTH)
+                    data = dev.read(min(PIECE_LENGTH, size - p * PIECE_LENGTH))
+                    leaves = [hashlib.sha256(data[b:b + BLOCK_SIZE]).digest() for b in range(0, len(data), BLOCK_SIZE)]
+
+                    # file in one piece is padded to power of 2, others to piece
+                    num_leaves = blocks_per_piece
+                    if num_pieces == 1:
+                        num_leaves = 1
+                        while num_leaves < len(leaves):
+                            num_leaves *= 2
+                    torrent.set_hash2(i, p, merkle_root(leaves, num_leaves))
+
+                    if not v1:
+                        continue
+                    if filled == PIECE_LENGTH:
+                        torrent.set_hash(piece, ph.digest())
+                        piece += 1
+                        ph = hashlib.sha1()
+                        filled = 0
+                    ph.update(data)
+                    filled += len(data)
+
+            if v1 and filled == PIECE_LENGTH:
+                torrent.set_hash(piece, ph.digest())
+                piece += 1
+                ph = hashlib.sha1()
+                filled = 0
+
+    if v1 and filled:
+        torrent.set_hash(piece, ph.digest())
+
 fs = lt.file_storage()
-fs.set_piece_length(16 * 1024 * 1024) # 16MiB
+fs.set_piece_length(PIECE_LENGTH)
 
 for o, l in zip(offset, length):
     fs.add_file(partition_name + "/" + o, int(l, 16))
 
-torrent = lt.create_torrent(fs, 16 * 1024 * 1024, flags=1<<6)
+flags = 1<<6 # v1_only
+if args.v2:
+    flags = 1<<5 # v2_only
+elif args.hybrid:
+    flags = 0
+
+torrent = lt.create_torrent(fs, PIECE_LENGTH, flags=flags)
 torrent.set_creator(creator_name)
 
 if tracker:
     torrent.add_tracker(tracker)
 
-for index, h in enumerate(piece_hash):
-    torrent.set_hash(index, bytes.fromhex(h))
+if args.hybrid or args.v2:
+    set_hashes_from_device(torrent, args.device, args.hybrid)
+else:
+    for index, h in enumerate(piece_hash):
+        torrent.set_hash(index, bytes.fromhex(h))
 
 with open(filename, 'wb') as f:
     f.write(lt.bencode(torrent.generate()))
@@ -0,0 +1,98 @@
+#ifndef __WRITE_ELEVATOR_HPP__
+#define __WRITE_ELEVATOR_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <utility>
+
+#include <boost/core/noncopyable.hpp>
+
+namespace ezio
+{
+// C-SCAN write scheduler for rotational disks. write runs of a storage are
+// sorted by partition offset and written one at a time in sweeps of
+// increasing offset, then wrap to the lowest. blocks stay in write buffer
+// pool while queued, so the pool watermarks still push back on peers.
+class write_elevator : boost::noncopyable
+{
+public:
+	// return true if the caller should post drain_one()
+	bool push(std::int64_t offset, std::int64_t length, std::function<void()> job)
+	{
+		std::lock_guard<std::mutex> l(mutex_);
+		jobs_.emplace(offset, pending{length, std::move(job)});
+		if (draining_) {
+			return false;
+		}
+		draining_ = true;
+		return true;
+	}
+
+	// write the next run of the sweep, new runs are picked up in the same
+	// sweep if they are ahead of the head. return true if more runs are
+	// queued, the caller should post it again.
+	bool drain_one()
+	{
+		std::function<void()> job;
+		{
+			std::lock_guard<std::mutex> l(mutex_);
+			if (jobs_.empty()) {
+				draining_ = false;
+				return false;
+			}
+
+			auto it = jobs_.lower_bound(head_);
+			if (it == jobs_.end()) {
+				// end of sweep, back to the lowest offset
+				it = jobs_.begin();
+				sweeps_++;
+			}
+
+			head_ = it->first + it->second.length;
+			job = std::move(it->second.job);
+			jobs_.erase(it);
+			runs_++;
+		}
+
+		job();
+
+		std::lock_guard<std::mutex> l(mutex_);
+		if (jobs_.empty()) {
+			draining_ = false;
+			return false;
+		}
+		return true;
+	}
+
+	std::int64_t runs() const
+	{
+		return runs_;
+	}
+
+	std::int64_t sweeps() const
+	{
+		return sweeps_;
+	}
+
+private:
+	struct pending {
+		std::int64_t length;
+		std::function<void()> job;
+	};
+
+	std::mutex mutex_;
+	std::multimap<std::int64_t, pending> jobs_;
+	// partition offset after the last write
+	std::int64_t head_{0};
+	bool draining_{false};
+
+	std::atomic<std::int64_t> runs_{0};
+	std::atomic<std::int64_t> sweeps_{0};
+};
+
+}  // namespace ezio
+
+#endif